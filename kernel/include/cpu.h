@@ -135,6 +135,17 @@ static inline bool CpuHasSse()
 	return CpuHasFxSave() && (CpuFeaturesEDX & (1 << 25));
 }
 
+/**
+ * Returns true if the CPU supports SSE4.2
+ *
+ * The only SSE4.2 instruction the kernel uses is @c crc32, which only uses general
+ * purpose registers, so it can be used in kernel mode.
+ */
+static inline bool CpuHasSse42()
+{
+	return (CpuFeaturesECX & (1 << 20));
+}
+
 /**
  * Number of bytes needed to store FPU state with FNSAVE
  */
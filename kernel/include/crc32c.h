@@ -0,0 +1,55 @@
+/**
+ * @file
+ * CRC32C checksums
+ *
+ * Calculates the Castagnoli CRC (polynomial 0x1EDC6F41), which is used to detect
+ * corruption of cached data. The SSE4.2 @c crc32 instruction is used when the
+ * CPU supports it, otherwise a slicing-by-8 table is used.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Util
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include "chaff.h"
+
+/**
+ * Builds the CRC tables and detects the @c crc32 instruction
+ *
+ * @private
+ */
+void INIT Crc32cInit();
+
+/**
+ * Calculates the CRC32C of some data
+ *
+ * Pass 0 as @a crc to start a new checksum, or the result of a previous call to
+ * continue the checksum over more data.
+ *
+ * @param crc previous checksum
+ * @param data data to checksum
+ * @param length length of @a data
+ * @return the new checksum
+ */
+unsigned int Crc32c(unsigned int crc, const void * data, unsigned int length);
+
+#endif /* CRC32C_H_ */
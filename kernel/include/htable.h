@@ -43,9 +43,11 @@
 /** @{ */
 
 /**
- * Initial number of buckets in the table
+ * Initial number of buckets in the table (must be a power of 2)
+ *
+ * These buckets are stored inside the ::HashTable.
  */
-#define HASH_INITIAL_SIZE		1024
+#define HASH_INITIAL_SIZE		4
 
 /**
  * Reference for GROW and SHRINK
@@ -66,6 +68,12 @@
  */
 #define HASH_THRESHOLD_SHRINK	1
 
+/**
+ * Number of old buckets moved into the new bucket array by each operation while
+ * the table is being resized
+ */
+#define HASH_MIGRATE_BUCKETS	8
+
 /** @} */
 
 /**
@@ -98,7 +106,13 @@ typedef struct HashItem
 /**
  * Structure storing data about the entire hash table including buckets
  *
- * This must be cleared to all zeros using MemSet() before use
+ * This must be cleared to all zeros using MemSet() before use and must not be moved
+ * while it contains items.
+ *
+ * When a large table is resized, the old bucket array is kept and its buckets are moved
+ * into the new array a few at a time by later operations on the table. Until this
+ * finishes, items in old buckets below #migrateIndex are in the new array and all
+ * other items are still in the old array.
  */
 typedef struct HashTable
 {
@@ -117,6 +131,26 @@ typedef struct HashTable
 	 */
 	unsigned int itemCount;
 
+	/**
+	 * Bucket array being migrated from (or NULL if the table is not being resized)
+	 */
+	HashItem ** oldBuckets;
+
+	/**
+	 * The number of buckets in #oldBuckets
+	 */
+	unsigned int oldBucketCount;
+
+	/**
+	 * Index of the next bucket in #oldBuckets to be migrated
+	 */
+	unsigned int migrateIndex;
+
+	/**
+	 * Buckets used when the table is small
+	 */
+	HashItem * smallBuckets[HASH_INITIAL_SIZE];
+
 } HashTable;
 
 /**
@@ -191,10 +225,25 @@ void HashTableReserve(HashTable * table, unsigned int count);
 /**
  * Shrinks the hash table if there are very few items in it
  *
+ * Removing items never allocates memory, so tables are not shrunk when items are
+ * removed (or when they are inserted, so that HashTableReserve() is not undone).
+ * This function must be called to return the memory. Removing the last item frees
+ * all the buckets, so empty tables use no memory other than the ::HashTable itself.
+ *
  * @param table hash table to shrink
  */
 void HashTableShrink(HashTable * table);
 
+/**
+ * Frees the memory used by the buckets of a hash table
+ *
+ * The items in the table are not touched. Afterwards the table is empty and can be
+ * used again.
+ *
+ * @param table hash table to free
+ */
+void HashTableFree(HashTable * table);
+
 /**
  * Returns the number of items in the hash table
  */
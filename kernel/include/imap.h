@@ -0,0 +1,166 @@
+/**
+ * @file
+ * Integer keyed hash map
+ *
+ * This file contains an open addressing hash map which maps unsigned integers to
+ * pointers. It is faster than ::HashTable for integer keys since the keys are stored
+ * in the map next to their values, so lookups do not follow pointers to each item
+ * or compare keys through pointers.
+ *
+ * To use it:
+ * - Create an ::IntMap somewhere and wipe it
+ * - Use the manipulation functions to use the map
+ *
+ * Values stored in the map must not be NULL.
+ *
+ * The map uses Robin Hood hashing. When inserting, entries which are further from
+ * their home slot take the slots of entries which are nearer to theirs, which keeps
+ * all probe sequences short and lets unsuccessful lookups stop early. Entries are
+ * removed by shifting the following entries back a slot, so there are no tombstones.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Util
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IMAP_H_
+#define IMAP_H_
+
+#include "chaff.h"
+
+/**
+ * @name Global thresholds and performance adjusters
+ */
+/** @{ */
+
+/**
+ * Initial number of slots in the map (must be a power of 2)
+ */
+#define IMAP_INITIAL_SIZE		8
+
+/**
+ * Reference for GROW and SHRINK
+ */
+#define IMAP_THRESHOLD_REF		8
+
+/**
+ * Threshold required to grow the map
+ *
+ * 7/8 = 87.5% load
+ */
+#define IMAP_THRESHOLD_GROW		7
+
+/**
+ * Threshold required to shrink the map
+ *
+ * 1/8 = 12.5% load
+ */
+#define IMAP_THRESHOLD_SHRINK	1
+
+/** @} */
+
+/**
+ * A slot in an integer map
+ *
+ * @private
+ */
+typedef struct IntMapEntry
+{
+	unsigned int key;		///< Key of this entry
+	void * value;			///< Value of this entry (NULL if the slot is empty)
+
+} IntMapEntry;
+
+/**
+ * Structure storing data about an integer map
+ *
+ * This must be cleared to all zeros using MemSet() before use
+ */
+typedef struct IntMap
+{
+	/**
+	 * Slots of the map
+	 */
+	IntMapEntry * entries;
+
+	/**
+	 * Number of slots in #entries (0 or a power of 2)
+	 */
+	unsigned int capacity;
+
+	/**
+	 * Number of entries in the map
+	 */
+	unsigned int count;
+
+	/**
+	 * Amount to shift hash values right by to get a slot number
+	 */
+	unsigned int shift;
+
+} IntMap;
+
+/**
+ * Inserts an entry into the map
+ *
+ * @param map map to insert into
+ * @param key key of the new entry
+ * @param value value of the new entry (must not be NULL)
+ *
+ * @retval true if the entry was successfully added
+ * @retval false if an entry with that key already exists
+ */
+bool IntMapInsert(IntMap * map, unsigned int key, void * value);
+
+/**
+ * Removes an entry from the map
+ *
+ * @param map map to remove from
+ * @param key key of the entry to remove
+ * @return the value of the removed entry or NULL if there is no entry with that key
+ */
+void * IntMapRemove(IntMap * map, unsigned int key);
+
+/**
+ * Finds an entry in the map
+ *
+ * @param map map to find in
+ * @param key key to find
+ * @return the value with the given key or NULL if there is no entry with that key
+ */
+void * IntMapFind(IntMap * map, unsigned int key);
+
+/**
+ * Frees the memory used by a map
+ *
+ * Afterwards the map is empty and can be used again.
+ *
+ * @param map map to free
+ */
+void IntMapFree(IntMap * map);
+
+/**
+ * Returns the number of entries in the map
+ */
+static inline unsigned int IntMapCount(IntMap * map)
+{
+	return map->count;
+}
+
+#endif /* IMAP_H_ */
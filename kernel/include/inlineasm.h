@@ -94,6 +94,18 @@ static inline void invlpg(void * address)
 	asm volatile("invlpg %0"::"m"(address));
 }
 
+/**
+ * Reads the CPU's time stamp counter
+ *
+ * @return number of cycles since the CPU was reset
+ */
+static inline unsigned long long rdtsc()
+{
+	unsigned long long value;
+	asm volatile("rdtsc":"=A"(value));
+	return value;
+}
+
 /**
  * Load a pointer to the interrupt descriptor table
  *
@@ -132,7 +144,7 @@ static inline void outw(unsigned short port, unsigned short data)
  */
 static inline void outd(unsigned short port, unsigned int data)
 {
-	asm volatile("outd %1, %0"::"Nd"(port), "a"(data));
+	asm volatile("outl %1, %0"::"Nd"(port), "a"(data));
 }
 
 /**
@@ -157,7 +169,7 @@ static inline unsigned char inb(unsigned short port)
 static inline unsigned short inw(unsigned short port)
 {
 	unsigned short data;
-	asm volatile("inb %1, %0":"=a"(data):"Nd"(port));
+	asm volatile("inw %1, %0":"=a"(data):"Nd"(port));
 	return data;
 }
 
@@ -170,7 +182,7 @@ static inline unsigned short inw(unsigned short port)
 static inline unsigned int ind(unsigned short port)
 {
 	unsigned int data;
-	asm volatile("inb %1, %0":"=a"(data):"Nd"(port));
+	asm volatile("inl %1, %0":"=a"(data):"Nd"(port));
 	return data;
 }
 
@@ -29,10 +29,170 @@
 #include "chaff.h"
 #include "list.h"
 #include "htable.h"
+#include "radix.h"
 #include "waitqueue.h"
+#include "timer.h"
+#include "io/blkqueue.h"
 
 struct IoDevice;
 
+/**
+ * @name Cache Limits
+ * @{
+ */
+
+/**
+ * Number of blocks evicted at once when a cache reaches its limit
+ */
+#define IO_BCACHE_EVICT_BATCH 32
+
+/**
+ * Maximum number of bytes used by all block caches together
+ *
+ * Set by IoBlockCacheInit() to a quarter of physical memory.
+ * If this is reached, blocks are evicted from the cache with the oldest unused block.
+ */
+extern unsigned int IoBlockCacheGlobalLimit;
+
+/**
+ * Number of bytes currently used by all block caches
+ */
+extern unsigned int IoBlockCacheGlobalBytes;
+
+/** @} */
+
+/**
+ * @name Write-back Caching
+ *
+ * In write-back mode, writes only modify the cached block which is marked dirty.
+ * The flusher thread writes dirty blocks back to the device when they get old or
+ * when there is too much dirty data.
+ *
+ * @{
+ */
+
+/**
+ * Block cache creation flag enabling write-back mode
+ */
+#define IO_BCACHE_WRITEBACK 1
+
+/**
+ * Number of seconds between each run of the flusher thread
+ */
+#define IO_BCACHE_FLUSH_INTERVAL 1
+
+/**
+ * Number of seconds after which dirty blocks are written back
+ */
+#define IO_BCACHE_DIRTY_EXPIRE 5
+
+/**
+ * Percentage of #IoBlockCacheGlobalLimit which can be dirty before the flusher writes
+ * back blocks regardless of their age
+ */
+#define IO_BCACHE_DIRTY_BACKGROUND_RATIO 10
+
+/**
+ * Percentage of #IoBlockCacheGlobalLimit which can be dirty before writers are throttled
+ * (writers must write back their own blocks)
+ */
+#define IO_BCACHE_DIRTY_RATIO 20
+
+/**
+ * Maximum number of blocks written back in one batch
+ */
+#define IO_BCACHE_FLUSH_BATCH 64
+
+/**
+ * Number of bytes in dirty blocks in all block caches
+ */
+extern unsigned int IoBlockCacheDirtyBytes;
+
+/** @} */
+
+/**
+ * @name Scan-Resistant Caching
+ *
+ * By default, unused blocks are evicted in least recently used order. With the
+ * #IO_BCACHE_ARC flag, the cache uses adaptive replacement (ARC) instead:
+ * blocks used once are kept separately from blocks which have been reused, so a
+ * long sequential scan only evicts other blocks which were used once.
+ *
+ * The offsets of recently evicted blocks are remembered in two ghost lists.
+ * Misses which hit a ghost list adjust the target size of the used-once list.
+ *
+ * @{
+ */
+
+/**
+ * Block cache creation flag enabling adaptive replacement
+ */
+#define IO_BCACHE_ARC 2
+
+/**
+ * Hits within this time of a block being loaded are not counted as reuse (1/16 second)
+ *
+ * This prevents small sequential reads within one block from making it frequent.
+ */
+#define IO_BCACHE_ARC_CORRELATED (((TimerTime) 1) << 28)
+
+/** @} */
+
+/**
+ * @name Compressed Caching
+ *
+ * With the #IO_BCACHE_COMPRESS flag, clean blocks evicted from the cache are
+ * compressed (see lz.h) and kept in a second level cache. A miss checks this cache
+ * before reading from the device and decompresses the block if it is found.
+ *
+ * Only blocks which shrink by at least an eighth are kept. Compressed blocks from
+ * all caches share one limit and the least recently stored are freed first.
+ * Blocks larger than 8KB are never compressed.
+ *
+ * @{
+ */
+
+/**
+ * Block cache creation flag enabling the compressed cache
+ */
+#define IO_BCACHE_COMPRESS 4
+
+/**
+ * Maximum number of bytes used by compressed blocks in all block caches
+ *
+ * Set by IoBlockCacheInit() to a sixteenth of physical memory.
+ */
+extern unsigned int IoBlockCacheZLimit;
+
+/**
+ * Number of bytes currently used by compressed blocks
+ */
+extern unsigned int IoBlockCacheZBytes;
+
+/** @} */
+
+/**
+ * @name Block Checksums
+ *
+ * With the #IO_BCACHE_CHECKSUM flag, a CRC32C checksum (see crc32c.h) of each block
+ * is calculated when the block is read from the device or modified by the cache. The
+ * checksum is verified on each cache hit and before the block is written back, so
+ * corruption of cached data is detected instead of being returned or written to the
+ * device.
+ *
+ * A corrupted block is removed from the cache. Clean blocks are then read again
+ * from the device. The data in corrupted dirty blocks is lost.
+ *
+ * @{
+ */
+
+/**
+ * Block cache creation flag enabling block checksums
+ */
+#define IO_BCACHE_CHECKSUM 8
+
+/** @} */
+
 /**
  * State a block is in
  */
@@ -57,6 +217,102 @@ typedef enum
 
 } IoBlockState;
 
+/**
+ * @name Request Merging
+ *
+ * Runs of contiguous blocks which need reading from or writing to the device are
+ * transferred using a single device request. Reads go through a bounce buffer and
+ * writes are gathered from the blocks (see IoDeviceOps::writev).
+ *
+ * @{
+ */
+
+/**
+ * Maximum size of a merged device request in bytes
+ */
+#define IO_BCACHE_MERGE_MAX (128 * 1024)
+
+/**
+ * Maximum number of blocks in a merged device request
+ */
+#define IO_BCACHE_MERGE_MAX_BLOCKS 64
+
+/** @} */
+
+/**
+ * @name Readahead
+ *
+ * Sequential reads through IoBlockCacheReadBuffer() cause the following blocks to be
+ * read in the background by the readahead thread. The readahead window doubles on each
+ * sequential read and halves on each random read.
+ *
+ * @{
+ */
+
+/**
+ * Initial readahead window in blocks
+ */
+#define IO_BCACHE_RA_MIN 4
+
+/**
+ * Maximum readahead window in bytes
+ */
+#define IO_BCACHE_RA_MAX (128 * 1024)
+
+/**
+ * Maximum readahead window in blocks
+ */
+#define IO_BCACHE_RA_MAX_BLOCKS 64
+
+/**
+ * Maximum number of queued readahead requests
+ */
+#define IO_BCACHE_RA_QUEUE 16
+
+/** @} */
+
+/**
+ * @name Statistics
+ * @{
+ */
+
+/**
+ * Device ioctl which gets the statistics of a block device's cache
+ *
+ * The data argument must point to an IoBlockCacheStats structure which is filled in.
+ */
+#define IO_BCACHE_IOCTL_STATS 0x4201
+
+/** @} */
+
+/**
+ * Block cache statistics
+ */
+typedef struct IoBlockCacheStats
+{
+	unsigned int lookups;				///< Number of blocks looked up for reads
+	unsigned int hits;					///< Number of lookups which found the block in the cache
+	unsigned int misses;				///< Number of lookups which had to read the block from the device
+	unsigned int waits;					///< Number of times a thread waited for a block being read or written
+	unsigned int errors;				///< Number of blocks which could not be read or written
+	unsigned int evictions;				///< Number of blocks evicted to make room for others
+	unsigned int readaheadBlocks;		///< Number of blocks requested by the readahead thread
+	unsigned int ghostHits;				///< Number of misses which were found in a ghost list
+	unsigned int zLookups;				///< Number of misses which checked the compressed cache
+	unsigned int zHits;					///< Number of misses which were found in the compressed cache
+	unsigned int zStores;				///< Number of evicted blocks stored in the compressed cache
+	unsigned int zRejects;				///< Number of evicted blocks which did not compress well enough
+	unsigned long long zBytesIn;		///< Number of bytes in blocks stored in the compressed cache
+	unsigned long long zBytesOut;		///< Number of bytes those blocks were compressed to
+	unsigned int checksumErrors;		///< Number of blocks found to be corrupted
+	unsigned long long bytesRead;		///< Number of bytes read from the device
+	unsigned long long bytesWritten;	///< Number of bytes written to the device
+
+	///Histogram of device request latencies in time stamp counter cycles (see #IO_BLKQ_LATENCY_BUCKETS)
+	unsigned int latency[IO_BLKQ_LATENCY_BUCKETS];
+
+} IoBlockCacheStats;
+
 /**
  * Structure containing information about a block
  */
@@ -68,8 +324,29 @@ typedef struct IoBlock
 	///All blocks list
 	ListHead listItem;
 
-	///Item in block hash table
-	HashItem hItem;
+	///Item in the cache's LRU or frequent list (only used when refCount == 0)
+	ListHead lruItem;
+
+	///Value of the global use counter when this block was last unlocked
+	unsigned int lastUse;
+
+	///Item in the cache's dirty list (only used when dirty is true)
+	ListHead dirtyItem;
+
+	///True if the block has been modified but not written back to the device
+	bool dirty;
+
+	///Time the block became dirty
+	TimerTime dirtyTime;
+
+	///True if the block has been reused (in the frequent list with #IO_BCACHE_ARC)
+	bool frequent;
+
+	///True if the block was read ahead and has not been used yet
+	bool readahead;
+
+	///Time the block was loaded (or first used if it was read ahead)
+	TimerTime loadTime;
 
 	///Block state
 	IoBlockState state;
@@ -89,6 +366,12 @@ typedef struct IoBlock
 	///Address of block data
 	char * address;
 
+	///Shared page containing the block data (NULL if the block does not use a shared page)
+	struct IoBlockBufferPage * bufferPage;
+
+	///Checksum of the block data (only with #IO_BCACHE_CHECKSUM)
+	unsigned int checksum;
+
 } IoBlock;
 
 /**
@@ -96,15 +379,99 @@ typedef struct IoBlock
  */
 typedef struct IoBlockCache
 {
+	///Device the cache belongs to
+	struct IoDevice * device;
+
 	///Size of blocks in cache
 	unsigned int blockSize;
 
-	///Hashtable of blocks (used for lookups)
-	HashTable blockTable;
+	///Cache flags (#IO_BCACHE_WRITEBACK, #IO_BCACHE_ARC, #IO_BCACHE_COMPRESS, #IO_BCACHE_CHECKSUM)
+	int flags;
+
+	///Tree of blocks indexed by block number (used for lookups)
+	RadixTree blockTree;
+
+	///Tree of shared pages used by blocks smaller than a page (see io/blkbuf.h)
+	RadixTree bufferPages;
 
 	///List of all blocks (used for removing all at end)
 	ListHead blockList;
 
+	/**
+	 * List of unreferenced blocks which can be evicted
+	 *
+	 * The least recently used block is at the head of the list.
+	 */
+	ListHead lruList;
+
+	/**
+	 * List of unreferenced blocks which have been reused (only with #IO_BCACHE_ARC)
+	 *
+	 * The least recently used block is at the head of the list.
+	 */
+	ListHead freqList;
+
+	/** @name Adaptive Replacement State @{ */
+	unsigned int recentCount;			///< Number of blocks which have not been reused
+	unsigned int frequentCount;			///< Number of blocks which have been reused
+	unsigned int arcTarget;				///< Target number of blocks which have not been reused
+	ListHead ghostRecent;				///< Offsets of evicted blocks which were not reused
+	ListHead ghostFrequent;				///< Offsets of evicted blocks which were reused
+	unsigned int ghostRecentCount;		///< Number of entries in ghostRecent
+	unsigned int ghostFrequentCount;	///< Number of entries in ghostFrequent
+	HashTable ghostTable;				///< Hashtable of ghost entries
+	/** @} */
+
+	///Tree of compressed blocks indexed by block number (only with #IO_BCACHE_COMPRESS)
+	RadixTree zTree;
+
+	///Item in the global list of block caches
+	ListHead cacheItem;
+
+	///Maximum number of bytes used by this cache (0 = only use the global limit)
+	unsigned int maxBytes;
+
+	///Number of blocks in the cache
+	unsigned int blockCount;
+
+	///List of dirty blocks (the oldest dirty block is at the head of the list)
+	ListHead dirtyList;
+
+	///Number of dirty blocks in the cache
+	unsigned int dirtyCount;
+
+	///Request queue used for all device reads and writes
+	IoBlockQueue queue;
+
+	///Number of write requests which have not completed
+	unsigned int writesInFlight;
+
+	///Wait queue for threads waiting for writes to complete
+	ProcWaitQueue writeWait;
+
+	///Error from a failed write which has not been reported by IoBlockCacheSync() yet
+	int writeError;
+
+	///True while the flusher thread is writing back this cache (it cannot be destroyed)
+	bool flushing;
+
+	///Wait queue for threads waiting for the flusher thread to finish with this cache
+	ProcWaitQueue flushWait;
+
+	/** @name Readahead State @{ */
+	unsigned long long raNext;		///< Offset the next read is expected at if access is sequential
+	unsigned long long raEnd;		///< End of the data which has been read ahead
+	unsigned int raWindow;			///< Current readahead window in blocks (0 = no readahead)
+	/** @} */
+
+	/**
+	 * Cache statistics
+	 *
+	 * The byte counts and latency histogram are kept by the request queue.
+	 * Use IoBlockCacheGetStats() to get all the statistics.
+	 */
+	IoBlockCacheStats stats;
+
 } IoBlockCache;
 
 /**
@@ -117,14 +484,59 @@ void INIT IoBlockCacheInit();
 /**
  * Initializes a block cache
  *
+ * The cache must be stored in the device's blockCache field by the caller.
+ *
+ * @param device device the cache is for
  * @param blockSize size of each block in the cache
+ * @param flags cache flags (#IO_BCACHE_WRITEBACK for a write-back cache and
+ *              #IO_BCACHE_ARC for adaptive replacement, #IO_BCACHE_COMPRESS to keep
+ *              compressed copies of evicted blocks, #IO_BCACHE_CHECKSUM to checksum
+ *              blocks, or 0 for a write-through LRU cache)
  * @return the new block cache or NULL on error
  */
-IoBlockCache * IoBlockCacheCreate(int blockSize);
+IoBlockCache * IoBlockCacheCreate(struct IoDevice * device, int blockSize, int flags);
+
+/**
+ * Registers the block cache statistics device with devfs
+ *
+ * @private
+ */
+void INIT IoBlockCacheStatsInit();
+
+/**
+ * Gets the statistics of a block cache
+ *
+ * @param cache cache to get the statistics of
+ * @param stats structure to store the statistics in
+ */
+void IoBlockCacheGetStats(IoBlockCache * cache, IoBlockCacheStats * stats);
+
+/**
+ * Writes all the dirty blocks of a device back to the device
+ *
+ * Does nothing for write-through caches.
+ *
+ * @param device device to sync
+ * @retval 0 all dirty blocks were written successfully
+ * @retval <0 error code (blocks which could not be written are discarded)
+ */
+int IoBlockCacheSync(struct IoDevice * device);
+
+/**
+ * Sets the maximum size of a block cache
+ *
+ * Unreferenced blocks are evicted immediately if the cache is over the new limit.
+ *
+ * @param cache cache to set the limit of
+ * @param maxBytes maximum number of bytes used by the cache's blocks (0 = no per-cache limit)
+ */
+void IoBlockCacheSetLimit(IoBlockCache * cache, unsigned int maxBytes);
 
 /**
  * Destroies a block cache
  *
+ * Any dirty blocks are written back first.
+ *
  * @param cache cache to destroy
  * @retval true all the blocks in the cache were destroyed
  * @retval false if some blocks were locked (cache not destroied)
@@ -181,6 +593,9 @@ int IoBlockCacheReadBuffer(struct IoDevice * device, unsigned long long off,
 /**
  * Writes data to the block cache and disk
  *
+ * In write-back mode, the data is only written to the block cache.
+ * The caller may be throttled if there is too much dirty data.
+ *
  * @param device device to write to
  * @param off offset within device to write
  * @param buffer buffer to read data from (this can be user mode)
@@ -191,4 +606,37 @@ int IoBlockCacheReadBuffer(struct IoDevice * device, unsigned long long off,
 int IoBlockCacheWriteBuffer(struct IoDevice * device, unsigned long long off,
 		void * buffer, unsigned int length);
 
+/**
+ * Reads data from a device into a memory buffer without caching it
+ *
+ * The data is read straight into the buffer. Dirty cached blocks in the area are
+ * written back first. Requests which are not block aligned are passed to IoBlockCacheReadBuffer().
+ *
+ * @param device device to read from
+ * @param off offset within device to read
+ * @param buffer buffer to read into (this can be user mode)
+ * @param length number of bytes to read
+ * @retval 0 all data read successfully
+ * @retval <0 error code
+ */
+int IoBlockCacheReadDirect(struct IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length);
+
+/**
+ * Writes data from a memory buffer to a device without caching it
+ *
+ * The data is written straight from the buffer. Blocks in the area which are already
+ * cached are updated with the new data. Requests which are not block aligned are passed
+ * to IoBlockCacheWriteBuffer().
+ *
+ * @param device device to write to
+ * @param off offset within device to write
+ * @param buffer buffer to read data from (this can be user mode)
+ * @param length number of bytes to write
+ * @retval 0 all data written successfully
+ * @retval <0 error code
+ */
+int IoBlockCacheWriteDirect(struct IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length);
+
 #endif /* BCACHE_H_ */
@@ -0,0 +1,132 @@
+/**
+ * @file
+ * Block cache buffer allocator
+ *
+ * Allocates the memory used to store the data of cached blocks:
+ * - Blocks smaller than a page are packed into shared pages. All the blocks in one
+ *   page come from the same page sized region of the device, so neighbouring blocks
+ *   are stored next to each other.
+ * - Blocks of exactly one page use a single kernel page.
+ * - Blocks larger than a page use separate (possibly high memory) pages mapped into
+ *   kernel virtual memory, so no contiguous physical memory is needed.
+ *
+ * Drivers which need the physical pages of a buffer can use IoBufferGetPages().
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Io
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IO_BLKBUF_H_
+#define IO_BLKBUF_H_
+
+#include "chaff.h"
+#include "mm/physical.h"
+
+struct IoBlock;
+struct IoBlockCache;
+
+/**
+ * Smallest block size which is packed into shared pages
+ *
+ * Smaller blocks are allocated with MemKAlloc().
+ */
+#define IO_BLKBUF_MIN_PACKED 16
+
+/**
+ * A page shared by blocks smaller than a page
+ *
+ * @private
+ */
+typedef struct IoBlockBufferPage
+{
+	///Region of the device stored in this page (device offset / PAGE_SIZE)
+	unsigned long long region;
+
+	///Address of the page
+	char * address;
+
+	///Number of blocks using the page
+	unsigned int count;
+
+	///Bitmap of the slots in use
+	unsigned int used[PAGE_SIZE / IO_BLKBUF_MIN_PACKED / 32];
+
+} IoBlockBufferPage;
+
+/**
+ * A physically contiguous part of a buffer
+ */
+typedef struct IoPageVec
+{
+	///First physical page
+	MemPhysPage page;
+
+	///Offset of the data within the first page
+	unsigned int offset;
+
+	///Number of bytes (this may continue into the following physical pages)
+	unsigned int length;
+
+} IoPageVec;
+
+/**
+ * Returns the largest number of entries IoBufferGetPages() can use for a buffer of the given length
+ */
+#define IO_PAGEVEC_MAX(length) (((length) + PAGE_SIZE - 1) / PAGE_SIZE + 1)
+
+/**
+ * Initializes the block buffer allocator
+ */
+void INIT IoBlockBufferInit();
+
+/**
+ * Allocates the data buffer of a block
+ *
+ * The block's offset must be set. On return, @c block->address points to the buffer.
+ *
+ * @param bCache block cache the block belongs to
+ * @param block block to allocate buffer for
+ */
+void IoBlockBufferAlloc(struct IoBlockCache * bCache, struct IoBlock * block);
+
+/**
+ * Frees the data buffer of a block
+ *
+ * @param bCache block cache the block belongs to
+ * @param block block to free buffer of
+ */
+void IoBlockBufferFree(struct IoBlockCache * bCache, struct IoBlock * block);
+
+/**
+ * Gets the physical pages used by a kernel buffer
+ *
+ * This works for buffers in directly mapped kernel memory and in kernel virtual
+ * memory (such as block buffers and request bounce buffers).
+ * Physically contiguous pages are merged into one entry.
+ *
+ * @param buffer buffer to get the pages of
+ * @param length length of the buffer
+ * @param vec array of entries to fill
+ * @param max number of entries in @a vec (#IO_PAGEVEC_MAX is always enough)
+ * @return the number of entries used or 0 if @a vec is too small
+ */
+unsigned int IoBufferGetPages(void * buffer, unsigned int length, IoPageVec * vec, unsigned int max);
+
+#endif /* IO_BLKBUF_H_ */
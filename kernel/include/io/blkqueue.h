@@ -0,0 +1,316 @@
+/**
+ * @file
+ * Block device request queues and I/O schedulers
+ *
+ * Requests for block devices are placed into the device's request queue where an
+ * I/O scheduler sorts them. The queue merges contiguous requests and dispatches
+ * them to the driver one at a time. When a request is completed, its completion
+ * function is called.
+ *
+ * Requests must be completed in thread context. The queue is not protected from
+ * interrupts, and completion functions allocate and free memory. Drivers whose
+ * hardware signals completion with an interrupt must wake a thread which calls
+ * IoBlockRequestDone().
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Io
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IO_BLKQUEUE_H_
+#define IO_BLKQUEUE_H_
+
+#include "chaff.h"
+#include "list.h"
+#include "timer.h"
+
+struct IoDevice;
+struct IoBlockQueue;
+struct IoVec;
+
+/**
+ * @name Request Types
+ * @{
+ */
+
+#define IO_BLKQ_READ	0	///< Read data from the device into the buffer
+#define IO_BLKQ_WRITE	1	///< Write data from the buffer to the device
+
+/** @} */
+
+/**
+ * @name Queue Parameters
+ * @{
+ */
+
+/**
+ * Maximum size of a request created by merging other requests in bytes
+ */
+#define IO_BLKQ_MERGE_MAX (128 * 1024)
+
+/**
+ * Time a read request can wait before the deadline scheduler dispatches it (half a second)
+ */
+#define IO_BLKQ_READ_EXPIRE (((TimerTime) 1) << 31)
+
+/**
+ * Time a write request can wait before the deadline scheduler dispatches it (5 seconds)
+ */
+#define IO_BLKQ_WRITE_EXPIRE (((TimerTime) 5) << 32)
+
+/**
+ * Number of buckets in the device latency histogram
+ *
+ * Bucket n counts requests which took between 2^n and 2^(n+1) TSC cycles.
+ */
+#define IO_BLKQ_LATENCY_BUCKETS 40
+
+/** @} */
+
+/**
+ * A request to transfer data to or from a block device
+ */
+typedef struct IoBlockRequest
+{
+	///Item in the scheduler's list of requests
+	ListHead listItem;
+
+	///Item in the scheduler's secondary list (used by the deadline scheduler)
+	ListHead fifoItem;
+
+	///Queue the request was submitted to
+	struct IoBlockQueue * queue;
+
+	///Request type (#IO_BLKQ_READ or #IO_BLKQ_WRITE)
+	int type;
+
+	///Offset within the device
+	unsigned long long off;
+
+	///Buffer to transfer to or from (must be kernel memory)
+	void * buffer;
+
+	/**
+	 * Buffers to gather the data of a write request from (NULL to use buffer)
+	 *
+	 * If this is set, buffer is ignored and the lengths of the buffers must add up to count.
+	 */
+	struct IoVec * vec;
+
+	///Number of buffers in vec
+	unsigned int vecCount;
+
+	///Number of bytes to transfer
+	unsigned int count;
+
+	///Time the request should be dispatched by (set by the scheduler)
+	TimerTime deadline;
+
+	///Time stamp counter when the request was submitted (set by the queue)
+	unsigned long long queueTime;
+
+	///Result of the request (0 or an error code) - valid when complete is called
+	int result;
+
+	///True if the request must not be merged (set by the queue after a merged request fails)
+	bool noMerge;
+
+	/**
+	 * Function called when the request has completed
+	 *
+	 * This is called in thread context (see IoBlockRequestDone()) and must not sleep.
+	 *
+	 * @param request the completed request
+	 */
+	void (* complete)(struct IoBlockRequest * request);
+
+	///Data for use by the submitter
+	void * data;
+
+} IoBlockRequest;
+
+/**
+ * An I/O scheduler which decides the order requests are dispatched in
+ */
+typedef struct IoBlockScheduler
+{
+	///Name of the scheduler
+	const char * name;
+
+	/**
+	 * Adds a request to the queue
+	 *
+	 * @param queue queue to add to
+	 * @param request request to add
+	 */
+	void (* add)(struct IoBlockQueue * queue, IoBlockRequest * request);
+
+	/**
+	 * Chooses the next request to dispatch
+	 *
+	 * The request is not removed from the queue.
+	 *
+	 * @param queue queue to choose from (contains at least one request)
+	 * @return the request to dispatch
+	 */
+	IoBlockRequest * (* next)(struct IoBlockQueue * queue);
+
+} IoBlockScheduler;
+
+/**
+ * A queue of requests for a block device
+ */
+typedef struct IoBlockQueue
+{
+	///Device the queue belongs to
+	struct IoDevice * device;
+
+	///I/O scheduler in use
+	const IoBlockScheduler * sched;
+
+	///List of queued requests (order depends on the scheduler)
+	ListHead requests;
+
+	///Queued requests in submission order, by type (used by the deadline scheduler)
+	ListHead fifo[2];
+
+	///Offset after the end of the last dispatched request
+	unsigned long long headPos;
+
+	///Request currently being handled by the driver
+	IoBlockRequest dispatched;
+
+	///List of submitted requests which were merged into the dispatched request
+	ListHead active;
+
+	///True if the driver is handling a request
+	bool busy;
+
+	///True if the queue is inside its dispatch loop
+	bool dispatching;
+
+	///Number of requests waiting to be dispatched
+	unsigned int queued;
+
+	///Time stamp counter when the current request was dispatched
+	unsigned long long dispatchTime;
+
+	/** @name Statistics @{ */
+	unsigned int submitted;				///< Number of requests submitted
+	unsigned int dispatches;			///< Number of requests sent to the driver
+	unsigned int merges;				///< Number of requests merged into another request
+	unsigned long long bytesRead;		///< Number of bytes successfully read from the device
+	unsigned long long bytesWritten;	///< Number of bytes successfully written to the device
+
+	///Histogram of device request latencies (see #IO_BLKQ_LATENCY_BUCKETS)
+	unsigned int latency[IO_BLKQ_LATENCY_BUCKETS];
+	/** @} */
+
+} IoBlockQueue;
+
+/**
+ * @name I/O Schedulers
+ * @{
+ */
+
+///Dispatches requests in the order they were submitted
+extern const IoBlockScheduler IoBlockSchedNoop;
+
+///Elevator which dispatches requests in order of offset, sweeping across the device
+extern const IoBlockScheduler IoBlockSchedElevator;
+
+///Elevator which also dispatches requests which have waited too long (reads are preferred)
+extern const IoBlockScheduler IoBlockSchedDeadline;
+
+/** @} */
+
+/**
+ * Initializes a request queue
+ *
+ * The deadline scheduler is used by default.
+ *
+ * @param queue queue to initialize
+ * @param device device the queue is for
+ */
+void IoBlockQueueInit(IoBlockQueue * queue, struct IoDevice * device);
+
+/**
+ * Changes the I/O scheduler used by a queue
+ *
+ * @param queue queue to change
+ * @param sched new scheduler
+ * @retval true the scheduler was changed
+ * @retval false the queue contains requests so the scheduler cannot be changed
+ */
+bool IoBlockQueueSetScheduler(IoBlockQueue * queue, const IoBlockScheduler * sched);
+
+/**
+ * Submits a request to a queue
+ *
+ * The type, off, buffer, vec, count, complete and data fields must be set by the caller
+ * (vecCount must also be set if vec is not NULL).
+ * The request must not be modified until it has completed.
+ *
+ * If the device is synchronous (has no submit function), the request may be
+ * completed before this function returns.
+ *
+ * @param queue queue to submit to
+ * @param request request to submit
+ */
+void IoBlockQueueSubmit(IoBlockQueue * queue, IoBlockRequest * request);
+
+/**
+ * Submits a request to a queue and waits for it to complete
+ *
+ * @param queue queue to submit to
+ * @param type request type (#IO_BLKQ_READ or #IO_BLKQ_WRITE)
+ * @param off offset within the device
+ * @param buffer buffer to transfer to or from (must be kernel memory)
+ * @param count number of bytes to transfer
+ * @return the result of the request
+ */
+int IoBlockQueueTransfer(IoBlockQueue * queue, int type, unsigned long long off,
+		void * buffer, unsigned int count);
+
+/**
+ * Records a device request in a queue's statistics
+ *
+ * This is done automatically for requests dispatched by the queue. It only
+ * needs calling for device requests made without using the queue.
+ *
+ * @param queue queue to update
+ * @param type request type (#IO_BLKQ_READ or #IO_BLKQ_WRITE)
+ * @param count number of bytes transferred (0 if the request failed)
+ * @param cycles time the request took in time stamp counter cycles
+ */
+void IoBlockQueueAccount(IoBlockQueue * queue, int type, unsigned int count, unsigned long long cycles);
+
+/**
+ * Called by drivers when a request given to the submit function has completed
+ *
+ * This must be called in thread context, not from an interrupt handler. It updates
+ * the request queue without disabling interrupts and the completion function may
+ * allocate and free memory.
+ *
+ * @param request request which has completed
+ * @param result result of the request (0 or an error code)
+ */
+void IoBlockRequestDone(IoBlockRequest * request, int result);
+
+#endif /* IO_BLKQUEUE_H_ */
@@ -0,0 +1,107 @@
+/**
+ * @file
+ * Block I/O tracing
+ *
+ * Requests passing through the block cache and block device requests record trace
+ * events in a fixed size ring buffer. When the buffer is full, the oldest events are
+ * overwritten. Adding events never blocks and can be done from interrupt handlers.
+ *
+ * The events can be read from the @c blktrace device. Each read removes the events
+ * returned from the buffer (the file offset is ignored). A read returns 0 when there
+ * are no events, so all the waiting events can be saved with @c cat. Events which
+ * were overwritten before being read show up as gaps in the sequence numbers.
+ * Writing @c 0 to the device stops tracing and writing @c 1 restarts it.
+ *
+ * The events are analysed using @c tools/blktrace.py on the host.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Io
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IO_BLKTRACE_H_
+#define IO_BLKTRACE_H_
+
+#include "chaff.h"
+
+struct IoDevice;
+
+/**
+ * Number of events in the ring buffer (must be a power of 2)
+ */
+#define IO_BTRACE_EVENTS 4096
+
+/**
+ * @name Event Flags
+ * @{
+ */
+
+#define IO_BTRACE_CACHE		1	///< Request to the block cache (otherwise a device request)
+#define IO_BTRACE_HIT		2	///< All the blocks were in the cache
+#define IO_BTRACE_MISS		4	///< Some blocks were read from the device
+#define IO_BTRACE_MERGED	8	///< Device request was merged from a number of submitted requests
+#define IO_BTRACE_DIRECT	16	///< Device request bypassed the request queue
+
+/** @} */
+
+/**
+ * A trace event (64 bytes, all little endian)
+ *
+ * Times are time stamp counter values. For block cache events, the issue time is the
+ * same as the queue time.
+ */
+typedef struct IoBlockTraceEvent
+{
+	unsigned int sequence;				///< Event number plus 1 (0 while the event is being written)
+	int result;							///< Result of the request (0 or an error code)
+	unsigned long long queueTime;		///< Time the request was submitted
+	unsigned long long issueTime;		///< Time the request was sent to the driver
+	unsigned long long completeTime;	///< Time the request completed
+	unsigned long long offset;			///< Offset within the device
+	unsigned int length;				///< Number of bytes transferred
+	unsigned char op;					///< #IO_BLKQ_READ or #IO_BLKQ_WRITE
+	unsigned char flags;				///< Event flags
+	unsigned short reserved;			///< Unused (0)
+	char device[16];					///< Device name (truncated)
+
+} IoBlockTraceEvent;
+
+/**
+ * True if events are being recorded
+ */
+extern bool IoBlockTraceEnabled;
+
+/**
+ * Allocates the trace buffer and registers the @c blktrace device
+ *
+ * @private
+ */
+void INIT IoBlockTraceInit();
+
+/**
+ * Records a trace event
+ *
+ * The sequence number and device name are filled in by this function.
+ *
+ * @param device device the event is for
+ * @param event event to record
+ */
+void IoBlockTraceAdd(struct IoDevice * device, IoBlockTraceEvent * event);
+
+#endif /* IO_BLKTRACE_H_ */
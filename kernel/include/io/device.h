@@ -38,6 +38,17 @@
 
 struct IoDevice;
 struct IoBlockCache;
+struct IoBlockRequest;
+
+/**
+ * A buffer which is part of a vectored transfer
+ */
+typedef struct IoVec
+{
+	void * base;			///< Start of the buffer
+	unsigned int length;	///< Length of the buffer in bytes
+
+} IoVec;
 
 /**
  * Device operations implemented by devices
@@ -91,6 +102,22 @@ typedef struct
 	 */
 	int (* write)(struct IoDevice * device, unsigned long long off, void * buffer, unsigned int count);
 
+	/**
+	 * Writes data gathered from a number of buffers to a contiguous area of the device
+	 *
+	 * This is only used by block devices (through the block cache's request queue) and
+	 * only if submit is NULL. If this is NULL, the buffers are copied into one buffer
+	 * and written using write.
+	 *
+	 * @param device device to write to
+	 * @param off offset within the device to write to
+	 * @param vec array of buffers to write (all kernel memory)
+	 * @param vecCount number of buffers in @a vec
+	 * @retval 0 on success
+	 * @retval <0 error code
+	 */
+	int (* writev)(struct IoDevice * device, unsigned long long off, IoVec * vec, unsigned int vecCount);
+
 	/**
 	 * Performs a device-dependent request
 	 *
@@ -103,6 +130,21 @@ typedef struct
 	 */
 	int (* ioctl)(struct IoDevice * device, int request, void * data);
 
+	/**
+	 * Starts an asynchronous block request
+	 *
+	 * This is only used by block devices (through the block cache's request queue).
+	 * The driver must call IoBlockRequestDone() from thread context (never from an
+	 * interrupt handler) when the request has finished, which can be done before this
+	 * returns. Only one request is given to the driver at a time.
+	 *
+	 * If this is NULL, read and write are used synchronously instead.
+	 *
+	 * @param device device to perform the request on
+	 * @param request request to start
+	 */
+	void (* submit)(struct IoDevice * device, struct IoBlockRequest * request);
+
 } IoDeviceOps;
 
 /**
@@ -28,7 +28,7 @@
 
 #include "chaff.h"
 #include "list.h"
-#include "htable.h"
+#include "imap.h"
 #include "io/mode.h"
 
 struct IoINode;
@@ -169,6 +169,37 @@ typedef struct IoFileOps
 	 */
 	int (* readdir)(struct IoFile * file, void * buf, IoDirectoryFiller filler, int count);
 
+	/**
+	 * Reads a page of a regular file into the page cache
+	 *
+	 * If this is implemented, regular files are given a page cache (see io/pagecache.h)
+	 * and reads and writes to them go through the cache instead of using read and write.
+	 * writepage must also be implemented.
+	 *
+	 * Any part of the page after the end of the file should be filled with 0s.
+	 *
+	 * @param file file to read from (the file offset should be ignored)
+	 * @param index index of the page within the file (the page starts at index * PAGE_SIZE)
+	 * @param page kernel buffer of PAGE_SIZE bytes to read into
+	 * @retval 0 on success
+	 * @retval <0 error code
+	 */
+	int (* readpage)(struct IoFile * file, unsigned int index, void * page);
+
+	/**
+	 * Writes a page of a regular file from the page cache
+	 *
+	 * The file should be extended if the data written goes past the end of it.
+	 *
+	 * @param file file to write to (the file offset should be ignored)
+	 * @param index index of the page within the file (the page starts at index * PAGE_SIZE)
+	 * @param page kernel buffer containing the page's data
+	 * @param length number of bytes at the start of the page which are part of the file
+	 * @retval 0 on success
+	 * @retval <0 error code
+	 */
+	int (* writepage)(struct IoFile * file, unsigned int index, void * page, unsigned int length);
+
 } IoFileOps;
 
 /**
@@ -350,12 +381,7 @@ typedef struct IoFilesystem
 	 *
 	 * These are | iNode -> IoFilesystem * | mappings
 	 */
-	HashTable mountPoints;
-
-	/**
-	 * Item in parent's mount table
-	 */
-	HashItem mountItem;
+	IntMap mountPoints;
 
 } IoFilesystem;
 
@@ -66,7 +66,7 @@ typedef struct IoFile
 	/**
 	 * Offset of file pointer within file
 	 */
-	unsigned int off;
+	unsigned long long off;
 
 	/**
 	 * Flags the file was opened with
@@ -95,6 +95,11 @@ typedef struct IoFile
 	 */
 	IoFileOps * ops;
 
+	/**
+	 * Page cache of the file's iNode (NULL if reads and writes are not cached)
+	 */
+	struct IoPageCache * pageCache;
+
 } IoFile;
 
 /**
@@ -165,12 +170,13 @@ typedef struct IoContext
 #define IO_O_EXCL		0x20		///< File must not already exist
 #define IO_O_CLOEXEC	0x40		///< Close file descriptor on exec
 #define IO_O_DIRECTORY	0x80		///< File must be a directory
+#define IO_O_DIRECT		0x100		///< Bypass the page cache (and the block cache for block aligned reads and writes)
 
 /**
  * @}
  */
 
-#define IO_O_ALLFLAGS	0xFF		///< All flags (used for masking)
+#define IO_O_ALLFLAGS	0x1FF		///< All flags (used for masking)
 
 #define IO_O_FDRESERVED	0x01		///< File descriptor slot is reserved @private
 
@@ -0,0 +1,225 @@
+/**
+ * @file
+ * Per-file page cache
+ *
+ * Each regular file whose filesystem implements IoFileOps::readpage has a page
+ * cache containing pages of the file's data. The cache is attached to the iNode
+ * (not the open file) so all files opened on the same iNode share it, and it
+ * is kept after the last file is closed until its pages are evicted.
+ *
+ * Reads are satisfied from cached pages and only missing pages are requested from
+ * the filesystem. Writes update the cached page and are then written through to
+ * the filesystem using IoFileOps::writepage.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Io
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IO_PAGECACHE_H_
+#define IO_PAGECACHE_H_
+
+#include "chaff.h"
+#include "list.h"
+#include "htable.h"
+
+struct IoINode;
+struct IoFile;
+struct IoFilesystem;
+struct IoPageCache;
+
+/**
+ * @name Cache Limits
+ * @{
+ */
+
+/**
+ * Maximum number of pages held by all page caches
+ *
+ * When this is reached, the least recently used page which is not in use is evicted.
+ * Pages are also evicted when physical memory runs out.
+ */
+extern unsigned int IoPageCacheGlobalLimit;
+
+/**
+ * Number of pages currently held by all page caches
+ */
+extern unsigned int IoPageCacheGlobalPages;
+
+/** @} */
+
+/**
+ * A cached page of file data
+ */
+typedef struct IoPage
+{
+	///Item in the global table of pages
+	HashItem hItem;
+
+	///Item in the cache's list of pages
+	ListHead listItem;
+
+	///Item in the global least recently used list
+	ListHead lruItem;
+
+	/**
+	 * Cache the page belongs to (the first part of the page key)
+	 *
+	 * This is NULL if the page has been removed from its cache while in use.
+	 */
+	struct IoPageCache * cache;
+
+	///Index of the page within the file (the second part of the page key)
+	unsigned int index;
+
+	///Kernel address of the page's data
+	void * address;
+
+	///Number of users of the page (pages in use cannot be evicted)
+	unsigned int refCount;
+
+	///True while the page is being read or written by the filesystem
+	bool locked;
+
+	///True if the page contains valid data
+	bool upToDate;
+
+} IoPage;
+
+/**
+ * The page cache of an iNode
+ */
+typedef struct IoPageCache
+{
+	///Item in the global table of caches
+	HashItem hItem;
+
+	///Filesystem of the iNode (the first part of the cache key)
+	struct IoFilesystem * fs;
+
+	///iNode number (the second part of the cache key)
+	unsigned int iNode;
+
+	///Number of open files using the cache
+	unsigned int refCount;
+
+	///Current size of the file
+	unsigned long long size;
+
+	///List of pages in the cache
+	ListHead pageList;
+
+	///Number of pages in the cache
+	unsigned int pageCount;
+
+} IoPageCache;
+
+/**
+ * Initializes the page cache
+ */
+void INIT IoPageCacheInit();
+
+/**
+ * Gets the page cache for an iNode
+ *
+ * The cache is created if it does not exist. If it exists but is not in use and
+ * its size differs from the iNode's size, the cached pages are discarded.
+ *
+ * @param iNode iNode to get the cache of
+ * @return the page cache (release with IoPageCacheRelease())
+ */
+IoPageCache * IoPageCacheGet(struct IoINode * iNode);
+
+/**
+ * Releases a page cache obtained with IoPageCacheGet()
+ *
+ * The cache is freed once it is unused and contains no pages.
+ *
+ * @param cache cache to release
+ */
+void IoPageCacheRelease(IoPageCache * cache);
+
+/**
+ * Reads data from a file using its page cache
+ *
+ * Data is read from @c file->off and the offset is not advanced.
+ *
+ * @param file file to read from (must have a page cache)
+ * @param buffer buffer to read into (may be user mode)
+ * @param count number of bytes to read
+ * @retval >=0 the number of bytes read
+ * @retval <0 error code
+ */
+int IoPageCacheRead(struct IoFile * file, void * buffer, unsigned int count);
+
+/**
+ * Writes data to a file using its page cache
+ *
+ * Data is written to @c file->off (or the end of the file for files opened
+ * with #IO_O_APPEND) and each page is written through to the filesystem.
+ *
+ * @param file file to write to (must have a page cache)
+ * @param buffer buffer to write from (may be user mode)
+ * @param count number of bytes to write
+ * @retval >=0 the number of bytes written
+ * @retval <0 error code
+ */
+int IoPageCacheWrite(struct IoFile * file, void * buffer, unsigned int count);
+
+/**
+ * Updates a page cache after its file has been truncated
+ *
+ * Pages after the new end of the file are discarded and the end of the last page is cleared.
+ *
+ * @param cache cache to update
+ * @param size new size of the file
+ */
+void IoPageCacheTruncate(IoPageCache * cache, unsigned long long size);
+
+/**
+ * Discards all the unused page caches on a filesystem
+ *
+ * This should be called when a filesystem is unmounted.
+ *
+ * @param fs filesystem to discard caches for
+ */
+void IoPageCacheInvalidateFs(struct IoFilesystem * fs);
+
+/**
+ * Gets an up to date page of a file
+ *
+ * The page will not be evicted until it is released with IoPageCacheReleasePage().
+ * This is intended for mapping file pages into memory.
+ *
+ * @param file file to get page of (must have a page cache)
+ * @param index index of the page within the file
+ * @param page returned page
+ * @retval 0 on success
+ * @retval <0 error code returned by the filesystem
+ */
+int IoPageCacheGetPage(struct IoFile * file, unsigned int index, IoPage ** page);
+
+/**
+ * Releases a page obtained with IoPageCacheGetPage()
+ *
+ * @param page page to release
+ */
+void IoPageCacheReleasePage(IoPage * page);
+
+#endif /* IO_PAGECACHE_H_ */
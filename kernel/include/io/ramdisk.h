@@ -0,0 +1,121 @@
+/**
+ * @file
+ * RAM disk block devices
+ *
+ * A RAM disk is a block device whose data is stored in kernel memory. Pages are
+ * allocated when they are first written, so unwritten areas of the disk read as zeros
+ * and use no memory.
+ *
+ * A RAM disk can simulate the timing of a real disk using a profile. Requests then
+ * complete asynchronously (through IoDeviceOps::submit) after the time the profile
+ * gives them. This allows the block cache and request queue to be measured
+ * reproducibly.
+ *
+ * At boot, a RAM disk called @c ram0 is created if the kernel command line contains
+ * a @c ramdisk option or a boot module's command line starts with @c ramdisk.
+ * The options are (separated by spaces):
+ * - @c ramdisk=SIZE - size of the disk (with an optional K or M suffix)
+ * - @c ramdisk.profile=none|ssd|hdd - timing profile to use
+ * - @c ramdisk.latency=US - overrides the profile's per-request latency in microseconds
+ * - @c ramdisk.seek=US - overrides the profile's seek time in microseconds
+ * - @c ramdisk.bandwidth=KB - overrides the profile's bandwidth in KB per second
+ * - @c ramdisk.blocksize=BYTES - block size of the disk's block cache (default 4096)
+ * - @c ramdisk.cache=FLAGS - comma separated block cache flags
+ *   (@c writeback, @c arc, @c compress and @c checksum)
+ *
+ * The contents of a boot module are copied into the disk. If no size is given,
+ * the disk is the size of the module.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Io
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef IO_RAMDISK_H_
+#define IO_RAMDISK_H_
+
+#include "chaff.h"
+#include "multiboot.h"
+
+struct IoDevice;
+
+/**
+ * Timing of a simulated disk
+ *
+ * Each request takes @c latency microseconds plus the time taken to transfer its data at
+ * @c bandwidth. Requests which do not start where the previous request ended take an
+ * extra @c seek microseconds.
+ */
+typedef struct IoRamDiskProfile
+{
+	unsigned int latency;		///< Time taken by every request in microseconds
+	unsigned int seek;			///< Extra time taken by non-sequential requests in microseconds
+	unsigned int bandwidth;		///< Transfer rate in KB per second (0 = unlimited)
+
+} IoRamDiskProfile;
+
+/**
+ * @name Profiles
+ * @{
+ */
+
+///Solid state disk (100us per request, 400MB/s)
+extern const IoRamDiskProfile IoRamDiskProfileSsd;
+
+///Hard disk (8ms seek, 100MB/s)
+extern const IoRamDiskProfile IoRamDiskProfileHdd;
+
+/** @} */
+
+/**
+ * Creates the RAM disk given on the kernel command line or as a boot module
+ *
+ * @param bootInfo multiboot information structure
+ * @private
+ */
+void INIT IoRamDiskInit(multiboot_info_t * bootInfo);
+
+/**
+ * Creates a RAM disk and registers it with devfs
+ *
+ * @param name name of the device
+ * @param size size of the disk in bytes (rounded up to a multiple of the block size)
+ * @param blockSize block size of the disk's block cache
+ * @param cacheFlags block cache flags (see IoBlockCacheCreate())
+ * @param profile timing profile to simulate (NULL for no delays)
+ * @return the new device or NULL on error
+ */
+struct IoDevice * IoRamDiskCreate(const char * name, unsigned int size,
+		unsigned int blockSize, int cacheFlags, const IoRamDiskProfile * profile);
+
+/**
+ * Copies data into a RAM disk without going through its block cache
+ *
+ * This should only be used before the disk is in use.
+ *
+ * @param device RAM disk to copy to
+ * @param off offset within the disk
+ * @param data data to copy
+ * @param length number of bytes to copy
+ * @retval 0 on success
+ * @retval -ENXIO the data does not fit on the disk
+ */
+int IoRamDiskLoad(struct IoDevice * device, unsigned int off, const void * data, unsigned int length);
+
+#endif /* IO_RAMDISK_H_ */
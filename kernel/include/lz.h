@@ -0,0 +1,67 @@
+/**
+ * @file
+ * Fast LZ77 compression
+ *
+ * A byte oriented LZ77 codec designed for speed rather than compression ratio
+ * (similar to LZ4). The compressed data is a series of sequences, each containing
+ * a token byte, some literal bytes and a back reference into the output.
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Util
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include "chaff.h"
+
+/**
+ * Largest amount of data which can be compressed at once
+ */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * Compresses some data
+ *
+ * This uses a global hash table, so it must not be called from interrupt handlers.
+ *
+ * @param input data to compress
+ * @param inLen length of @a input (at most #LZ_MAX_INPUT)
+ * @param output buffer to store compressed data in
+ * @param outMax size of @a output
+ * @return the length of the compressed data or 0 if it does not fit in @a output
+ */
+unsigned int LzCompress(const void * input, unsigned int inLen, void * output, unsigned int outMax);
+
+/**
+ * Decompresses some data
+ *
+ * Corrupted data is detected (and does not cause writes outside @a output).
+ *
+ * @param input compressed data
+ * @param inLen length of @a input
+ * @param output buffer to store decompressed data in
+ * @param outMax size of @a output
+ * @retval >=0 the length of the decompressed data
+ * @retval -1 the data is corrupted or does not fit in @a output
+ */
+int LzDecompress(const void * input, unsigned int inLen, void * output, unsigned int outMax);
+
+#endif /* LZ_H_ */
@@ -261,6 +261,18 @@ bool MemMapPage(void * address, MemPhysPage page);
  */
 MemPhysPage MemUnmapPage(void * address);
 
+/**
+ * Returns the page mapped to the given virtual address
+ *
+ * The address supplied must be in the kernel virtual region (>= 0xF0000000).
+ *
+ * @note Implemented in pageMapping.c
+ *
+ * @param address address to lookup
+ * @return the page which is mapped or INVALID_PAGE if nothing is mapped
+ */
+MemPhysPage MemGetMappedPage(void * address);
+
 /** @} */
 
 #endif
@@ -44,6 +44,13 @@ void INIT MemManagerInit(multiboot_info_t * bootInfo);
  */
 void INIT MemFreeInitPages();
 
+/**
+ * Initializes the virtio memory balloon driver
+ *
+ * Does nothing if there is no balloon device.
+ */
+void INIT MemBalloonInit();
+
 /**
  * Page fault handler
  *
@@ -29,6 +29,7 @@
 #define MM_PHYSICAL_H_
 
 #include "chaff.h"
+#include "list.h"
 
 /**
  * Type used for physical page identifiers
@@ -94,12 +95,78 @@ static inline MemPhysPage MemVirt2Phys(void * addr)
 /** @} */
 
 /**
- * Initializes the physical memory manager zones
+ * @name Deferred Initialization
+ *
+ * The page state table is initialized in sections. Only the first #MEM_INIT_SYNC_PAGES
+ * are initialized during boot. The other sections are initialized by a background thread
+ * or when the allocator first reaches them.
+ *
+ * @{
+ */
+
+/**
+ * Number of pages in each section of the page state table
+ */
+#define MEM_INIT_SECTION_PAGES 1024
+
+/**
+ * Number of pages initialized during boot (covers #MEM_DMA and the start of #MEM_KERNEL)
+ */
+#define MEM_INIT_SYNC_PAGES 0x2000
+
+/**
+ * Maximum number of ranges which can be passed to MemPhysicalReserve()
+ */
+#define MEM_MAX_RESERVED_RANGES 128
+
+/**
+ * Bitmap of initialized sections
+ *
+ * @private
+ */
+extern unsigned int MemPhysicalSectionsReady[];
+
+/**
+ * Returns true if the section containing the given page has been initialized
+ *
+ * Uninitialized pages must not be used at all (not even to read the reference count).
+ *
+ * @param page page to check
+ */
+static inline bool MemPhysicalIsReady(MemPhysPage page)
+{
+	unsigned int section = page / MEM_INIT_SECTION_PAGES;
+	return MemPhysicalSectionsReady[section / 32] & (1 << (section % 32));
+}
+
+/**
+ * Marks a range of pages as reserved
+ *
+ * The range is allocated when its sections are initialized.
+ * Must be called before MemPhysicalInit().
+ *
+ * @param start first page to reserve
+ * @param end page after the last page to reserve
+ * @private
+ */
+void INIT MemPhysicalReserve(MemPhysPage start, MemPhysPage end);
+
+/**
+ * Initializes the physical memory manager zones and the first sections of the page state table
  *
  * @private
  */
 void INIT MemPhysicalInit();
 
+/**
+ * Starts the thread which initializes the rest of the page state table
+ *
+ * @private
+ */
+void INIT MemPhysicalInitLate();
+
+/** @} */
+
 /**
  * Allocates normal physical pages
  *
@@ -152,10 +219,13 @@ extern unsigned int MemPhysicalTotalPages;
 
 /**
  * Number of free pages in RAM
+ *
+ * This only includes pages in initialized sections of the page state table.
  */
 extern unsigned int MemPhysicalFreePages;
 
 struct MemSlab;
+struct MemContext;
 
 /**
  * Memory page status structure
@@ -169,10 +239,39 @@ typedef struct MemPage
 	 */
 	unsigned int refCount;
 
+	union
+	{
+		/**
+		 * SLAB associated with this page (only used when page is part of a slab)
+		 */
+		struct MemSlab * slab;
+
+		/**
+		 * Memory context this page is mapped into (only valid if #owned is set)
+		 */
+		struct MemContext * owner;
+	};
+
+	/**
+	 * Virtual page number the page is mapped to in #owner (only valid if #owned is set)
+	 */
+	unsigned int ownerPage		: 20;
+
 	/**
-	 * SLAB associated with this page (only used when page is part of a slab)
+	 * 1 if this is a user page mapped into exactly one context
+	 *
+	 * Pages with an owner can be moved by the memory compactor.
 	 */
-	struct MemSlab * slab;
+	unsigned int owned			: 1;
+
+	/**
+	 * Number of working set scans since this page was last accessed
+	 *
+	 * Saturates at #MEM_IDLE_AGE_MAX. Only maintained for pages with an owner.
+	 */
+	unsigned int idleAge		: 8;
+
+	unsigned int /* unused */	: 3;
 
 } MemPage;
 
@@ -197,4 +296,173 @@ static inline unsigned int MemPhysicalRefCount(MemPhysPage page)
 	return MemPageStateTable[page].refCount;
 }
 
+/**
+ * Sets the owner of a user page
+ *
+ * The owner is only recorded if the page is mapped into one context only.
+ *
+ * @param page page to set the owner of
+ * @param context context the page has been mapped into
+ * @param address virtual address the page has been mapped to
+ */
+static inline void MemPhysicalSetOwner(MemPhysPage page, struct MemContext * context, void * address)
+{
+	MemPage * state = &MemPageStateTable[page];
+
+	if(state->refCount == 1)
+	{
+		state->owner = context;
+		state->ownerPage = ((unsigned int) address) / PAGE_SIZE;
+		state->owned = 1;
+	}
+	else
+	{
+		state->owned = 0;
+	}
+}
+
+/**
+ * Clears the owner of a user page
+ *
+ * This must be called when a page becomes shared between contexts.
+ *
+ * @param page page to clear the owner of
+ */
+static inline void MemPhysicalClearOwner(MemPhysPage page)
+{
+	MemPageStateTable[page].owned = 0;
+}
+
+/**
+ * @name Memory Pressure
+ *
+ * Shrinkers are called by MemPhysicalAlloc() when it runs out of memory
+ * to give pages back to the physical memory manager.
+ *
+ * @{
+ */
+
+/**
+ * A function which frees memory when the system is under memory pressure
+ */
+typedef struct MemShrinker
+{
+	ListHead listItem;		///< Item in the list of shrinkers
+
+	/**
+	 * Frees some memory
+	 *
+	 * This can be called from any context (including while other allocations are in progress)
+	 * so it must not allocate memory or sleep.
+	 *
+	 * @param pages number of pages wanted
+	 * @return number of pages which were freed
+	 */
+	unsigned int (* shrink)(unsigned int pages);
+
+} MemShrinker;
+
+/**
+ * Registers a shrinker
+ *
+ * @param shrinker shrinker to register (this must stay allocated until unregistered)
+ */
+void MemShrinkerRegister(MemShrinker * shrinker);
+
+/**
+ * Unregisters a shrinker
+ *
+ * @param shrinker shrinker to unregister
+ */
+void MemShrinkerUnregister(MemShrinker * shrinker);
+
+/**
+ * Calls the registered shrinkers until the given number of pages have been freed
+ *
+ * @param pages number of pages wanted
+ * @return number of pages which were freed
+ */
+unsigned int MemPhysicalShrink(unsigned int pages);
+
+/** @} */
+
+/**
+ * @name Compaction
+ *
+ * The compactor recovers contiguous ranges of free memory by moving user pages
+ * (pages with an owner) out of the way.
+ *
+ * @{
+ */
+
+/**
+ * Largest run of free pages the background compactor tries to keep available in each zone
+ */
+#define MEM_COMPACT_TARGET 1024
+
+/**
+ * Maximum number of pages moved by the background compactor in each pass
+ */
+#define MEM_COMPACT_BATCH 256
+
+/**
+ * Number of seconds between each background compaction pass
+ */
+#define MEM_COMPACT_INTERVAL 5
+
+/**
+ * Starts the background compactor thread
+ *
+ * @private
+ */
+void INIT MemCompactInit();
+
+/**
+ * Attempts to create a run of free pages by moving pages out of the way
+ *
+ * This is called automatically by MemPhysicalAlloc() when it fails to find enough
+ * contiguous memory.
+ *
+ * @param number number of contiguous pages required
+ * @param zone zone to create the free pages in (lower zones are not searched)
+ * @param maxMoves maximum number of pages to move
+ * @retval true a run of free pages was created (or one already existed)
+ * @retval false the compactor could not create the run
+ */
+bool MemPhysicalCompact(unsigned int number, int zone, unsigned int maxMoves);
+
+/**
+ * Returns the length of the largest run of free pages in a zone
+ *
+ * @param zone zone to search
+ * @return number of pages in the largest run
+ */
+unsigned int MemPhysicalLargestFree(int zone);
+
+/**
+ * Gets the range of pages in a zone
+ *
+ * @param[in] zone zone to get the range of
+ * @param[out] start first page in the zone
+ * @param[out] end page after the last page in the zone
+ * @retval true on success
+ * @retval false if the zone does not exist
+ * @private
+ */
+bool PRIVATE MemPhysicalGetZone(int zone, MemPhysPage * start, MemPhysPage * end);
+
+/**
+ * Allocates a page in a zone or one of the zones above it
+ *
+ * Higher zones are searched first. Unlike MemPhysicalAlloc(), this never searches
+ * zones below @a zone, never shrinks caches and does not panic when out of memory.
+ *
+ * @param zone lowest zone the page can be allocated from
+ * @return the allocated page or INVALID_PAGE if there are no free pages
+ * @private
+ */
+MemPhysPage PRIVATE MemPhysicalAllocAbove(int zone);
+
+/** @} */
+
 #endif
@@ -49,6 +49,45 @@ typedef enum MemRegionFlags
 
 struct MemContext;
 
+/**
+ * @name Working set estimation
+ *
+ * The working set scanner periodically samples and clears the accessed bits of all
+ * user pages to estimate how much memory each context is actively using.
+ *
+ * @{
+ */
+
+/**
+ * Number of seconds between each working set scan
+ */
+#define MEM_WSS_INTERVAL 1
+
+/**
+ * Pages accessed within this many scans are part of the working set
+ */
+#define MEM_WSS_WINDOW 4
+
+/**
+ * Pages not accessed for this many scans are cold
+ */
+#define MEM_WSS_COLD_AGE 64
+
+/**
+ * Maximum idle age of a page (see MemPage::idleAge)
+ */
+#define MEM_IDLE_AGE_MAX 255
+
+/**
+ * Number of buckets in a region's idle age histogram
+ *
+ * Bucket 0 counts pages accessed during the last scan.
+ * Bucket n counts pages with an idle age between 2^(n-1) and 2^n - 1.
+ */
+#define MEM_IDLE_BUCKETS 9
+
+/** @} */
+
 /**
  * A region of virtual memory which some properties are applied to
  */
@@ -63,6 +102,15 @@ typedef struct MemRegion
 	unsigned int start;				///< Pointer to start of region
 	unsigned int length;			///< Length of region in pages
 
+	/**
+	 * Histogram of the idle ages of the resident pages in this region
+	 *
+	 * Shared pages are not included.
+	 *
+	 * Updated by the working set scanner (see #MEM_IDLE_BUCKETS).
+	 */
+	unsigned int idleHistogram[MEM_IDLE_BUCKETS];
+
 } MemRegion;
 
 /**
@@ -75,6 +123,16 @@ typedef struct MemContext
 
 	unsigned int refCount;			///< Memory context reference counter
 
+	ListHead contextItem;			///< Item in list of all user contexts
+
+	unsigned int wssPages;			///< Pages accessed within the last #MEM_WSS_WINDOW scans
+	unsigned int coldPages;			///< Pages not accessed for at least #MEM_WSS_COLD_AGE scans
+	unsigned int sharedPages;		///< Resident pages shared with other contexts (not aged)
+
+	unsigned int rssPages;			///< Number of user pages mapped into this context
+	unsigned int maxRssPages;		///< Peak value of rssPages
+	unsigned int tablePages;		///< Number of page tables allocated for this context
+
 } MemContext;
 
 /**
@@ -182,6 +240,30 @@ void MemRegionResize(MemRegion * region, unsigned int newLength);
  */
 void MemRegionDelete(MemRegion * region);
 
+/**
+ * Scans the pages of a context and updates its working set information
+ *
+ * This clears the accessed bits of all the pages in the context.
+ * The working set scanner thread calls this on every context periodically.
+ *
+ * @param context context to scan (not the kernel context)
+ */
+void MemWorkingSetScan(MemContext * context);
+
+/**
+ * Starts the working set scanner thread
+ *
+ * @private
+ */
+void INIT MemWorkingSetInit();
+
+/**
+ * List of all user memory contexts
+ *
+ * @private
+ */
+extern ListHead MemContextList;
+
 /**
  * Kernel context data pointer
  *
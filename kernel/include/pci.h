@@ -0,0 +1,101 @@
+/**
+ * @file
+ * PCI configuration space access
+ *
+ * @date October 2012
+ * @author James Cowgill
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PCI_H_
+#define PCI_H_
+
+#include "chaff.h"
+
+/**
+ * Address of a PCI function (bus, device and function number)
+ *
+ * This is packed in the same way as the PCI configuration address register.
+ */
+typedef unsigned int PciAddress;
+
+/**
+ * Creates a PCI address
+ *
+ * @param bus bus number (0 - 255)
+ * @param dev device number (0 - 31)
+ * @param func function number (0 - 7)
+ */
+#define PCI_ADDRESS(bus, dev, func) (((bus) << 16) | ((dev) << 11) | ((func) << 8))
+
+/**
+ * Returned by PciFindDevice() if no device was found
+ */
+#define PCI_INVALID_ADDRESS 0xFFFFFFFF
+
+/**
+ * @name Configuration Space Registers
+ * @{
+ */
+
+#define PCI_REG_ID				0x00	///< Vendor ID (low) and device ID (high)
+#define PCI_REG_COMMAND			0x04	///< Command register (low) and status register (high)
+#define PCI_REG_CLASS			0x08	///< Revision and class codes
+#define PCI_REG_HEADER			0x0C	///< Cache line size, latency timer, header type and BIST
+#define PCI_REG_BAR0			0x10	///< First base address register
+#define PCI_REG_INTERRUPT		0x3C	///< Interrupt line (low byte) and interrupt pin
+
+#define PCI_COMMAND_IO			0x01	///< Enables IO space accesses
+#define PCI_COMMAND_MEMORY		0x02	///< Enables memory space accesses
+#define PCI_COMMAND_MASTER		0x04	///< Enables bus mastering (DMA)
+
+#define PCI_BAR_IO				0x01	///< Set in a base address register if it refers to IO space
+
+/** @} */
+
+/**
+ * Reads a 32-bit value from PCI configuration space
+ *
+ * @param addr address of the PCI function
+ * @param reg register to read (must be 4 byte aligned)
+ * @return the value of the register (0xFFFFFFFF if the function doesn't exist)
+ */
+unsigned int PciConfigRead(PciAddress addr, unsigned int reg);
+
+/**
+ * Writes a 32-bit value to PCI configuration space
+ *
+ * @param addr address of the PCI function
+ * @param reg register to write (must be 4 byte aligned)
+ * @param value value to write
+ */
+void PciConfigWrite(PciAddress addr, unsigned int reg, unsigned int value);
+
+/**
+ * Finds a PCI function with the given vendor and device id
+ *
+ * @param vendor vendor id to search for
+ * @param device device id to search for
+ * @param start address to start searching from (use 0 for the first search or the
+ *              previous result + PCI_ADDRESS(0, 0, 1) to continue a search)
+ * @retval PCI_INVALID_ADDRESS if no more functions were found
+ * @retval address the address of the function
+ */
+PciAddress PciFindDevice(unsigned short vendor, unsigned short device, PciAddress start);
+
+#endif
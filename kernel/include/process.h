@@ -27,7 +27,6 @@
 #define PROCESS_H_
 
 #include "list.h"
-#include "htable.h"
 #include "interrupt.h"
 #include "signalNums.h"
 #include "secContext.h"
@@ -76,6 +75,29 @@ typedef struct ProcSigaction
 
 } ProcSigaction;
 
+/**
+ * Memory usage and page fault counters for a thread or process
+ *
+ * Returned by ProcGetUsage()
+ */
+typedef struct ProcUsage
+{
+	/** @name Fault Counters @{ */
+	unsigned int minorFaults;		///< Total number of page faults resolved without IO
+	unsigned int zeroFillFaults;	///< Faults which mapped a new zeroed page
+	unsigned int cowCopyFaults;		///< Copy-on-write faults which copied the page
+	unsigned int cowReuseFaults;	///< Copy-on-write faults which reused the page (no other references)
+	unsigned int forkSharedPages;	///< Pages shared with child processes by ProcFork()
+	/** @} */
+
+	/** @name Memory Usage (pages) @{ */
+	unsigned int rssPages;			///< Resident user pages (0 for threads and children)
+	unsigned int maxRssPages;		///< Peak number of resident user pages
+	unsigned int tablePages;		///< Page table pages (0 for threads and children)
+	/** @} */
+
+} ProcUsage;
+
 /**
  * A process on the system, containing a memory context, IO context and a number of threads
  */
@@ -86,11 +108,6 @@ typedef struct ProcProcess
 	 */
 	unsigned int pid;
 
-	/**
-	 * Item in the process hash map
-	 */
-	HashItem hItem;
-
 	/** @name Process Relationships @{ */
 	struct ProcProcess * parent;	///< Parent process
 	ListHead processSibling;		///< Entry in the sibling list
@@ -147,6 +164,16 @@ typedef struct ProcProcess
 	 */
 	ListHead * alarmPtr;
 
+	/**
+	 * Counters of threads in this process which have been reaped
+	 */
+	ProcUsage usage;
+
+	/**
+	 * Counters of child processes which have been reaped
+	 */
+	ProcUsage childUsage;
+
 } ProcProcess;
 
 /**
@@ -159,11 +186,6 @@ typedef struct ProcThread
 	 */
 	unsigned int tid;
 
-	/**
-	 * Hash map item
-	 */
-	HashItem hItem;
-
 	/**
 	 * Parent process
 	 */
@@ -230,6 +252,11 @@ typedef struct ProcThread
 	 */
 	ListHead waitQueue;
 
+	/**
+	 * Page fault counters for this thread
+	 */
+	ProcUsage usage;
+
 } ProcThread;
 
 /**
@@ -438,6 +465,37 @@ int ProcWaitProcess(int id, unsigned int * exitCode, int options);
  */
 int ProcWaitThread(int id, unsigned int * exitCode, int options);
 
+/**
+ * @name Resource Usage
+ * @{
+ */
+
+#define PROC_USAGE_SELF		0	///< Usage of the current process (all threads)
+#define PROC_USAGE_CHILDREN	-1	///< Usage of all reaped children of the current process
+#define PROC_USAGE_THREAD	1	///< Usage of the current thread
+
+/**
+ * Gets the memory usage and page fault counters of the current process
+ *
+ * @param[in] who which counters to get (one of the PROC_USAGE_ constants)
+ * @param[out] usage pointer to place to write the counters to (must be kernel mode)
+ * @retval 0 on success
+ * @retval -EINVAL if @a who is invalid
+ */
+int ProcGetUsage(int who, ProcUsage * usage);
+
+/**
+ * Gets the memory usage and page fault counters of any process
+ *
+ * This is the same as ProcGetUsage() with #PROC_USAGE_SELF but for the given process.
+ *
+ * @param[in] process process to get the counters of
+ * @param[out] usage pointer to place to write the counters to (must be kernel mode)
+ */
+void ProcGetProcessUsage(ProcProcess * process, ProcUsage * usage);
+
+/** @} */
+
 /**
  * Kernel process data pointer
  *
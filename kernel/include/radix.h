@@ -0,0 +1,178 @@
+/**
+ * @file
+ * Radix tree implementation
+ *
+ * This file contains a radix tree which maps 64-bit integer indexes to pointers.
+ * Lookups take time proportional to the height of the tree (which only depends on
+ * the largest index stored) and the tree never needs to be rehashed. Items can
+ * also be found in index order.
+ *
+ * To use it:
+ * - Create a ::RadixTree somewhere and wipe it
+ * - Use the manipulation functions to use the tree
+ *
+ * @date October 2012
+ * @author James Cowgill
+ * @ingroup Util
+ */
+
+/*
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef RADIX_H_
+#define RADIX_H_
+
+#include "chaff.h"
+
+/**
+ * @name Tree parameters
+ * @{
+ */
+
+/**
+ * Number of index bits used by each level of the tree
+ */
+#define RADIX_MAP_SHIFT		6
+
+/**
+ * Number of slots in each node
+ */
+#define RADIX_MAP_SIZE		(1 << RADIX_MAP_SHIFT)
+
+/**
+ * Mask for the slot number at each level
+ */
+#define RADIX_MAP_MASK		(RADIX_MAP_SIZE - 1)
+
+/** @} */
+
+/**
+ * A node in a radix tree
+ *
+ * @private
+ */
+typedef struct RadixNode
+{
+	///Parent of this node (NULL for the root)
+	struct RadixNode * parent;
+
+	///Slot in the parent which contains this node
+	unsigned int offset;
+
+	///Number of used slots
+	unsigned int count;
+
+	///Child nodes or items (on the bottom level)
+	void * slots[RADIX_MAP_SIZE];
+
+} RadixNode;
+
+/**
+ * Structure storing data about an entire radix tree
+ *
+ * This must be cleared to all zeros using MemSet() before use
+ */
+typedef struct RadixTree
+{
+	/**
+	 * Root node of the tree (NULL if the tree is empty)
+	 */
+	RadixNode * root;
+
+	/**
+	 * Number of levels in the tree
+	 */
+	unsigned int height;
+
+	/**
+	 * The number of items in the tree
+	 */
+	unsigned int itemCount;
+
+} RadixTree;
+
+/**
+ * Inserts an item into a radix tree
+ *
+ * @param tree tree to insert into
+ * @param index index to insert the item at
+ * @param item item to insert (must not be NULL)
+ *
+ * @retval true if the item was successfully added
+ * @retval false if an item already exists at that index
+ */
+bool RadixTreeInsert(RadixTree * tree, unsigned long long index, void * item);
+
+/**
+ * Removes an item from a radix tree
+ *
+ * @param tree tree to remove from
+ * @param index index of the item to remove
+ * @return the item which was removed or NULL if there was no item at that index
+ */
+void * RadixTreeRemove(RadixTree * tree, unsigned long long index);
+
+/**
+ * Finds an item in a radix tree
+ *
+ * @param tree tree to search
+ * @param index index of the item to find
+ * @return the item or NULL if there is no item at that index
+ */
+void * RadixTreeFind(RadixTree * tree, unsigned long long index);
+
+/**
+ * Finds the first item in a radix tree with an index greater than or equal to the one given
+ *
+ * @param tree tree to search
+ * @param index on entry, the index to start searching from. On return, the index
+ *        of the item found (not modified if nothing was found).
+ * @return the item or NULL if there are no more items
+ */
+void * RadixTreeNext(RadixTree * tree, unsigned long long * index);
+
+/**
+ * Finds a number of items in index order
+ *
+ * @param tree tree to search
+ * @param first index to start searching from
+ * @param items array to store the items found in
+ * @param max maximum number of items to find
+ * @return the number of items found
+ */
+unsigned int RadixTreeGangFind(RadixTree * tree, unsigned long long first, void ** items, unsigned int max);
+
+/**
+ * Frees all the nodes in a radix tree
+ *
+ * The items themselves are not freed. The tree is empty afterwards.
+ *
+ * @param tree tree to clear
+ */
+void RadixTreeClear(RadixTree * tree);
+
+/**
+ * Returns the number of items in a radix tree
+ *
+ * @param tree tree to count
+ * @return number of items
+ */
+static inline unsigned int RadixTreeCount(RadixTree * tree)
+{
+	return tree->itemCount;
+}
+
+#endif /* RADIX_H_ */
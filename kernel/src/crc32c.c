@@ -0,0 +1,152 @@
+/*
+ * crc32c.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "cpu.h"
+#include "crc32c.h"
+
+//Reversed CRC32C polynomial
+#define CRC32C_POLY 0x82F63B78
+
+//Slicing-by-8 tables
+// crcTable[0] is the normal byte table, crcTable[n] gives the CRC of a byte followed by n zero bytes
+static unsigned int crcTable[8][256];
+
+//True if the crc32 instruction is available
+static bool crcHardware;
+
+//Builds the CRC tables and detects the crc32 instruction
+void INIT Crc32cInit()
+{
+	for(unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int crc = i;
+
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		}
+
+		crcTable[0][i] = crc;
+	}
+
+	for(unsigned int i = 0; i < 256; i++)
+	{
+		for(int n = 1; n < 8; n++)
+		{
+			unsigned int prev = crcTable[n - 1][i];
+			crcTable[n][i] = (prev >> 8) ^ crcTable[0][prev & 0xFF];
+		}
+	}
+
+	crcHardware = CpuHasSse42();
+}
+
+//Reads 4 bytes (x86 allows unaligned reads)
+static inline unsigned int CrcRead32(const unsigned char * ptr)
+{
+	unsigned int value;
+	MemCpy(&value, ptr, 4);
+	return value;
+}
+
+//CRC using the crc32 instruction
+// The main loop is unrolled since each crc32 depends on the previous one
+static unsigned int CrcHardware(unsigned int crc, const unsigned char * ptr, unsigned int length)
+{
+	//Align to 4 bytes
+	while(length > 0 && ((unsigned int) ptr & 3) != 0)
+	{
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*ptr));
+		ptr++;
+		length--;
+	}
+
+	while(length >= 16)
+	{
+		asm("crc32l %1, %0\n\t"
+			"crc32l %2, %0\n\t"
+			"crc32l %3, %0\n\t"
+			"crc32l %4, %0"
+			: "+r" (crc)
+			: "rm" (CrcRead32(ptr)), "rm" (CrcRead32(ptr + 4)),
+			  "rm" (CrcRead32(ptr + 8)), "rm" (CrcRead32(ptr + 12)));
+
+		ptr += 16;
+		length -= 16;
+	}
+
+	while(length >= 4)
+	{
+		asm("crc32l %1, %0" : "+r" (crc) : "rm" (CrcRead32(ptr)));
+		ptr += 4;
+		length -= 4;
+	}
+
+	while(length > 0)
+	{
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*ptr));
+		ptr++;
+		length--;
+	}
+
+	return crc;
+}
+
+//CRC using slicing-by-8 tables
+static unsigned int CrcSoftware(unsigned int crc, const unsigned char * ptr, unsigned int length)
+{
+	while(length >= 8)
+	{
+		unsigned int low = CrcRead32(ptr) ^ crc;
+		unsigned int high = CrcRead32(ptr + 4);
+
+		crc = crcTable[7][low & 0xFF] ^ crcTable[6][(low >> 8) & 0xFF] ^
+			crcTable[5][(low >> 16) & 0xFF] ^ crcTable[4][low >> 24] ^
+			crcTable[3][high & 0xFF] ^ crcTable[2][(high >> 8) & 0xFF] ^
+			crcTable[1][(high >> 16) & 0xFF] ^ crcTable[0][high >> 24];
+
+		ptr += 8;
+		length -= 8;
+	}
+
+	while(length > 0)
+	{
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *ptr) & 0xFF];
+		ptr++;
+		length--;
+	}
+
+	return crc;
+}
+
+//Calculates the CRC32C of some data
+unsigned int Crc32c(unsigned int crc, const void * data, unsigned int length)
+{
+	if(crcHardware)
+	{
+		return ~CrcHardware(~crc, data, length);
+	}
+	else
+	{
+		return ~CrcSoftware(~crc, data, length);
+	}
+}
@@ -24,57 +24,272 @@
 #include "mm/kmemory.h"
 
 //Generic Variable-Sized Hash Table
+// The number of buckets is always a power of 2 so buckets are selected by masking
+// the hash value instead of dividing it.
 //
+// Tables with HASH_INITIAL_SIZE buckets use the bucket array inside the HashTable, so
+// small tables do not allocate any memory. Larger arrays up to 8KB are allocated
+// with MemKAlloc and the rest with MemVirtualAlloc.
 
-//Resizes an existing hash table
-static void HashTableResize(HashTable * table, unsigned int newSize)
+//Largest bucket array allocated with MemKAlloc
+#define HASH_KALLOC_MAX (8 << 10)
+
+//Allocates a wiped bucket array
+static HashItem ** HashTableAllocBuckets(HashTable * table, unsigned int size)
 {
-	//Ignore size 0
-	if(newSize == 0)
+	if(size == HASH_INITIAL_SIZE)
 	{
-		return;
+		MemSet(table->smallBuckets, 0, sizeof(table->smallBuckets));
+		return table->smallBuckets;
+	}
+	else if(size * sizeof(HashItem *) <= HASH_KALLOC_MAX)
+	{
+		return MemKZAlloc(size * sizeof(HashItem *));
 	}
+	else
+	{
+		return MemVirtualZAlloc(size * sizeof(HashItem *));
+	}
+}
 
-	//Allocate new bucket table and wipe it
-	HashItem ** buckets = MemVirtualZAlloc(sizeof(HashItem *) * newSize);
+//Frees a bucket array
+static void HashTableFreeBuckets(HashTable * table, HashItem ** buckets, unsigned int size)
+{
+	if(buckets == table->smallBuckets)
+	{
+		return;
+	}
+	else if(size * sizeof(HashItem *) <= HASH_KALLOC_MAX)
+	{
+		MemKFree(buckets);
+	}
+	else
+	{
+		MemVirtualFree(buckets);
+	}
+}
 
-	//Re-add all items to buckets
-	for(unsigned int i = 0; i < table->bucketCount; i++)
+//Moves some buckets from the old bucket array into the new one
+// The old array is freed once all its buckets have been moved
+static void HashTableMigrateBuckets(HashTable * table, unsigned int count)
+{
+	while(count-- > 0 && table->migrateIndex < table->oldBucketCount)
 	{
-		HashItem * currItem = table->buckets[i];
+		HashItem * currItem = table->oldBuckets[table->migrateIndex];
 		HashItem * nextItem;
 
+		table->oldBuckets[table->migrateIndex++] = NULL;
+
 		while(currItem)
 		{
 			//Get next item (temp)
 			nextItem = currItem->next;
 
 			//Store in new bucket
-			unsigned int bucketID = currItem->hashValue % newSize;
-			currItem->next = buckets[bucketID];
-			buckets[bucketID] = currItem;
+			unsigned int bucketID = currItem->hashValue & (table->bucketCount - 1);
+			currItem->next = table->buckets[bucketID];
+			table->buckets[bucketID] = currItem;
 
 			//Advance pointer
 			currItem = nextItem;
 		}
 	}
 
-	//Replace old bucket pointer
+	//Free old buckets when done
+	if(table->migrateIndex >= table->oldBucketCount)
+	{
+		HashTableFreeBuckets(table, table->oldBuckets, table->oldBucketCount);
+		table->oldBuckets = NULL;
+		table->oldBucketCount = 0;
+		table->migrateIndex = 0;
+	}
+}
+
+//Continues resizing the table if it is being resized
+static inline void HashTableMigrate(HashTable * table, unsigned int count)
+{
+	if(table->oldBuckets)
+	{
+		HashTableMigrateBuckets(table, count);
+	}
+}
+
+//Hashing constants (from MurmurHash3)
+#define HASH_C1		0xcc9e2d51
+#define HASH_C2		0x1b873593
+#define HASH_SEED	2166136261
+
+//Rotates a value left
+static inline unsigned int HashRotate(unsigned int value, unsigned int shift)
+{
+	return (value << shift) | (value >> (32 - shift));
+}
+
+//Reads an unaligned word from a key
+static inline unsigned int HashRead32(const unsigned char * ptr)
+{
+	unsigned int word;
+	MemCpy(&word, ptr, sizeof(unsigned int));
+	return word;
+}
+
+//Adds a word to the hash
+static inline unsigned int HashAddWord(unsigned int hash, unsigned int word)
+{
+	word *= HASH_C1;
+	word = HashRotate(word, 15);
+	word *= HASH_C2;
+
+	hash ^= word;
+	hash = HashRotate(hash, 13);
+	return hash * 5 + 0xe6546b64;
+}
+
+//Mixes the bits of the final hash so the low bits depend on every bit of the key
+static inline unsigned int HashFinish(unsigned int hash, unsigned int keyLen)
+{
+	hash ^= keyLen;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+//Hashes a key (inlined into the hash table functions)
+static inline unsigned int HashKey(const void * keyPtr, unsigned int keyLen)
+{
+	//MurmurHash3 Algorithm (processes the key a word at a time)
+	const unsigned char * mem = keyPtr;
+	unsigned int hash = HASH_SEED;
+
+	//Integer keys
+	if(keyLen == sizeof(unsigned int))
+	{
+		return HashFinish(HashAddWord(hash, HashRead32(mem)), keyLen);
+	}
+	else if(keyLen == sizeof(unsigned long long))
+	{
+		hash = HashAddWord(hash, HashRead32(mem));
+		hash = HashAddWord(hash, HashRead32(mem + 4));
+		return HashFinish(hash, keyLen);
+	}
+
+	//Whole words
+	unsigned int remaining = keyLen;
+	while(remaining >= sizeof(unsigned int))
+	{
+		hash = HashAddWord(hash, HashRead32(mem));
+		mem += sizeof(unsigned int);
+		remaining -= sizeof(unsigned int);
+	}
+
+	//Remaining bytes
+	if(remaining > 0)
+	{
+		unsigned int word = 0;
+
+		switch(remaining)
+		{
+			case 3:
+				word |= mem[2] << 16;
+				//Fall through
+			case 2:
+				word |= mem[1] << 8;
+				//Fall through
+			case 1:
+				word |= mem[0];
+		}
+
+		word *= HASH_C1;
+		word = HashRotate(word, 15);
+		word *= HASH_C2;
+		hash ^= word;
+	}
+
+	return HashFinish(hash, keyLen);
+}
+
+//Starts resizing an existing hash table
+// The items in large tables are moved into the new buckets by later calls to
+// HashTableMigrate
+static void HashTableResize(HashTable * table, unsigned int newSize)
+{
+	//Ignore size 0 or the current size
+	if(newSize == 0 || newSize == table->bucketCount)
+	{
+		return;
+	}
+
+	//Finish any previous resize
+	HashTableMigrate(table, ~0U);
+
+	//Allocate new bucket table and wipe it
+	HashItem ** buckets = HashTableAllocBuckets(table, newSize);
+
+	//Keep the old buckets until their items have been moved
 	if(table->buckets)
 	{
-		MemVirtualFree(table->buckets);
+		if(table->itemCount == 0)
+		{
+			HashTableFreeBuckets(table, table->buckets, table->bucketCount);
+		}
+		else
+		{
+			table->oldBuckets = table->buckets;
+			table->oldBucketCount = table->bucketCount;
+			table->migrateIndex = 0;
+		}
 	}
 
 	table->buckets = buckets;
 	table->bucketCount = newSize;
+
+	//Small tables are migrated immediately
+	if(table->oldBucketCount * sizeof(HashItem *) <= HASH_KALLOC_MAX)
+	{
+		HashTableMigrate(table, ~0U);
+	}
+}
+
+//Returns the bucket an item with the given hash is stored in
+static inline HashItem ** HashTableGetBucket(HashTable * table, unsigned int hashValue)
+{
+	//Use the old bucket if it has not been migrated yet
+	if(table->oldBuckets)
+	{
+		unsigned int oldBucketID = hashValue & (table->oldBucketCount - 1);
+		if(oldBucketID >= table->migrateIndex)
+		{
+			return &table->oldBuckets[oldBucketID];
+		}
+	}
+
+	return &table->buckets[hashValue & (table->bucketCount - 1)];
 }
 
 //Compares 2 keys to see if their equal
 static inline bool HashTableKeyCompare(const void * keyPtr1, const void * keyPtr2,
 		unsigned int keyLen1, unsigned int keyLen2)
 {
+	if(keyLen1 != keyLen2)
+	{
+		return false;
+	}
+
+	//Integer keys (constant sized comparisons are compiled into integer comparisons)
+	if(keyLen1 == sizeof(unsigned int))
+	{
+		return MemCmp(keyPtr1, keyPtr2, sizeof(unsigned int)) == 0;
+	}
+	else if(keyLen1 == sizeof(unsigned long long))
+	{
+		return MemCmp(keyPtr1, keyPtr2, sizeof(unsigned long long)) == 0;
+	}
+
 	//Do memory comparison
-	return keyLen1 == keyLen2 && MemCmp(keyPtr1, keyPtr2, keyLen1) == 0;
+	return MemCmp(keyPtr1, keyPtr2, keyLen1) == 0;
 }
 
 //Checks if the hash table has reached the growing threshold
@@ -83,6 +298,13 @@ static inline bool HashTableGrowCheck(HashTable * table, unsigned int count)
 	return count > ((table->bucketCount * HASH_THRESHOLD_GROW) / HASH_THRESHOLD_REF);
 }
 
+//Checks if the hash table has reached the shrinking threshold
+static inline bool HashTableShrinkCheck(HashTable * table, unsigned int size)
+{
+	return size > HASH_INITIAL_SIZE &&
+		table->itemCount < ((size * HASH_THRESHOLD_SHRINK) / HASH_THRESHOLD_REF);
+}
+
 //Finds the hash item from a given key in a pre-calculated bucket
 static inline HashItem * HashTableFindFromBucket(HashItem * bucket, const void * keyPtr, unsigned int keyLen)
 {
@@ -112,7 +334,7 @@ bool HashTableInsert(HashTable * table, HashItem * item, const void * keyPtr, un
 	//Calculate hash and store in item
 	item->keyPtr = keyPtr;
 	item->keyLen = keyLen;
-	item->hashValue = HashTableHash(keyPtr, keyLen);
+	item->hashValue = HashKey(keyPtr, keyLen);
 
 	//Ensure table is large enough
 	if(HashTableGrowCheck(table, table->itemCount + 1))
@@ -128,19 +350,21 @@ bool HashTableInsert(HashTable * table, HashItem * item, const void * keyPtr, un
 		}
 	}
 
+	//Continue any resize
+	HashTableMigrate(table, HASH_MIGRATE_BUCKETS);
+
 	//Lookup bucket
-	unsigned int bucketID = item->hashValue % table->bucketCount;
-	HashItem * bucket = table->buckets[bucketID];
+	HashItem ** bucket = HashTableGetBucket(table, item->hashValue);
 
 	//Check if this item is in the table
-	if(HashTableFindFromBucket(bucket, keyPtr, keyLen) != NULL)
+	if(HashTableFindFromBucket(*bucket, keyPtr, keyLen) != NULL)
 	{
 		return false;
 	}
 
 	//Insert at beginning of this bucket
-	item->next = bucket;
-	table->buckets[bucketID] = item;
+	item->next = *bucket;
+	*bucket = item;
 	table->itemCount++;
 
 	return true;
@@ -156,19 +380,22 @@ static bool HashTableRemoveKeyItem(HashTable * table, HashItem * item,
 		return false;
 	}
 
+	//Continue any resize
+	HashTableMigrate(table, HASH_MIGRATE_BUCKETS);
+
 	//Calculate hash
-	unsigned int bucketID;
+	unsigned int hashValue;
 	if(item == NULL)
 	{
-		bucketID = HashTableHash(keyPtr, keyLen) % table->bucketCount;
+		hashValue = HashKey(keyPtr, keyLen);
 	}
 	else
 	{
-		bucketID = item->hashValue % table->bucketCount;
+		hashValue = item->hashValue;
 	}
 
 	//Search for item
-	HashItem ** currItemPtr = &table->buckets[bucketID];
+	HashItem ** currItemPtr = HashTableGetBucket(table, hashValue);
 	HashItem * currItem = *currItemPtr;
 
 	while(currItem)
@@ -183,6 +410,15 @@ static bool HashTableRemoveKeyItem(HashTable * table, HashItem * item,
 
 			//Decrement number of items
 			table->itemCount--;
+
+			//Free buckets of empty tables
+			// Removing items must not allocate memory (it is used by memory shrinkers), so
+			// other tables are only shrunk by HashTableShrink
+			if(table->itemCount == 0)
+			{
+				HashTableFree(table);
+			}
+
 			return true;
 		}
 
@@ -216,12 +452,14 @@ HashItem * HashTableFind(HashTable * table, const void * keyPtr, unsigned int ke
 		return NULL;
 	}
 
+	//Continue any resize
+	HashTableMigrate(table, HASH_MIGRATE_BUCKETS);
+
 	//Calculate hash and get bucket
-	unsigned int bucketID = HashTableHash(keyPtr, keyLen) % table->bucketCount;
-	HashItem * bucket = table->buckets[bucketID];
+	HashItem ** bucket = HashTableGetBucket(table, HashKey(keyPtr, keyLen));
 
 	//Find from bucket
-	return HashTableFindFromBucket(bucket, keyPtr, keyLen);
+	return HashTableFindFromBucket(*bucket, keyPtr, keyLen);
 }
 
 //Causes the hash table to grow if it will reach the grow threshold when
@@ -239,6 +477,11 @@ void HashTableReserve(HashTable * table, unsigned int count)
 	{
 		//Double size until large enough
 		unsigned int currSize = table->bucketCount;
+		if(currSize == 0)
+		{
+			currSize = HASH_INITIAL_SIZE;
+		}
+
 		while(currSize < count)
 		{
 			currSize *= 2;
@@ -252,37 +495,46 @@ void HashTableReserve(HashTable * table, unsigned int count)
 //Shrinks the hash table if there are very few items in it
 void HashTableShrink(HashTable * table)
 {
+	//Free all buckets if empty
+	if(table->itemCount == 0)
+	{
+		HashTableFree(table);
+		return;
+	}
+
 	//Check shrink threshold
-	unsigned int shrinkThreshold = (table->bucketCount * HASH_THRESHOLD_SHRINK) / HASH_THRESHOLD_REF;
-	if(table->bucketCount < shrinkThreshold)
+	if(HashTableShrinkCheck(table, table->bucketCount))
 	{
-		//Divide size until small enough
+		//Halve size until the load is above the threshold
 		unsigned int currSize = table->bucketCount;
-		while(currSize > shrinkThreshold)
+		while(HashTableShrinkCheck(table, currSize))
 		{
 			currSize /= 2;
 		}
 
 		//Resize table
-		if(currSize != 0)
-		{
-			HashTableResize(table, currSize);
-		}
+		HashTableResize(table, currSize);
 	}
 }
 
-//Hashes the key using the built-in hashing function
-unsigned int HashTableHash(const void * keyPtr, unsigned int keyLen)
+//Frees the memory used by the buckets of a hash table
+void HashTableFree(HashTable * table)
 {
-	//FNV Hash Algorithm
-	const char * mem = keyPtr;
-	unsigned int hash = 2166136261;
+	if(table->buckets)
+	{
+		HashTableFreeBuckets(table, table->buckets, table->bucketCount);
+	}
 
-	while(keyLen-- > 0)
+	if(table->oldBuckets)
 	{
-		hash ^= *mem++;
-		hash *= 16777619;
+		HashTableFreeBuckets(table, table->oldBuckets, table->oldBucketCount);
 	}
 
-	return hash;
+	MemSet(table, 0, sizeof(HashTable));
+}
+
+//Hashes the key using the built-in hashing function
+unsigned int HashTableHash(const void * keyPtr, unsigned int keyLen)
+{
+	return HashKey(keyPtr, keyLen);
 }
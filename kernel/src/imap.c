@@ -0,0 +1,258 @@
+/*
+ * imap.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "imap.h"
+#include "mm/kmemory.h"
+
+//Integer Keyed Hash Map
+// Keys are hashed by multiplying them by 2^32 / golden ratio and using the top bits
+// of the result as the home slot of the entry. The distance of an entry from its
+// home slot is recalculated from its key when needed.
+
+//Largest slot array allocated with MemKAlloc
+#define IMAP_KALLOC_MAX (8 << 10)
+
+//Returns the home slot of a key
+static inline unsigned int IntMapHome(IntMap * map, unsigned int key)
+{
+	return (key * 2654435769U) >> map->shift;
+}
+
+//Returns the distance of the entry in the given slot from its home slot
+static inline unsigned int IntMapDistance(IntMap * map, unsigned int slot)
+{
+	return (slot - IntMapHome(map, map->entries[slot].key)) & (map->capacity - 1);
+}
+
+//Frees a slot array
+static void IntMapFreeEntries(IntMapEntry * entries, unsigned int capacity)
+{
+	if(capacity * sizeof(IntMapEntry) <= IMAP_KALLOC_MAX)
+	{
+		MemKFree(entries);
+	}
+	else
+	{
+		MemVirtualFree(entries);
+	}
+}
+
+//Places an entry in the map without checking if it exists or if the map is full
+static void IntMapPlace(IntMap * map, unsigned int key, void * value)
+{
+	unsigned int mask = map->capacity - 1;
+	unsigned int slot = IntMapHome(map, key);
+	unsigned int distance = 0;
+
+	for(;;)
+	{
+		IntMapEntry * entry = &map->entries[slot];
+
+		//Use empty slot
+		if(entry->value == NULL)
+		{
+			entry->key = key;
+			entry->value = value;
+			return;
+		}
+
+		//Take the slot from entries nearer to their home
+		unsigned int entryDistance = IntMapDistance(map, slot);
+		if(entryDistance < distance)
+		{
+			unsigned int tmpKey = entry->key;
+			void * tmpValue = entry->value;
+
+			entry->key = key;
+			entry->value = value;
+
+			key = tmpKey;
+			value = tmpValue;
+			distance = entryDistance;
+		}
+
+		//Advance slot
+		slot = (slot + 1) & mask;
+		distance++;
+	}
+}
+
+//Resizes the map
+static void IntMapResize(IntMap * map, unsigned int newSize)
+{
+	IntMapEntry * oldEntries = map->entries;
+	unsigned int oldCapacity = map->capacity;
+
+	//Allocate new slots
+	if(newSize * sizeof(IntMapEntry) <= IMAP_KALLOC_MAX)
+	{
+		map->entries = MemKZAlloc(newSize * sizeof(IntMapEntry));
+	}
+	else
+	{
+		map->entries = MemVirtualZAlloc(newSize * sizeof(IntMapEntry));
+	}
+
+	map->capacity = newSize;
+	map->shift = 32 - __builtin_ctz(newSize);
+
+	//Re-add all entries
+	for(unsigned int i = 0; i < oldCapacity; i++)
+	{
+		if(oldEntries[i].value != NULL)
+		{
+			IntMapPlace(map, oldEntries[i].key, oldEntries[i].value);
+		}
+	}
+
+	if(oldEntries)
+	{
+		IntMapFreeEntries(oldEntries, oldCapacity);
+	}
+}
+
+//Returns the slot containing the given key or -1 if it is not in the map
+static int IntMapFindSlot(IntMap * map, unsigned int key)
+{
+	//Ignore if count == 0
+	if(map->count == 0)
+	{
+		return -1;
+	}
+
+	unsigned int mask = map->capacity - 1;
+	unsigned int slot = IntMapHome(map, key);
+	unsigned int distance = 0;
+
+	for(;;)
+	{
+		IntMapEntry * entry = &map->entries[slot];
+
+		if(entry->value == NULL)
+		{
+			return -1;
+		}
+		else if(entry->key == key)
+		{
+			return slot;
+		}
+
+		//If the key were here, it would have taken this slot when inserted
+		if(IntMapDistance(map, slot) < distance)
+		{
+			return -1;
+		}
+
+		//Advance slot
+		slot = (slot + 1) & mask;
+		distance++;
+	}
+}
+
+//Inserts an entry into the map
+bool IntMapInsert(IntMap * map, unsigned int key, void * value)
+{
+	//Check if this key is in the map
+	if(IntMapFindSlot(map, key) >= 0)
+	{
+		return false;
+	}
+
+	//Ensure map is large enough
+	if(map->capacity == 0)
+	{
+		IntMapResize(map, IMAP_INITIAL_SIZE);
+	}
+	else if(map->count + 1 > (map->capacity * IMAP_THRESHOLD_GROW) / IMAP_THRESHOLD_REF)
+	{
+		IntMapResize(map, map->capacity * 2);
+	}
+	else if(map->capacity > IMAP_INITIAL_SIZE &&
+		map->count < (map->capacity * IMAP_THRESHOLD_SHRINK) / IMAP_THRESHOLD_REF)
+	{
+		//Shrink maps which entries have been removed from
+		IntMapResize(map, map->capacity / 2);
+	}
+
+	IntMapPlace(map, key, value);
+	map->count++;
+	return true;
+}
+
+//Removes an entry from the map
+void * IntMapRemove(IntMap * map, unsigned int key)
+{
+	int found = IntMapFindSlot(map, key);
+	if(found < 0)
+	{
+		return NULL;
+	}
+
+	unsigned int mask = map->capacity - 1;
+	unsigned int slot = found;
+	unsigned int next = (slot + 1) & mask;
+	void * value = map->entries[slot].value;
+
+	//Shift back following entries which are not in their home slot
+	while(map->entries[next].value != NULL && IntMapDistance(map, next) > 0)
+	{
+		map->entries[slot] = map->entries[next];
+		slot = next;
+		next = (next + 1) & mask;
+	}
+
+	map->entries[slot].key = 0;
+	map->entries[slot].value = NULL;
+	map->count--;
+
+	//Free empty maps
+	// Removing entries never allocates memory, so other maps are shrunk by the next insert
+	if(map->count == 0)
+	{
+		IntMapFree(map);
+	}
+
+	return value;
+}
+
+//Finds an entry in the map
+void * IntMapFind(IntMap * map, unsigned int key)
+{
+	int slot = IntMapFindSlot(map, key);
+	if(slot < 0)
+	{
+		return NULL;
+	}
+
+	return map->entries[slot].value;
+}
+
+//Frees the memory used by a map
+void IntMapFree(IntMap * map)
+{
+	if(map->entries)
+	{
+		IntMapFreeEntries(map->entries, map->capacity);
+	}
+
+	MemSet(map, 0, sizeof(IntMap));
+}
@@ -20,412 +20,2172 @@
  */
 
 #include "chaff.h"
+#include "crc32c.h"
 #include "io/bcache.h"
+#include "io/blkbuf.h"
+#include "io/blktrace.h"
 #include "io/device.h"
 #include "errno.h"
+#include "inlineasm.h"
+#include "lz.h"
 #include "mm/check.h"
 #include "mm/kmemory.h"
+#include "mm/physical.h"
+#include "process.h"
+#include "timer.h"
 
 //Cache of IoBlock objects
 static MemCache * blockHeadCache;
 
-//Insert into block cache table
-static inline bool IoBlockHashInsert(IoBlockCache * cache, IoBlock * block)
+//Ghost list entry (remembers the offset of an evicted block)
+typedef struct IoBlockGhost
 {
-	return HashTableInsert(&cache->blockTable, &block->hItem, &block->offset, sizeof(unsigned long long));
+	unsigned long long offset;
+	HashItem hItem;
+	ListHead listItem;
+	bool frequent;
+
+} IoBlockGhost;
+
+static MemCache * ghostCache;
+
+//Compressed copy of an evicted block
+typedef struct IoZBlock
+{
+	ListHead lruItem;
+	IoBlockCache * cache;
+	unsigned long long offset;
+	unsigned int size;
+	char data[];
+
+} IoZBlock;
+
+//Largest block which can be compressed
+#define Z_MAX_BLOCK_SIZE 8192
+
+//Compressed block limits
+unsigned int IoBlockCacheZLimit;
+unsigned int IoBlockCacheZBytes;
+
+//Compressed blocks from all caches (the least recently stored is at the head)
+static ListHead zLruList = LIST_INLINE_INIT(zLruList);
+
+//Buffer blocks are compressed into
+static char zBuffer[Z_MAX_BLOCK_SIZE];
+
+//Global cache limits
+unsigned int IoBlockCacheGlobalLimit;
+unsigned int IoBlockCacheGlobalBytes;
+
+//List of all block caches
+static ListHead cacheList = LIST_INLINE_INIT(cacheList);
+
+//Incremented each time a block is unlocked (used to compare the ages of blocks in different caches)
+static unsigned int useCounter;
+
+//Number of bytes in dirty blocks
+unsigned int IoBlockCacheDirtyBytes;
+
+static int NORETURN FlusherThread(void * unused);
+static void ClearDirty(IoBlockCache * bCache, IoBlock * block);
+
+//Queue of readahead requests
+typedef struct ReadaheadRequest
+{
+	IoBlockCache * bCache;
+	unsigned long long off;
+	unsigned int count;
+
+} ReadaheadRequest;
+
+static ReadaheadRequest raQueue[IO_BCACHE_RA_QUEUE];
+static unsigned int raQueueHead;
+static unsigned int raQueueCount;
+static ProcWaitQueue raWaitQueue = LIST_INLINE_INIT(raWaitQueue);
+
+static int NORETURN ReadaheadThread(void * unused);
+
+//Maximum size of the text produced by the statistics device
+#define STATS_TEXT_SIZE 4096
+
+//Returns the block number containing an offset
+static inline unsigned long long IoBlockIndex(IoBlockCache * cache, unsigned long long off)
+{
+	return off >> __builtin_ctz(cache->blockSize);
 }
 
-static inline IoBlock * IoBlockHashFind(IoBlockCache * cache, unsigned long long off)
+//Insert into block cache tree
+static inline bool IoBlockTreeInsert(IoBlockCache * cache, IoBlock * block)
 {
-	HashItem * item = HashTableFind(&cache->blockTable, &off, sizeof(unsigned long long));
+	return RadixTreeInsert(&cache->blockTree, IoBlockIndex(cache, block->offset), block);
+}
 
-	if(item)
+static inline IoBlock * IoBlockTreeFind(IoBlockCache * cache, unsigned long long off)
+{
+	return RadixTreeFind(&cache->blockTree, IoBlockIndex(cache, off));
+}
+
+//Removes a block from the block cache tree
+// Nothing happens if the block has already been removed
+static inline void IoBlockTreeRemove(IoBlockCache * cache, IoBlock * block)
+{
+	unsigned long long index = IoBlockIndex(cache, block->offset);
+
+	if(RadixTreeFind(&cache->blockTree, index) == block)
 	{
-		return HashTableEntry(item, IoBlock, hItem);
+		RadixTreeRemove(&cache->blockTree, index);
 	}
-	else
+}
+
+//Finds the first cached block in the range [off, end)
+static inline IoBlock * IoBlockTreeNext(IoBlockCache * cache, unsigned long long off, unsigned long long end)
+{
+	unsigned long long index = IoBlockIndex(cache, off);
+	IoBlock * block = RadixTreeNext(&cache->blockTree, &index);
+
+	if(block != NULL && block->offset >= end)
 	{
 		return NULL;
 	}
+
+	return block;
 }
 
-//Frees a block
-static inline void FreeBlock(IoBlockCache * bCache, IoBlock * block)
+//Records a trace event for a request to the cache (or a direct device request)
+static inline void Trace(IoBlockCache * bCache, int op, int flags, unsigned long long off,
+		unsigned int length, unsigned long long startTime, int result)
 {
-	//Free block memory
-	if(bCache->blockSize >= PAGE_SIZE)
+	if(IoBlockTraceEnabled)
 	{
-		MemPhysicalFree(MemVirt2Phys(block->address), bCache->blockSize / PAGE_SIZE);
+		IoBlockTraceEvent event =
+		{
+			.result = result,
+			.queueTime = startTime,
+			.issueTime = startTime,
+			.completeTime = rdtsc(),
+			.offset = off,
+			.length = length,
+			.op = op,
+			.flags = flags,
+		};
+
+		IoBlockTraceAdd(bCache->device, &event);
 	}
-	else
+}
+
+//Returns the trace flags for a cache request given the number of misses before it
+static inline int TraceHitFlags(IoBlockCache * bCache, unsigned int oldMisses)
+{
+	return IO_BTRACE_CACHE | (bCache->stats.misses == oldMisses ? IO_BTRACE_HIT : IO_BTRACE_MISS);
+}
+
+//Calculates the checksum of a block after its data has changed
+static inline void SetChecksum(IoBlockCache * bCache, IoBlock * block)
+{
+	if(bCache->flags & IO_BCACHE_CHECKSUM)
+	{
+		block->checksum = Crc32c(0, block->address, bCache->blockSize);
+	}
+}
+
+//Returns false if the data in a block does not match its checksum
+static bool VerifyChecksum(IoBlockCache * bCache, IoBlock * block)
+{
+	if(!(bCache->flags & IO_BCACHE_CHECKSUM) ||
+			Crc32c(0, block->address, bCache->blockSize) == block->checksum)
 	{
-		MemKFree(block->address);
+		return true;
 	}
 
-	//Free block itself
-	MemSlabFree(blockHeadCache, block);
+	PrintLog(Error, "IoBlockCache: checksum error in block %u of device %s",
+			(unsigned int) IoBlockIndex(bCache, block->offset), bCache->device->name);
+
+	bCache->stats.checksumErrors++;
+	return false;
 }
 
-//Initialize block cache
-void INIT IoBlockCacheInit()
+//Removes a locked block with corrupted data from the cache
+// The block is freed when it is unlocked
+static void DiscardBlock(IoBlockCache * bCache, IoBlock * block)
 {
-	blockHeadCache = MemSlabCreate(sizeof(IoBlock), 0);
+	ClearDirty(bCache, block);
+	block->state = IO_BLOCK_ERROR;
+	IoBlockTreeRemove(bCache, block);
+	ProcWaitQueueWakeAll(&block->waitingThreads);
 }
 
-//Initializes a block cache
-IoBlockCache * IoBlockCacheCreate(int blockSize)
+//Frees a block
+static inline void FreeBlock(IoBlockCache * bCache, IoBlock * block)
 {
-	//Setup cache parameters
-	// Check block size
-	if((blockSize & (blockSize - 1)) != 0 || blockSize == 0)
+	//Free block memory
+	IoBlockBufferFree(bCache, block);
+
+	//Update counts
+	if(block->frequent)
 	{
-		PrintLog(Critical, "IoBlockCacheInit: can only create block cache with power of 2 size");
-		return NULL;
+		bCache->frequentCount--;
 	}
-	else if(blockSize < 16)
+	else
 	{
-		PrintLog(Warning, "IoBlockCacheInit: low block cache size isn't very efficient");
+		bCache->recentCount--;
 	}
 
-	//Create and setup cache
-	IoBlockCache * cache = MemKAlloc(sizeof(IoBlockCache));
-	cache->blockSize = blockSize;
-	ListHeadInit(&cache->blockList);
+	//Free block itself
+	MemSlabFree(blockHeadCache, block);
 
-	return cache;
+	bCache->blockCount--;
+	IoBlockCacheGlobalBytes -= bCache->blockSize;
 }
 
-//Destroys a block cache
-bool IoBlockCacheDestroy(IoBlockCache * cache)
+//Adds a reference to a block which is already in the cache
+static inline void LockBlock(IoBlock * block)
 {
-	//Remove each entry from the list
-	IoBlock * block;
-	IoBlock * tmpBlock;
-	bool allUnlocked = true;
-
-	ListForEachEntrySafe(block, tmpBlock, &cache->blockList, listItem)
+	//Referenced blocks cannot be evicted
+	if(block->refCount++ == 0)
 	{
-		//Remove if unlocked
-		if(block->refCount == 0)
-		{
-			HashTableRemoveItem(&cache->blockTable, &block->hItem);
-			ListDelete(&block->listItem);
-
-			FreeBlock(cache, block);
-		}
-		else
-		{
-			allUnlocked = false;
-		}
+		ListDeleteInit(&block->lruItem);
 	}
+}
 
-	//Destroy final cache
-	if(allUnlocked)
+//Returns the number of blocks a cache can hold (used to size the ghost lists)
+static unsigned int Capacity(IoBlockCache * bCache)
+{
+	unsigned int maxBytes = bCache->maxBytes;
+
+	if(maxBytes == 0 || maxBytes > IoBlockCacheGlobalLimit)
 	{
-		MemKFree(cache);
+		maxBytes = IoBlockCacheGlobalLimit;
 	}
 
-	return allUnlocked;
+	return maxBytes >> __builtin_ctz(bCache->blockSize);
 }
 
-//Creates an empty block for the cache (off must be block aligned and must not exist)
-static IoBlock * CreateEmptyBlock(IoBlockCache * bCache, unsigned long long off)
+//Finds the ghost entry with the given offset
+static IoBlockGhost * GhostFind(IoBlockCache * bCache, unsigned long long off)
 {
-	// Create new block and memory region
-	IoBlock * block = MemSlabAlloc(blockHeadCache);
+	HashItem * item = HashTableFind(&bCache->ghostTable, &off, sizeof(unsigned long long));
 
-	block->offset = off;
-	ListHeadInit(&block->listItem);
-	ProcWaitQueueInit(&block->waitingThreads);
-	block->refCount = 1;
+	if(item)
+	{
+		return HashTableEntry(item, IoBlockGhost, hItem);
+	}
+	else
+	{
+		return NULL;
+	}
+}
 
-	// If size >= page, use direct physical allocation
-	if(bCache->blockSize >= PAGE_SIZE)
+//Removes and frees a ghost entry
+static void GhostRemove(IoBlockCache * bCache, IoBlockGhost * ghost)
+{
+	if(ghost->frequent)
 	{
-		block->address = MemPhys2Virt(
-				MemPhysicalAlloc(bCache->blockSize / PAGE_SIZE, MEM_KERNEL));
+		bCache->ghostFrequentCount--;
 	}
 	else
 	{
-		block->address = MemKAlloc(bCache->blockSize);
+		bCache->ghostRecentCount--;
 	}
 
-	// Insert block into hash map
-	IoBlockHashInsert(bCache, block);
-	return block;
+	ListDelete(&ghost->listItem);
+	HashTableRemoveItem(&bCache->ghostTable, &ghost->hItem);
+	MemSlabFree(ghostCache, ghost);
 }
 
-//Reads a block of data from the block cache or reads it from the disk if it isn't there
-int IoBlockCacheRead(IoDevice * device, unsigned long long off, IoBlock ** block)
+//Remembers the offset of a block which is being evicted
+static void GhostAdd(IoBlockCache * bCache, IoBlock * block)
 {
-	//Get block cache
-	IoBlockCache * bCache = device->blockCache;
+	IoBlockGhost * ghost = MemSlabAlloc(ghostCache);
+	ghost->offset = block->offset;
+	ghost->frequent = block->frequent;
 
-	//Align off to block boundary
-	off &= ~(bCache->blockSize - 1);
+	if(!HashTableInsert(&bCache->ghostTable, &ghost->hItem, &ghost->offset, sizeof(unsigned long long)))
+	{
+		//Already a ghost for this block
+		MemSlabFree(ghostCache, ghost);
+		return;
+	}
+
+	if(ghost->frequent)
+	{
+		ListHeadAddLast(&ghost->listItem, &bCache->ghostFrequent);
+		bCache->ghostFrequentCount++;
+	}
+	else
+	{
+		ListHeadAddLast(&ghost->listItem, &bCache->ghostRecent);
+		bCache->ghostRecentCount++;
+	}
 
-	//Lookup block in hash table
-	IoBlock * readBlock = IoBlockHashFind(bCache, off);
+	//Trim ghost lists
+	// Blocks used once + their ghosts are limited to the capacity, all ghosts to twice that
+	unsigned int capacity = Capacity(bCache);
 
-	if(readBlock == NULL)
+	while(bCache->ghostRecentCount > 0 && bCache->recentCount + bCache->ghostRecentCount > capacity)
 	{
-		//Read block from disk
-		// Require device reader
-		if(!device->devOps->read)
-		{
-			return -ENOSYS;
-		}
+		GhostRemove(bCache, ListEntry(bCache->ghostRecent.next, IoBlockGhost, listItem));
+	}
+
+	while(bCache->ghostFrequentCount > 0 &&
+			bCache->ghostRecentCount + bCache->ghostFrequentCount > 2 * capacity)
+	{
+		GhostRemove(bCache, ListEntry(bCache->ghostFrequent.next, IoBlockGhost, listItem));
+	}
+}
 
-		// Create new block and memory region
-		readBlock = CreateEmptyBlock(bCache, off);
-		readBlock->state = IO_BLOCK_READING;
+//Looks up a new block in the ghost lists and adapts the target size of the recent list
+static void GhostCheck(IoBlockCache * bCache, IoBlock * block)
+{
+	IoBlockGhost * ghost = GhostFind(bCache, block->offset);
 
-		// Read data from device
-		int res = device->devOps->read(device, off, readBlock->address, bCache->blockSize);
+	if(ghost == NULL)
+	{
+		return;
+	}
 
-		// Wake up threads
-		ProcWaitQueueWakeAll(&readBlock->waitingThreads);
+	//Speculative reads do not adapt the cache
+	if(!block->readahead)
+	{
+		unsigned int capacity = Capacity(bCache);
+		unsigned int delta;
 
-		// Check for errors and continue
-		if(res != 0)
+		if(ghost->frequent)
 		{
-			//Mark block in error state
-			readBlock->state = IO_BLOCK_ERROR;
-
-			//Remove block from cache
-			HashTableRemoveItem(&bCache->blockTable, &readBlock->hItem);
+			//Frequent list is too small
+			delta = bCache->ghostRecentCount / bCache->ghostFrequentCount;
+			delta = delta ? delta : 1;
 
-			//Unlock block
-			IoBlockCacheUnlock(device, readBlock);
-			return -EIO;
+			bCache->arcTarget = (bCache->arcTarget > delta) ? bCache->arcTarget - delta : 0;
 		}
 		else
 		{
-			//Mark block in ok state
-			readBlock->state = IO_BLOCK_OK;
-		}
-	}
-	else
-	{
-		//Increment item ref count
-		readBlock->refCount++;
-
-		//If block is being read, wait until finished
-		if(readBlock->state == IO_BLOCK_READING)
-		{
-			//Wait for read to finish
-			ProcWaitQueueWait(&readBlock->waitingThreads, false);
+			//Recent list is too small
+			delta = bCache->ghostFrequentCount / bCache->ghostRecentCount;
+			delta = delta ? delta : 1;
 
-			//Check if the block is now in an error state
-			if(readBlock->state == IO_BLOCK_ERROR)
-			{
-				IoBlockCacheUnlock(device, readBlock);
-				return -EIO;
-			}
+			bCache->arcTarget = (bCache->arcTarget + delta < capacity) ? bCache->arcTarget + delta : capacity;
 		}
+
+		//Block was used recently enough to be reused
+		block->frequent = true;
+		bCache->stats.ghostHits++;
 	}
 
-	//Return block
-	*block = readBlock;
-	return 0;
+	GhostRemove(bCache, ghost);
 }
 
-//Decrements the reference count on a block from the cache
-void IoBlockCacheUnlock(IoDevice * device, IoBlock * block)
+//Records a cache hit on a block
+static void TouchBlock(IoBlockCache * bCache, IoBlock * block)
 {
-	//Very simple at the moment
-	if(block->refCount > 0)
+	TimerTime now = TimerGetTime();
+
+	if(block->readahead)
 	{
-		block->refCount--;
+		//First use of a block which was read ahead
+		block->readahead = false;
+		block->loadTime = now;
+	}
+	else if((bCache->flags & IO_BCACHE_ARC) && !block->frequent &&
+			now - block->loadTime >= IO_BCACHE_ARC_CORRELATED)
+	{
+		//Block has been reused
+		block->frequent = true;
+		bCache->recentCount--;
+		bCache->frequentCount++;
+	}
+}
 
-		if(block->state == IO_BLOCK_ERROR && block->refCount == 0)
-		{
-			//Erase block
-			ListDelete(&block->listItem);
-			FreeBlock(device->blockCache, block);
-		}
+//Returns the list blocks should be evicted from next
+static ListHead * EvictionList(IoBlockCache * bCache)
+{
+	//Evict from the recent list if it is larger than the target
+	if(!ListEmpty(&bCache->lruList) &&
+			(bCache->recentCount > bCache->arcTarget || ListEmpty(&bCache->freqList)))
+	{
+		return &bCache->lruList;
 	}
-	else
+
+	return &bCache->freqList;
+}
+
+//Frees a compressed block
+static void ZFree(IoZBlock * zBlock)
+{
+	RadixTreeRemove(&zBlock->cache->zTree, IoBlockIndex(zBlock->cache, zBlock->offset));
+	ListDelete(&zBlock->lruItem);
+
+	IoBlockCacheZBytes -= sizeof(IoZBlock) + zBlock->size;
+	MemKFree(zBlock);
+}
+
+//Frees the compressed blocks in the range [off, end)
+static void ZDropRange(IoBlockCache * bCache, unsigned long long off, unsigned long long end)
+{
+	unsigned long long index = IoBlockIndex(bCache, off);
+	IoZBlock * zBlock;
+
+	while((zBlock = RadixTreeNext(&bCache->zTree, &index)) != NULL && zBlock->offset < end)
 	{
-		PrintLog(Warning, "IoBlockCacheUnlock: block already unlocked");
+		ZFree(zBlock);
 	}
 }
 
-//Uses the block cache to read / copy data into a buffer
-int IoBlockCacheReadBuffer(IoDevice * device, unsigned long long off,
-		void * buffer, unsigned int length)
+//Stores a compressed copy of a clean block which is being evicted
+static void ZStore(IoBlockCache * bCache, IoBlock * block)
 {
-	//Ignore blank length
-	if(length == 0)
+	unsigned int blockSize = bCache->blockSize;
+
+	//Do not keep corrupted data
+	if(!VerifyChecksum(bCache, block))
 	{
-		return 0;
+		return;
 	}
 
-	//Get block size
-	int blockSize = device->blockCache->blockSize;
+	//Only keep blocks which shrink by at least an eighth
+	unsigned int size = LzCompress(block->address, blockSize, zBuffer, blockSize - blockSize / 8);
 
-	//Loop reading blocks and copying data
-	while(length > 0)
+	if(size == 0)
 	{
-		//Read this block
-		IoBlock * block;
-		int res = IoBlockCacheRead(device, off, &block);
+		bCache->stats.zRejects++;
+		return;
+	}
 
-		if(res != 0)
+	//Free the oldest compressed blocks until there is room
+	unsigned int allocSize = sizeof(IoZBlock) + size;
+
+	while(IoBlockCacheZBytes + allocSize > IoBlockCacheZLimit)
+	{
+		if(ListEmpty(&zLruList))
 		{
-			return res;
+			return;
 		}
 
-		//Determine offset and length in block
-		int blockOff = off & (blockSize - 1);				//Offset to read within block
-		unsigned int blockLength = blockSize - blockOff;	//Number of bytes to read after offset
+		ZFree(ListEntry(zLruList.next, IoZBlock, lruItem));
+	}
+
+	//Create compressed block
+	IoZBlock * zBlock = MemKAlloc(allocSize);
+	zBlock->cache = bCache;
+	zBlock->offset = block->offset;
+	zBlock->size = size;
+	MemCpy(zBlock->data, zBuffer, size);
+
+	RadixTreeInsert(&bCache->zTree, IoBlockIndex(bCache, block->offset), zBlock);
+	ListHeadAddLast(&zBlock->lruItem, &zLruList);
+	IoBlockCacheZBytes += allocSize;
+
+	bCache->stats.zStores++;
+	bCache->stats.zBytesIn += blockSize;
+	bCache->stats.zBytesOut += size;
+}
+
+//Evicts up to count unreferenced blocks from a cache
+// Returns the number of blocks evicted
+static unsigned int EvictBlocks(IoBlockCache * bCache, unsigned int count)
+{
+	unsigned int evicted = 0;
+
+	//Evict least recently used blocks first
+	while(evicted < count)
+	{
+		ListHead * list = EvictionList(bCache);
 
-		if(blockLength > length)
+		if(ListEmpty(list))
 		{
-			blockLength = length;
+			break;
 		}
 
-		//Memory checks
-		if(!MemCommitForRead(buffer, blockLength))
+		IoBlock * block = ListEntry(list->next, IoBlock, lruItem);
+
+		ListDelete(&block->lruItem);
+		ListDelete(&block->listItem);
+		IoBlockTreeRemove(bCache, block);
+
+		if(bCache->flags & IO_BCACHE_ARC)
 		{
-			//Unlock and return
-			IoBlockCacheUnlock(device, block);
-			return -EFAULT;
+			GhostAdd(bCache, block);
 		}
 
-		//Copy data
-		MemCpy(buffer, block->address + blockOff, blockLength);
-
-		//Unlock block
-		IoBlockCacheUnlock(device, block);
+		if(bCache->flags & IO_BCACHE_COMPRESS)
+		{
+			ZStore(bCache, block);
+		}
 
-		//Advance buffer
-		off += blockLength;
-		length -= blockLength;
-		buffer = ((char *) buffer) + blockLength;
+		FreeBlock(bCache, block);
+		evicted++;
 	}
 
-	//Finished
-	return 0;
+	bCache->stats.evictions += evicted;
+	return evicted;
 }
 
-//Writes data to disk and to the block cache
-int IoBlockCacheWriteBuffer(IoDevice * device, unsigned long long off,
-		void * buffer, unsigned int length)
+//Returns the age of the oldest unused block in a list (or 0 if the list is empty)
+static inline unsigned int OldestAge(ListHead * list)
 {
-	//Ignore blank length
-	if(length == 0)
+	if(ListEmpty(list))
 	{
 		return 0;
 	}
 
-	//Require write call
-	if(!device->devOps->write)
+	return useCounter - ListEntry(list->next, IoBlock, lruItem)->lastUse + 1;
+}
+
+//Evicts blocks so that a new block can be added to the cache without exceeding any limits
+static void MakeRoom(IoBlockCache * bCache)
+{
+	//Cache limit
+	if(bCache->maxBytes != 0 && (bCache->blockCount + 1) * bCache->blockSize > bCache->maxBytes)
 	{
-		return -ENOSYS;
+		EvictBlocks(bCache, IO_BCACHE_EVICT_BATCH);
 	}
 
-	//Get cache info
-	IoBlockCache * bCache = device->blockCache;
-	unsigned int blockSize = bCache->blockSize;
-
-	//Loop reading blocks and copying data
-	while(length > 0)
+	//Global limit
+	while(IoBlockCacheGlobalBytes + bCache->blockSize > IoBlockCacheGlobalLimit)
 	{
-		//Determine offset and length in block
-		int blockOff = off & (blockSize - 1);				//Offset to write within block
-		unsigned int blockLength = blockSize - blockOff;	//Number of bytes to write after offset
-
-		if(blockLength > length)
-		{
-			blockLength = length;
-		}
-
-		IoBlock * block;
-		int res;
+		//Find the cache containing the oldest unused block
+		IoBlockCache * victim = NULL;
+		unsigned int victimAge = 0;
 
-		//If the block is being partially written, it must be read first
-		if(blockOff != 0 || blockLength != blockSize)
+		IoBlockCache * cache;
+		ListForEachEntry(cache, &cacheList, cacheItem)
 		{
-			//Read block
-			res = IoBlockCacheRead(device, off, &block);
+			unsigned int age = OldestAge(&cache->lruList);
+			unsigned int freqAge = OldestAge(&cache->freqList);
 
-			if(res != 0)
+			if(freqAge > age)
 			{
-				return res;
+				age = freqAge;
 			}
-		}
-		else
-		{
-			//Replace block or create a new block
-			unsigned long long alignedOff = off & ~(blockSize - 1);
-			block = IoBlockHashFind(bCache, alignedOff);
 
-			if(block == NULL)
+			if(age > victimAge)
 			{
-				//Create new block
-				block = CreateEmptyBlock(bCache, alignedOff);
-				block->state = IO_BLOCK_OK;
+				victim = cache;
+				victimAge = age;
 			}
 		}
 
-		//Wait for block to become avaliable
-		while(block->state == IO_BLOCK_READING || block->state == IO_BLOCK_WRITING)
+		//Give up if everything is in use
+		if(victim == NULL || EvictBlocks(victim, IO_BCACHE_EVICT_BATCH) == 0)
 		{
-			ProcWaitQueueWait(&block->waitingThreads, false);
+			break;
 		}
+	}
+}
+
+//Initialize block cache
+void INIT IoBlockCacheInit()
+{
+	blockHeadCache = MemSlabCreate(sizeof(IoBlock), 0);
+	IoBlockBufferInit();
+	ghostCache = MemSlabCreate(sizeof(IoBlockGhost), 0);
+
+	//Use up to a quarter of memory for caching
+	IoBlockCacheGlobalLimit = (MemPhysicalTotalPages / 4) * PAGE_SIZE;
+	IoBlockCacheZLimit = (MemPhysicalTotalPages / 16) * PAGE_SIZE;
+
+	//Start flusher and readahead threads
+	ProcWakeUp(ProcCreateKernelThread("kbflush", FlusherThread, NULL));
+	ProcWakeUp(ProcCreateKernelThread("kreadahead", ReadaheadThread, NULL));
+}
+
+//Initializes a block cache
+IoBlockCache * IoBlockCacheCreate(IoDevice * device, int blockSize, int flags)
+{
+	//Setup cache parameters
+	// Check block size
+	if((blockSize & (blockSize - 1)) != 0 || blockSize == 0)
+	{
+		PrintLog(Critical, "IoBlockCacheInit: can only create block cache with power of 2 size");
+		return NULL;
+	}
+	else if(blockSize < 16)
+	{
+		PrintLog(Warning, "IoBlockCacheInit: low block cache size isn't very efficient");
+	}
+
+	if((flags & IO_BCACHE_COMPRESS) && blockSize > Z_MAX_BLOCK_SIZE)
+	{
+		PrintLog(Warning, "IoBlockCacheInit: blocks too large to compress, compressed cache disabled");
+		flags &= ~IO_BCACHE_COMPRESS;
+	}
+
+	//Create and setup cache
+	IoBlockCache * cache = MemKZAlloc(sizeof(IoBlockCache));
+	cache->device = device;
+	cache->blockSize = blockSize;
+	cache->flags = flags;
+	ListHeadInit(&cache->blockList);
+	ListHeadInit(&cache->lruList);
+	ListHeadInit(&cache->freqList);
+	ListHeadInit(&cache->ghostRecent);
+	ListHeadInit(&cache->ghostFrequent);
+	ListHeadInit(&cache->dirtyList);
+	ProcWaitQueueInit(&cache->writeWait);
+	ProcWaitQueueInit(&cache->flushWait);
+	IoBlockQueueInit(&cache->queue, device);
+	ListHeadAddLast(&cache->cacheItem, &cacheList);
+
+	return cache;
+}
+
+//Sets the maximum size of a block cache
+void IoBlockCacheSetLimit(IoBlockCache * cache, unsigned int maxBytes)
+{
+	cache->maxBytes = maxBytes;
+
+	//Evict blocks until we're under the limit
+	while(maxBytes != 0 && cache->blockCount * cache->blockSize > maxBytes)
+	{
+		if(EvictBlocks(cache, IO_BCACHE_EVICT_BATCH) == 0)
+		{
+			break;
+		}
+	}
+}
+
+//Destroys a block cache
+bool IoBlockCacheDestroy(IoBlockCache * cache)
+{
+	//Remove each entry from the list
+	IoBlock * block;
+	IoBlock * tmpBlock;
+	bool allUnlocked = true;
+
+	//Wait for the flusher thread to finish with this cache
+	while(cache->flushing)
+	{
+		ProcWaitQueueWait(&cache->flushWait, false);
+	}
+
+	//Write back dirty blocks
+	IoBlockCacheSync(cache->device);
+
+	//Cancel queued readahead requests
+	for(unsigned int i = 0; i < raQueueCount; i++)
+	{
+		ReadaheadRequest * request = &raQueue[(raQueueHead + i) % IO_BCACHE_RA_QUEUE];
+
+		if(request->bCache == cache)
+		{
+			request->count = 0;
+		}
+	}
+
+	ListForEachEntrySafe(block, tmpBlock, &cache->blockList, listItem)
+	{
+		//Remove if unlocked
+		if(block->refCount == 0)
+		{
+			IoBlockTreeRemove(cache, block);
+			ListDelete(&block->listItem);
+			ListDelete(&block->lruItem);
+
+			FreeBlock(cache, block);
+		}
+		else
+		{
+			allUnlocked = false;
+		}
+	}
+
+	//Destroy final cache
+	if(allUnlocked)
+	{
+		//The flusher thread may have started again while writing back
+		while(cache->flushing)
+		{
+			ProcWaitQueueWait(&cache->flushWait, false);
+		}
+
+		ListDelete(&cache->cacheItem);
+
+		//Free ghost entries
+		while(!ListEmpty(&cache->ghostRecent))
+		{
+			GhostRemove(cache, ListEntry(cache->ghostRecent.next, IoBlockGhost, listItem));
+		}
+
+		while(!ListEmpty(&cache->ghostFrequent))
+		{
+			GhostRemove(cache, ListEntry(cache->ghostFrequent.next, IoBlockGhost, listItem));
+		}
+
+		HashTableFree(&cache->ghostTable);
+
+		//Free compressed blocks
+		ZDropRange(cache, 0, ~0ULL);
+
+		RadixTreeClear(&cache->blockTree);
+		RadixTreeClear(&cache->bufferPages);
+
+		MemKFree(cache);
+	}
+
+	return allUnlocked;
+}
+
+//Creates an empty block for the cache (off must be block aligned and must not exist)
+// Blocks being read ahead are not counted as used until they are first looked up
+static IoBlock * CreateEmptyBlock(IoBlockCache * bCache, unsigned long long off, bool readahead)
+{
+	// Any compressed copy is out of date once the block is cached again
+	if(bCache->flags & IO_BCACHE_COMPRESS)
+	{
+		ZDropRange(bCache, off, off + 1);
+	}
+
+	// Ensure there is space for the block
+	MakeRoom(bCache);
+
+	// Create new block and memory region
+	IoBlock * block = MemSlabAlloc(blockHeadCache);
+
+	block->offset = off;
+	ListHeadInit(&block->lruItem);
+	ListHeadInit(&block->dirtyItem);
+	block->dirty = false;
+	block->frequent = false;
+	block->readahead = readahead;
+	block->loadTime = TimerGetTime();
+	ProcWaitQueueInit(&block->waitingThreads);
+	block->refCount = 1;
+
+	// Blocks which were evicted recently go straight into the frequent list
+	if(bCache->flags & IO_BCACHE_ARC)
+	{
+		GhostCheck(bCache, block);
+	}
+
+	if(block->frequent)
+	{
+		bCache->frequentCount++;
+	}
+	else
+	{
+		bCache->recentCount++;
+	}
+
+	// Allocate block memory
+	IoBlockBufferAlloc(bCache, block);
+
+	// Insert block into hash map and list of blocks
+	IoBlockTreeInsert(bCache, block);
+	ListHeadAddLast(&block->listItem, &bCache->blockList);
+
+	bCache->blockCount++;
+	IoBlockCacheGlobalBytes += bCache->blockSize;
+	return block;
+}
+
+//Returns the maximum number of blocks which can be transferred in one device request
+static inline unsigned int MergeLimit(IoBlockCache * bCache)
+{
+	unsigned int limit = IO_BCACHE_MERGE_MAX >> __builtin_ctz(bCache->blockSize);
+
+	if(limit > IO_BCACHE_MERGE_MAX_BLOCKS)
+	{
+		return IO_BCACHE_MERGE_MAX_BLOCKS;
+	}
+	else if(limit == 0)
+	{
+		return 1;
+	}
+
+	return limit;
+}
+
+//A request for a run of contiguous blocks
+// The request holds a reference to each block until it completes
+typedef struct BlockRun
+{
+	IoBlockRequest request;
+	IoBlockCache * bCache;
+	unsigned int count;
+	IoVec * vec;
+	IoBlock * blocks[];
+
+} BlockRun;
+
+static void ReadRunComplete(IoBlockRequest * request);
+static void WriteRunComplete(IoBlockRequest * request);
+
+//Submits a request to read or write a run of contiguous blocks
+// Writes of more than one block are gathered from the blocks, reads of more
+// than one block are transferred through a bounce buffer
+static void SubmitRun(IoBlockCache * bCache, IoBlock ** blocks, unsigned int count, int type)
+{
+	unsigned int blockSize = bCache->blockSize;
+	BlockRun * run = MemKAlloc(sizeof(BlockRun) + count * (sizeof(IoBlock *) + sizeof(IoVec)));
+
+	run->bCache = bCache;
+	run->count = count;
+	run->vec = (IoVec *) &run->blocks[count];
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		LockBlock(blocks[i]);
+		run->blocks[i] = blocks[i];
+	}
+
+	//Setup request
+	run->request.type = type;
+	run->request.off = blocks[0]->offset;
+	run->request.count = count * blockSize;
+	run->request.data = run;
+	run->request.vec = NULL;
+
+	if(count == 1)
+	{
+		run->request.buffer = blocks[0]->address;
+	}
+	else if(type == IO_BLKQ_WRITE)
+	{
+		run->request.buffer = NULL;
+		run->request.vec = run->vec;
+		run->request.vecCount = count;
+
+		for(unsigned int i = 0; i < count; i++)
+		{
+			run->vec[i].base = blocks[i]->address;
+			run->vec[i].length = blockSize;
+		}
+	}
+	else
+	{
+		run->request.buffer = MemVirtualAlloc(count * blockSize);
+	}
+
+	if(type == IO_BLKQ_READ)
+	{
+		run->request.complete = ReadRunComplete;
+	}
+	else
+	{
+		run->request.complete = WriteRunComplete;
+		bCache->writesInFlight++;
+	}
+
+	IoBlockQueueSubmit(&bCache->queue, &run->request);
+}
+
+//Frees a completed block run
+static void FreeRun(BlockRun * run)
+{
+	if(run->request.buffer != NULL && run->count > 1)
+	{
+		MemVirtualFree(run->request.buffer);
+	}
+
+	for(unsigned int i = 0; i < run->count; i++)
+	{
+		IoBlockCacheUnlock(run->bCache->device, run->blocks[i]);
+	}
+
+	MemKFree(run);
+}
+
+//Called when a block run read completes
+static void ReadRunComplete(IoBlockRequest * request)
+{
+	BlockRun * run = request->data;
+	IoBlockCache * bCache = run->bCache;
+	unsigned int blockSize = bCache->blockSize;
+
+	for(unsigned int i = 0; i < run->count; i++)
+	{
+		IoBlock * block = run->blocks[i];
+
+		if(request->result == 0)
+		{
+			if(run->count > 1)
+			{
+				MemCpy(block->address, (char *) request->buffer + i * blockSize, blockSize);
+			}
+
+			SetChecksum(bCache, block);
+			block->state = IO_BLOCK_OK;
+		}
+		else if(run->count > 1)
+		{
+			//The large read failed (probably ran off the end of the device)
+			// so try each block on its own
+			SubmitRun(bCache, &run->blocks[i], 1, IO_BLKQ_READ);
+			continue;
+		}
+		else
+		{
+			block->state = IO_BLOCK_ERROR;
+			IoBlockTreeRemove(bCache, block);
+			bCache->stats.errors++;
+		}
+
+		ProcWaitQueueWakeAll(&block->waitingThreads);
+	}
+
+	FreeRun(run);
+}
+
+//Recreates a block from its compressed copy
+// The block is returned locked and in the reading state if the copy is corrupt.
+static IoBlock * ZLoad(IoBlockCache * bCache, IoZBlock * zBlock, bool readahead)
+{
+	unsigned int blockSize = bCache->blockSize;
+
+	//Free the copy before creating the block since making room can free compressed blocks
+	ListDelete(&zBlock->lruItem);
+	RadixTreeRemove(&bCache->zTree, IoBlockIndex(bCache, zBlock->offset));
+	IoBlockCacheZBytes -= sizeof(IoZBlock) + zBlock->size;
+
+	IoBlock * block = CreateEmptyBlock(bCache, zBlock->offset, readahead);
+
+	if(LzDecompress(zBlock->data, zBlock->size, block->address, blockSize) == (int) blockSize)
+	{
+		SetChecksum(bCache, block);
+		block->state = IO_BLOCK_OK;
+		bCache->stats.zHits++;
+	}
+	else
+	{
+		PrintLog(Error, "IoBlockCacheRead: corrupt compressed block");
+		block->state = IO_BLOCK_READING;
+	}
+
+	MemKFree(zBlock);
+	return block;
+}
+
+//Starts reading a run of blocks which are not in the cache using one device request
+// Blocks are created until count is reached or a block already in the cache is found.
+// The new blocks are returned locked in blocks and the number of blocks is returned.
+// The blocks are in the reading state until the request completes.
+// If the first block has a compressed copy, only that block is returned (already read).
+static unsigned int ReadRun(IoBlockCache * bCache, unsigned long long off, unsigned int count,
+		IoBlock ** blocks, bool readahead)
+{
+	unsigned int runCount;
+
+	//Stop at the first block already in the cache
+	unsigned long long end = off + ((unsigned long long) count << __builtin_ctz(bCache->blockSize));
+	IoBlock * cached = IoBlockTreeNext(bCache, off, end);
+
+	if(cached != NULL)
+	{
+		end = cached->offset;
+	}
+
+	//Create blocks
+	for(runCount = 0; runCount < count; runCount++)
+	{
+		unsigned long long blockOff = off + runCount * bCache->blockSize;
+
+		if(blockOff >= end)
+		{
+			break;
+		}
+
+		//Check the compressed cache
+		if(bCache->flags & IO_BCACHE_COMPRESS)
+		{
+			IoZBlock * zBlock = RadixTreeFind(&bCache->zTree, IoBlockIndex(bCache, blockOff));
+
+			if(zBlock != NULL)
+			{
+				//Read the blocks before it first
+				if(runCount > 0)
+				{
+					break;
+				}
+
+				bCache->stats.zLookups++;
+				blocks[0] = ZLoad(bCache, zBlock, readahead);
+
+				if(blocks[0]->state == IO_BLOCK_OK)
+				{
+					return 1;
+				}
+
+				continue;
+			}
+
+			bCache->stats.zLookups++;
+		}
+
+		blocks[runCount] = CreateEmptyBlock(bCache, blockOff, readahead);
+		blocks[runCount]->state = IO_BLOCK_READING;
+	}
+
+	//Read everything at once
+	if(runCount > 0)
+	{
+		SubmitRun(bCache, blocks, runCount, IO_BLKQ_READ);
+	}
+
+	return runCount;
+}
+
+//Reads a block of data from the block cache or reads it from the disk if it isn't there
+static int ReadBlock(IoDevice * device, unsigned long long off, IoBlock ** block)
+{
+	//Get block cache
+	IoBlockCache * bCache = device->blockCache;
+
+	//Align off to block boundary
+	off &= ~(bCache->blockSize - 1);
+
+	//Lookup block in tree
+	IoBlock * readBlock = IoBlockTreeFind(bCache, off);
+
+	if(readBlock == NULL)
+	{
+		//Read block from disk
+		// Require device reader
+		if(!device->devOps->read && !device->devOps->submit)
+		{
+			return -ENOSYS;
+		}
+
+		ReadRun(bCache, off, 1, &readBlock, false);
+		bCache->stats.misses++;
+	}
+	else
+	{
+		//Increment item ref count
+		LockBlock(readBlock);
+		TouchBlock(bCache, readBlock);
+		bCache->stats.hits++;
+
+		if(readBlock->state == IO_BLOCK_READING)
+		{
+			bCache->stats.waits++;
+		}
+	}
+
+	bCache->stats.lookups++;
+
+	//If block is being read, wait until finished
+	while(readBlock->state == IO_BLOCK_READING)
+	{
+		ProcWaitQueueWait(&readBlock->waitingThreads, false);
+	}
+
+	//Check if the block is in an error state
+	if(readBlock->state == IO_BLOCK_ERROR)
+	{
+		IoBlockCacheUnlock(device, readBlock);
+		return -EIO;
+	}
+
+	//Check cached data has not been corrupted
+	if(readBlock->state == IO_BLOCK_OK && !VerifyChecksum(bCache, readBlock))
+	{
+		bool dirty = readBlock->dirty;
+
+		DiscardBlock(bCache, readBlock);
+		IoBlockCacheUnlock(device, readBlock);
+
+		//Read clean blocks again
+		if(dirty)
+		{
+			return -EIO;
+		}
+
+		return ReadBlock(device, off, block);
+	}
+
+	//Return block
+	*block = readBlock;
+	return 0;
+}
+
+//Reads a block (recording a trace event)
+int IoBlockCacheRead(IoDevice * device, unsigned long long off, IoBlock ** block)
+{
+	IoBlockCache * bCache = device->blockCache;
+	unsigned long long startTime = rdtsc();
+	unsigned int oldMisses = bCache->stats.misses;
+
+	int res = ReadBlock(device, off, block);
+
+	Trace(bCache, IO_BLKQ_READ, TraceHitFlags(bCache, oldMisses),
+			off & ~((unsigned long long) bCache->blockSize - 1), bCache->blockSize, startTime, res);
+	return res;
+}
+
+//Decrements the reference count on a block from the cache
+void IoBlockCacheUnlock(IoDevice * device, IoBlock * block)
+{
+	if(block->refCount > 0)
+	{
+		block->refCount--;
+
+		if(block->refCount == 0)
+		{
+			if(block->state == IO_BLOCK_ERROR)
+			{
+				//Erase block
+				ListDelete(&block->listItem);
+				FreeBlock(device->blockCache, block);
+			}
+			else if(!block->dirty)
+			{
+				//Block can now be evicted
+				IoBlockCache * bCache = device->blockCache;
+				block->lastUse = ++useCounter;
+
+				if(block->frequent && (bCache->flags & IO_BCACHE_ARC))
+				{
+					ListHeadAddLast(&block->lruItem, &bCache->freqList);
+				}
+				else
+				{
+					ListHeadAddLast(&block->lruItem, &bCache->lruList);
+				}
+			}
+		}
+	}
+	else
+	{
+		PrintLog(Warning, "IoBlockCacheUnlock: block already unlocked");
+	}
+}
+
+//Returns the number of dirty bytes allowed by the given percentage of the global limit
+static inline unsigned int DirtyThreshold(unsigned int ratio)
+{
+	return (IoBlockCacheGlobalLimit / 100) * ratio;
+}
+
+//Marks a locked block as dirty
+static void MarkDirty(IoBlockCache * bCache, IoBlock * block)
+{
+	if(!block->dirty)
+	{
+		block->dirty = true;
+		block->dirtyTime = TimerGetTime();
+		ListHeadAddLast(&block->dirtyItem, &bCache->dirtyList);
+
+		bCache->dirtyCount++;
+		IoBlockCacheDirtyBytes += bCache->blockSize;
+	}
+}
+
+//Clears the dirty flag of a block
+static void ClearDirty(IoBlockCache * bCache, IoBlock * block)
+{
+	if(block->dirty)
+	{
+		block->dirty = false;
+		ListDeleteInit(&block->dirtyItem);
+
+		bCache->dirtyCount--;
+		IoBlockCacheDirtyBytes -= bCache->blockSize;
+	}
+}
+
+//Called when a block run write completes
+static void WriteRunComplete(IoBlockRequest * request)
+{
+	BlockRun * run = request->data;
+	IoBlockCache * bCache = run->bCache;
+
+	for(unsigned int i = 0; i < run->count; i++)
+	{
+		IoBlock * block = run->blocks[i];
+
+		if(request->result == 0)
+		{
+			block->state = IO_BLOCK_OK;
+		}
+		else if(run->count > 1)
+		{
+			//Try each block on its own
+			SubmitRun(bCache, &run->blocks[i], 1, IO_BLKQ_WRITE);
+			continue;
+		}
+		else
+		{
+			//The data in this block is lost
+			PrintLog(Error, "IoBlockCache: error writing block to device %s", bCache->device->name);
+
+			block->state = IO_BLOCK_ERROR;
+			IoBlockTreeRemove(bCache, block);
+			bCache->writeError = request->result;
+			bCache->stats.errors++;
+		}
+
+		ProcWaitQueueWakeAll(&block->waitingThreads);
+	}
+
+	//Wake threads waiting for writes to finish
+	if(--bCache->writesInFlight == 0)
+	{
+		ProcWaitQueueWakeAll(&bCache->writeWait);
+	}
+
+	FreeRun(run);
+}
+
+//Starts writing a run of locked contiguous blocks to the device using one device request
+// None of the blocks may be being read or written by anyone else.
+// The blocks are in the writing state until the request completes.
+static void WriteRun(IoBlockCache * bCache, IoBlock ** blocks, unsigned int count)
+{
+	unsigned int start = 0;
+
+	//Mark blocks as being written
+	// The blocks are cleaned first so writes during the write dirty them again
+	for(unsigned int i = 0; i < count; i++)
+	{
+		ClearDirty(bCache, blocks[i]);
+
+		if(VerifyChecksum(bCache, blocks[i]))
+		{
+			blocks[i]->state = IO_BLOCK_WRITING;
+		}
+		else
+		{
+			//Never write corrupted data, so split the run around this block
+			if(i > start)
+			{
+				SubmitRun(bCache, &blocks[start], i - start, IO_BLKQ_WRITE);
+			}
+
+			DiscardBlock(bCache, blocks[i]);
+			bCache->writeError = -EIO;
+			start = i + 1;
+		}
+	}
+
+	if(count > start)
+	{
+		SubmitRun(bCache, &blocks[start], count - start, IO_BLKQ_WRITE);
+	}
+}
+
+//Waits for all the writes to a cache to complete
+static void WaitForWrites(IoBlockCache * bCache)
+{
+	while(bCache->writesInFlight > 0)
+	{
+		ProcWaitQueueWait(&bCache->writeWait, false);
+	}
+}
+
+//Starts writing back and unlocks a run of dirty blocks
+static void FlushRun(IoBlockCache * bCache, IoBlock ** run, unsigned int count)
+{
+	WriteRun(bCache, run, count);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		IoBlockCacheUnlock(bCache->device, run[i]);
+	}
+}
+
+//Writes back a batch of the oldest dirty blocks in a cache in offset order
+// If all is false, only blocks which have been dirty for longer than IO_BCACHE_DIRTY_EXPIRE are written
+// Returns the number of blocks written (the writes may not have finished yet)
+static int FlushBatch(IoBlockCache * bCache, bool all)
+{
+	IoBlock * batch[IO_BCACHE_FLUSH_BATCH];
+	unsigned int count = 0;
+	TimerTime expireTime = TimerGetTime() - (((TimerTime) IO_BCACHE_DIRTY_EXPIRE) << 32);
+
+	//Collect oldest blocks
+	IoBlock * block;
+	ListForEachEntry(block, &bCache->dirtyList, dirtyItem)
+	{
+		if(count == IO_BCACHE_FLUSH_BATCH || (!all && block->dirtyTime > expireTime))
+		{
+			break;
+		}
+
+		LockBlock(block);
+		batch[count++] = block;
+	}
+
+	//Sort by offset
+	for(unsigned int i = 1; i < count; i++)
+	{
+		block = batch[i];
+
+		unsigned int j;
+		for(j = i; j > 0 && batch[j - 1]->offset > block->offset; j--)
+		{
+			batch[j] = batch[j - 1];
+		}
+
+		batch[j] = block;
+	}
+
+	//Write blocks, merging contiguous blocks into runs
+	IoBlock * run[IO_BCACHE_MERGE_MAX_BLOCKS];
+	unsigned int runCount = 0;
+	unsigned int runLimit = MergeLimit(bCache);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		block = batch[i];
+
+		//Wait for other operations on the block
+		// The current run is written first so it is not held across the wait
+		if(block->state == IO_BLOCK_READING || block->state == IO_BLOCK_WRITING)
+		{
+			if(runCount > 0)
+			{
+				FlushRun(bCache, run, runCount);
+				runCount = 0;
+			}
+
+			while(block->state == IO_BLOCK_READING || block->state == IO_BLOCK_WRITING)
+			{
+				ProcWaitQueueWait(&block->waitingThreads, false);
+			}
+		}
+
+		//Someone else may have written it already
+		if(!block->dirty)
+		{
+			IoBlockCacheUnlock(bCache->device, block);
+			continue;
+		}
+
+		//Write the current run if this block cannot be added to it
+		if(runCount > 0 && (runCount == runLimit ||
+				run[runCount - 1]->offset + bCache->blockSize != block->offset))
+		{
+			FlushRun(bCache, run, runCount);
+			runCount = 0;
+		}
+
+		run[runCount++] = block;
+	}
+
+	if(runCount > 0)
+	{
+		FlushRun(bCache, run, runCount);
+	}
+
+	return count;
+}
+
+//Updates the readahead window and queues a readahead request if the access is sequential
+static void Readahead(IoBlockCache * bCache, unsigned long long off, unsigned int length)
+{
+	unsigned int blockSize = bCache->blockSize;
+	unsigned int blockShift = __builtin_ctz(blockSize);
+	unsigned long long end = off + length;
+
+	//Get maximum window
+	unsigned int maxWindow = IO_BCACHE_RA_MAX >> blockShift;
+
+	if(maxWindow > IO_BCACHE_RA_MAX_BLOCKS)
+	{
+		maxWindow = IO_BCACHE_RA_MAX_BLOCKS;
+	}
+	else if(maxWindow == 0)
+	{
+		//Blocks too big for readahead
+		return;
+	}
+
+	//Adjust window
+	if(off == bCache->raNext)
+	{
+		//Sequential - grow window
+		if(bCache->raWindow == 0)
+		{
+			bCache->raWindow = IO_BCACHE_RA_MIN;
+		}
+		else
+		{
+			bCache->raWindow *= 2;
+		}
+
+		if(bCache->raWindow > maxWindow)
+		{
+			bCache->raWindow = maxWindow;
+		}
+	}
+	else
+	{
+		//Random - shrink window and forget previous readahead
+		bCache->raWindow /= 2;
+		bCache->raEnd = 0;
+
+		if(bCache->raWindow < IO_BCACHE_RA_MIN)
+		{
+			bCache->raWindow = 0;
+		}
+	}
+
+	bCache->raNext = end;
+
+	IoDeviceOps * devOps = bCache->device->devOps;
+	if(bCache->raWindow == 0 || (!devOps->read && !devOps->submit))
+	{
+		return;
+	}
+
+	//Don't read ahead again until half the previous readahead has been used
+	unsigned long long endBlock = (end + blockSize - 1) & ~((unsigned long long) blockSize - 1);
+
+	if(bCache->raEnd > endBlock && ((bCache->raEnd - endBlock) >> blockShift) >= bCache->raWindow / 2)
+	{
+		return;
+	}
+
+	//Start after the data being read and anything already read ahead
+	unsigned long long start = endBlock;
+	unsigned long long raEnd = endBlock + ((unsigned long long) bCache->raWindow << blockShift);
+
+	if(start < bCache->raEnd)
+	{
+		start = bCache->raEnd;
+	}
+
+	if(start >= raEnd || raQueueCount == IO_BCACHE_RA_QUEUE)
+	{
+		return;
+	}
+
+	//Queue request
+	ReadaheadRequest * request = &raQueue[(raQueueHead + raQueueCount) % IO_BCACHE_RA_QUEUE];
+	request->bCache = bCache;
+	request->off = start;
+	request->count = (unsigned int) ((raEnd - start) >> blockShift);
+	raQueueCount++;
+
+	bCache->raEnd = raEnd;
+	ProcWaitQueueWakeAll(&raWaitQueue);
+}
+
+//Reads the blocks for a readahead request which are not in the cache
+static void ReadaheadRun(ReadaheadRequest * request)
+{
+	IoBlockCache * bCache = request->bCache;
+	IoBlock * blocks[IO_BCACHE_RA_MAX_BLOCKS];
+
+	//The read request keeps its own references to the blocks
+	unsigned int count = ReadRun(bCache, request->off, request->count, blocks, true);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		IoBlockCacheUnlock(bCache->device, blocks[i]);
+	}
+
+	bCache->stats.readaheadBlocks += count;
+}
+
+//Performs queued readahead requests
+static int NORETURN ReadaheadThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	for(;;)
+	{
+		//Wait for request
+		while(raQueueCount == 0)
+		{
+			ProcWaitQueueWait(&raWaitQueue, false);
+		}
+
+		//Take request off queue
+		ReadaheadRequest request = raQueue[raQueueHead];
+		raQueueHead = (raQueueHead + 1) % IO_BCACHE_RA_QUEUE;
+		raQueueCount--;
+
+		//Run it (unless cancelled)
+		if(request.count > 0)
+		{
+			ReadaheadRun(&request);
+		}
+	}
+}
+
+//Uses the block cache to read / copy data into a buffer
+static int ReadBuffer(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	//Ignore blank length
+	if(length == 0)
+	{
+		return 0;
+	}
+
+	//Detect sequential access and start reading ahead
+	Readahead(device->blockCache, off, length);
+
+	//Get cache info
+	IoBlockCache * bCache = device->blockCache;
+	unsigned int blockSize = bCache->blockSize;
+
+	//Loop reading blocks and copying data
+	while(length > 0)
+	{
+		IoBlock * blocks[IO_BCACHE_MERGE_MAX_BLOCKS];
+		unsigned int count;
+		int res = 0;
+
+		//Lookup first block
+		unsigned long long alignedOff = off & ~((unsigned long long) blockSize - 1);
+
+		if(IoBlockTreeFind(bCache, alignedOff) == NULL && (device->devOps->read || device->devOps->submit))
+		{
+			//Read the run of missing blocks at once
+			unsigned long long wanted = (off + length - alignedOff + blockSize - 1) >> __builtin_ctz(blockSize);
+			unsigned int limit = MergeLimit(bCache);
+
+			count = ReadRun(bCache, alignedOff, wanted < limit ? (unsigned int) wanted : limit, blocks, false);
+			bCache->stats.lookups += count;
+			bCache->stats.misses += count;
+		}
+		else
+		{
+			//Read this block
+			res = ReadBlock(device, off, &blocks[0]);
+
+			if(res != 0)
+			{
+				return res;
+			}
+
+			count = 1;
+		}
+
+		//Copy data from each block
+		for(unsigned int i = 0; i < count; i++)
+		{
+			IoBlock * block = blocks[i];
+
+			if(res == 0)
+			{
+				//Wait for the block to be read
+				while(block->state == IO_BLOCK_READING)
+				{
+					ProcWaitQueueWait(&block->waitingThreads, false);
+				}
+
+				if(block->state == IO_BLOCK_ERROR)
+				{
+					res = -EIO;
+				}
+			}
+
+			if(res == 0)
+			{
+				//Determine offset and length in block
+				int blockOff = off & (blockSize - 1);				//Offset to read within block
+				unsigned int blockLength = blockSize - blockOff;	//Number of bytes to read after offset
+
+				if(blockLength > length)
+				{
+					blockLength = length;
+				}
+
+				//Memory checks
+				if(!MemCommitForRead(buffer, blockLength))
+				{
+					res = -EFAULT;
+				}
+				else
+				{
+					//Copy data
+					MemCpy(buffer, block->address + blockOff, blockLength);
+
+					//Advance buffer
+					off += blockLength;
+					length -= blockLength;
+					buffer = ((char *) buffer) + blockLength;
+				}
+			}
+
+			//Unlock block
+			IoBlockCacheUnlock(device, block);
+		}
+
+		//Return if there was an error
+		if(res != 0)
+		{
+			return res;
+		}
+	}
+
+	//Finished
+	return 0;
+}
+
+//Reads data into a buffer (recording a trace event)
+int IoBlockCacheReadBuffer(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	IoBlockCache * bCache = device->blockCache;
+	unsigned long long startTime = rdtsc();
+	unsigned int oldMisses = bCache->stats.misses;
+
+	int res = ReadBuffer(device, off, buffer, length);
+
+	Trace(bCache, IO_BLKQ_READ, TraceHitFlags(bCache, oldMisses), off, length, startTime, res);
+	return res;
+}
+
+//Writes a range of data from a buffer to the cache (and the device if write-through)
+// The range can cover at most MergeLimit blocks. Blocks which are only partly
+// written are read first, then all the blocks are written to the device in one request.
+static int WriteBlocks(IoBlockCache * bCache, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	IoBlock * blocks[IO_BCACHE_MERGE_MAX_BLOCKS];
+	unsigned long long created = 0;		//Bitmap of blocks created here
+	unsigned int blockSize = bCache->blockSize;
+	unsigned int headOff = (unsigned int) off & (blockSize - 1);
+	unsigned long long start = off - headOff;
+	unsigned long long end = off + length;
+	unsigned int count = (headOff + length + blockSize - 1) >> __builtin_ctz(blockSize);
+	int res = 0;
+
+	//Memory checks
+	if(!MemCommitForRead(buffer, length))
+	{
+		return -EFAULT;
+	}
+
+	//Get all the blocks
+	unsigned int got;
+	for(got = 0; got < count; got++)
+	{
+		unsigned long long blockOff = start + got * blockSize;
+		IoBlock * block;
 
-		//If block has errored, return
-		if(block->state == IO_BLOCK_ERROR)
+		if(blockOff < off || blockOff + blockSize > end)
 		{
-			IoBlockCacheUnlock(device, block);
-			return -EIO;
+			//The block is being partially written, so it must be read first
+			res = ReadBlock(bCache->device, blockOff, &block);
+
+			if(res != 0)
+			{
+				break;
+			}
+		}
+		else
+		{
+			//Replace block or create new block
+			block = IoBlockTreeFind(bCache, blockOff);
+
+			if(block == NULL)
+			{
+				block = CreateEmptyBlock(bCache, blockOff, false);
+				block->state = IO_BLOCK_OK;
+				created |= 1ULL << got;
+			}
+			else
+			{
+				LockBlock(block);
+				TouchBlock(bCache, block);
+			}
 		}
 
-		//Memory checks
-		if(!MemCommitForWrite(block->address + blockOff, blockLength))
+		blocks[got] = block;
+	}
+
+	//Wait for all the blocks to become avaliable
+	// Start again after waiting since other blocks may have become busy
+	for(unsigned int i = 0; res == 0 && i < count; )
+	{
+		if(blocks[i]->state == IO_BLOCK_READING || blocks[i]->state == IO_BLOCK_WRITING)
 		{
-			IoBlockCacheUnlock(device, block);
-			return -EFAULT;
+			bCache->stats.waits++;
+			ProcWaitQueueWait(&blocks[i]->waitingThreads, false);
+			i = 0;
 		}
+		else
+		{
+			//If block has errored, fail
+			if(blocks[i]->state == IO_BLOCK_ERROR)
+			{
+				res = -EIO;
+			}
 
+			i++;
+		}
+	}
+
+	if(res == 0)
+	{
 		//Modify block contents
-		block->state = IO_BLOCK_WRITING;
-		MemCpy(block->address + blockOff, buffer, blockLength);
+		for(unsigned int i = 0; i < count; i++)
+		{
+			unsigned long long blockOff = start + i * blockSize;
+			unsigned int from = (i == 0) ? headOff : 0;
+			unsigned int to = blockSize;
+
+			if(blockOff + blockSize > end)
+			{
+				to = (unsigned int) (end - blockOff);
+			}
 
-		//Commit to disk
-		// This always happens since this is a write-through cache
-		// Writing is always done from buffer memory (removing user-mode issues)
-		res = device->devOps->write(device, off, block->address + blockOff, blockLength);
+			MemCpy(blocks[i]->address + from,
+					((char *) buffer) + (unsigned int) (blockOff + from - off), to - from);
+			SetChecksum(bCache, blocks[i]);
+		}
 
-		if(res == 0)
+		if(bCache->flags & IO_BCACHE_WRITEBACK)
 		{
-			block->state = IO_BLOCK_OK;
+			//The flusher writes the blocks later
+			for(unsigned int i = 0; i < count; i++)
+			{
+				MarkDirty(bCache, blocks[i]);
+			}
 		}
 		else
 		{
-			block->state = IO_BLOCK_ERROR;
+			//Commit to disk and wait for the write to finish
+			WriteRun(bCache, blocks, count);
 
-			//Also, remove block from cache
-			HashTableRemoveItem(&bCache->blockTable, &block->hItem);
+			for(unsigned int i = 0; i < count; i++)
+			{
+				while(blocks[i]->state == IO_BLOCK_WRITING)
+				{
+					ProcWaitQueueWait(&blocks[i]->waitingThreads, false);
+				}
+
+				if(blocks[i]->state == IO_BLOCK_ERROR)
+				{
+					res = -EIO;
+				}
+			}
+		}
+	}
+	else
+	{
+		//Throw away the new blocks (they contain garbage)
+		for(unsigned int i = 0; i < got; i++)
+		{
+			if(created & (1ULL << i))
+			{
+				blocks[i]->state = IO_BLOCK_ERROR;
+				IoBlockTreeRemove(bCache, blocks[i]);
+			}
 		}
+	}
 
-		//Wake up other threads and release block
-		ProcWaitQueueWakeAll(&block->waitingThreads);
-		IoBlockCacheUnlock(device, block);
+	//Release blocks
+	for(unsigned int i = 0; i < got; i++)
+	{
+		IoBlockCacheUnlock(bCache->device, blocks[i]);
+	}
+
+	return res;
+}
+
+//Writes data to disk and to the block cache
+static int WriteBuffer(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	//Ignore blank length
+	if(length == 0)
+	{
+		return 0;
+	}
+
+	//Require write call
+	if(!device->devOps->write && !device->devOps->submit)
+	{
+		return -ENOSYS;
+	}
+
+	//Get cache info
+	IoBlockCache * bCache = device->blockCache;
+	unsigned int blockSize = bCache->blockSize;
+
+	//Write up to the merge limit of blocks at a time
+	while(length > 0)
+	{
+		unsigned int blockOff = (unsigned int) off & (blockSize - 1);
+		unsigned int chunk = MergeLimit(bCache) * blockSize - blockOff;
+
+		if(chunk > length)
+		{
+			chunk = length;
+		}
+
+		int res = WriteBlocks(bCache, off, buffer, chunk);
 
-		//Return if there was an error
 		if(res != 0)
 		{
 			return res;
 		}
 
+		//Throttle writers if there is too much dirty data
+		if(IoBlockCacheDirtyBytes > DirtyThreshold(IO_BCACHE_DIRTY_RATIO))
+		{
+			while(IoBlockCacheDirtyBytes > DirtyThreshold(IO_BCACHE_DIRTY_RATIO) && bCache->dirtyCount > 0)
+			{
+				FlushBatch(bCache, true);
+			}
+
+			WaitForWrites(bCache);
+		}
+
 		//Advance buffer
-		off += blockLength;
-		length -= blockLength;
-		buffer = ((char *) buffer) + blockLength;
+		off += chunk;
+		length -= chunk;
+		buffer = ((char *) buffer) + chunk;
 	}
 
 	//Finished
 	return 0;
 }
+
+//Writes data from a buffer (recording a trace event)
+int IoBlockCacheWriteBuffer(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	IoBlockCache * bCache = device->blockCache;
+	unsigned long long startTime = rdtsc();
+	unsigned int oldMisses = bCache->stats.misses;
+
+	int res = WriteBuffer(device, off, buffer, length);
+
+	Trace(bCache, IO_BLKQ_WRITE, TraceHitFlags(bCache, oldMisses), off, length, startTime, res);
+	return res;
+}
+
+//Returns true if an area of a device is block aligned
+static inline bool IsBlockAligned(IoBlockCache * bCache, unsigned long long off, unsigned int length)
+{
+	return ((off | length) & (bCache->blockSize - 1)) == 0;
+}
+
+//Reads data from a device into a buffer without caching it
+int IoBlockCacheReadDirect(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	IoBlockCache * bCache = device->blockCache;
+	unsigned int blockSize = bCache->blockSize;
+
+	//Only aligned reads from synchronous devices can bypass the cache
+	if(!IsBlockAligned(bCache, off, length) || !device->devOps->read)
+	{
+		return IoBlockCacheReadBuffer(device, off, buffer, length);
+	}
+
+	if(length == 0)
+	{
+		return 0;
+	}
+
+	//Memory checks
+	if(!MemCommitForWrite(buffer, length))
+	{
+		return -EFAULT;
+	}
+
+	//Write back dirty blocks in the area (and wait for writes in progress)
+	// so the device has the latest data
+	IoBlock * block = IoBlockTreeNext(bCache, off, off + length);
+
+	while(block != NULL)
+	{
+		unsigned long long next = block->offset + blockSize;
+
+		if(block->dirty || block->state == IO_BLOCK_WRITING)
+		{
+			LockBlock(block);
+
+			while(block->state == IO_BLOCK_READING || block->state == IO_BLOCK_WRITING)
+			{
+				ProcWaitQueueWait(&block->waitingThreads, false);
+			}
+
+			if(block->dirty)
+			{
+				WriteRun(bCache, &block, 1);
+
+				while(block->state == IO_BLOCK_WRITING)
+				{
+					ProcWaitQueueWait(&block->waitingThreads, false);
+				}
+			}
+
+			IoBlockCacheUnlock(device, block);
+		}
+
+		block = IoBlockTreeNext(bCache, next, off + length);
+	}
+
+	//Read straight into the buffer
+	unsigned long long startTime = rdtsc();
+	int res = device->devOps->read(device, off, buffer, length);
+
+	IoBlockQueueAccount(&bCache->queue, IO_BLKQ_READ, res == 0 ? length : 0, rdtsc() - startTime);
+	Trace(bCache, IO_BLKQ_READ, IO_BTRACE_DIRECT, off, length, startTime, res);
+
+	if(res != 0)
+	{
+		bCache->stats.errors++;
+	}
+
+	return res;
+}
+
+//Writes data from a buffer to a device without caching it
+int IoBlockCacheWriteDirect(IoDevice * device, unsigned long long off,
+		void * buffer, unsigned int length)
+{
+	IoBlockCache * bCache = device->blockCache;
+	unsigned int blockSize = bCache->blockSize;
+
+	//Only aligned writes to synchronous devices can bypass the cache
+	if(!IsBlockAligned(bCache, off, length) || !device->devOps->write)
+	{
+		return IoBlockCacheWriteBuffer(device, off, buffer, length);
+	}
+
+	if(length == 0)
+	{
+		return 0;
+	}
+
+	//Memory checks
+	if(!MemCommitForRead(buffer, length))
+	{
+		return -EFAULT;
+	}
+
+	//Write through any cached copies of the blocks
+	// These are updated before the device write so a write back of old data cannot
+	// overwrite the new data
+	IoBlock * block = IoBlockTreeNext(bCache, off, off + length);
+
+	while(block != NULL)
+	{
+		unsigned long long next = block->offset + blockSize;
+
+		LockBlock(block);
+
+		while(block->state == IO_BLOCK_READING || block->state == IO_BLOCK_WRITING)
+		{
+			ProcWaitQueueWait(&block->waitingThreads, false);
+		}
+
+		if(block->state == IO_BLOCK_OK)
+		{
+			MemCpy(block->address, ((char *) buffer) + (unsigned int) (block->offset - off), blockSize);
+			SetChecksum(bCache, block);
+			ClearDirty(bCache, block);
+		}
+
+		IoBlockCacheUnlock(device, block);
+		block = IoBlockTreeNext(bCache, next, off + length);
+	}
+
+	//Compressed copies are now out of date
+	ZDropRange(bCache, off, off + length);
+
+	//Write straight from the buffer
+	unsigned long long startTime = rdtsc();
+	int res = device->devOps->write(device, off, buffer, length);
+
+	IoBlockQueueAccount(&bCache->queue, IO_BLKQ_WRITE, res == 0 ? length : 0, rdtsc() - startTime);
+	Trace(bCache, IO_BLKQ_WRITE, IO_BTRACE_DIRECT, off, length, startTime, res);
+
+	if(res != 0)
+	{
+		bCache->stats.errors++;
+
+		//The cached copies no longer match the device
+		// Blocks dirtied again while writing hold newer data which will be written
+		// back later, so only clean blocks are discarded
+		block = IoBlockTreeNext(bCache, off, off + length);
+
+		while(block != NULL)
+		{
+			unsigned long long next = block->offset + blockSize;
+
+			if(block->state == IO_BLOCK_OK && !block->dirty)
+			{
+				LockBlock(block);
+				DiscardBlock(bCache, block);
+				IoBlockCacheUnlock(device, block);
+			}
+
+			block = IoBlockTreeNext(bCache, next, off + length);
+		}
+	}
+
+	return res;
+}
+
+//Gets the statistics of a block cache
+void IoBlockCacheGetStats(IoBlockCache * cache, IoBlockCacheStats * stats)
+{
+	*stats = cache->stats;
+
+	//Add statistics from the request queue
+	stats->bytesRead = cache->queue.bytesRead;
+	stats->bytesWritten = cache->queue.bytesWritten;
+	MemCpy(stats->latency, cache->queue.latency, sizeof(stats->latency));
+}
+
+//Reads the statistics of all the block caches as text
+static int StatsDeviceRead(IoDevice * device, unsigned long long off, void * buffer, unsigned int count)
+{
+	IGNORE_PARAM device;
+
+	char * text = MemKAlloc(STATS_TEXT_SIZE);
+	unsigned int length = 0;
+
+	//Print each cache
+	IoBlockCache * bCache;
+	ListForEachEntry(bCache, &cacheList, cacheItem)
+	{
+		IoBlockCacheStats stats;
+		IoBlockCacheGetStats(bCache, &stats);
+
+		SPrintF(text + length, STATS_TEXT_SIZE - length,
+				"%s: lookups %u hits %u misses %u waits %u errors %u evictions %u "
+				"readahead %u ghosthits %u readkb %u writtenkb %u",
+				bCache->device->name, stats.lookups, stats.hits, stats.misses, stats.waits,
+				stats.errors, stats.evictions, stats.readaheadBlocks, stats.ghostHits,
+				(unsigned int) (stats.bytesRead >> 10), (unsigned int) (stats.bytesWritten >> 10));
+		length += StrLen(text + length, STATS_TEXT_SIZE - length);
+
+		//Compressed cache
+		if(bCache->flags & IO_BCACHE_COMPRESS)
+		{
+			unsigned int inKb = (unsigned int) (stats.zBytesIn >> 10);
+			unsigned int outKb = (unsigned int) (stats.zBytesOut >> 10);
+
+			SPrintF(text + length, STATS_TEXT_SIZE - length,
+					" zlookups %u zhits %u zstores %u zrejects %u zratio %u%%",
+					stats.zLookups, stats.zHits, stats.zStores, stats.zRejects,
+					inKb == 0 ? 0 : (outKb * 100) / inKb);
+			length += StrLen(text + length, STATS_TEXT_SIZE - length);
+		}
+
+		if(bCache->flags & IO_BCACHE_CHECKSUM)
+		{
+			SPrintF(text + length, STATS_TEXT_SIZE - length, " checksumerrors %u", stats.checksumErrors);
+			length += StrLen(text + length, STATS_TEXT_SIZE - length);
+		}
+
+		SPrintF(text + length, STATS_TEXT_SIZE - length, "\n  latency");
+		length += StrLen(text + length, STATS_TEXT_SIZE - length);
+
+		//Latency histogram (log2 of cycles : number of requests)
+		for(int i = 0; i < IO_BLKQ_LATENCY_BUCKETS; i++)
+		{
+			if(stats.latency[i] != 0)
+			{
+				SPrintF(text + length, STATS_TEXT_SIZE - length, " %i:%u", i, stats.latency[i]);
+				length += StrLen(text + length, STATS_TEXT_SIZE - length);
+			}
+		}
+
+		SPrintF(text + length, STATS_TEXT_SIZE - length, "\n");
+		length += StrLen(text + length, STATS_TEXT_SIZE - length);
+	}
+
+	//Copy requested part
+	int res = 0;
+
+	if(off < length)
+	{
+		if(count > length - off)
+		{
+			count = length - (unsigned int) off;
+		}
+
+		if(MemCommitForWrite(buffer, count))
+		{
+			MemCpy(buffer, text + (unsigned int) off, count);
+			res = count;
+		}
+		else
+		{
+			res = -EFAULT;
+		}
+	}
+
+	MemKFree(text);
+	return res;
+}
+
+static IoDeviceOps statsDeviceOps =
+{
+	.read = StatsDeviceRead,
+};
+
+static IoDevice statsDevice =
+{
+	.name = "blockstats",
+	.mode = IO_DEV_CHAR | IO_OWNER_READ | IO_GROUP_READ | IO_WORLD_READ,
+	.devOps = &statsDeviceOps,
+};
+
+//Registers the block cache statistics device
+void INIT IoBlockCacheStatsInit()
+{
+	IoDevFsRegister(&statsDevice);
+}
+
+//Writes all the dirty blocks of a device back to the device
+int IoBlockCacheSync(IoDevice * device)
+{
+	IoBlockCache * bCache = device->blockCache;
+
+	//Ignore write-through caches
+	if(bCache == NULL || !(bCache->flags & IO_BCACHE_WRITEBACK))
+	{
+		return 0;
+	}
+
+	//Write back until nothing is left
+	while(bCache->dirtyCount > 0)
+	{
+		FlushBatch(bCache, true);
+	}
+
+	//Wait for the writes and report any errors
+	WaitForWrites(bCache);
+
+	int result = bCache->writeError;
+	bCache->writeError = 0;
+	return result;
+}
+
+//Writes back old blocks and blocks over the dirty threshold
+static int NORETURN FlusherThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	for(;;)
+	{
+		//Wait until next run
+		TimerSleep(((TimerTime) IO_BCACHE_FLUSH_INTERVAL) << 32);
+
+		//Flush each cache
+		// FlushBatch can sleep, so the cache is marked as flushing to stop it being
+		// destroyed (and removed from the list) in the meantime
+		IoBlockCache * bCache;
+		ListForEachEntry(bCache, &cacheList, cacheItem)
+		{
+			bCache->flushing = true;
+
+			while(bCache->dirtyCount > 0)
+			{
+				//Write everything if over the background threshold, otherwise only expired blocks
+				bool all = IoBlockCacheDirtyBytes > DirtyThreshold(IO_BCACHE_DIRTY_BACKGROUND_RATIO);
+
+				if(FlushBatch(bCache, all) == 0)
+				{
+					break;
+				}
+			}
+
+			bCache->flushing = false;
+			ProcWaitQueueWakeAll(&bCache->flushWait);
+		}
+	}
+}
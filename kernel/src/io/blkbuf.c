@@ -0,0 +1,187 @@
+/*
+ * blkbuf.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "io/bcache.h"
+#include "io/blkbuf.h"
+#include "mm/kmemory.h"
+#include "mm/physical.h"
+
+//Block buffer allocator
+// Shared pages are kept in a radix tree in each cache, indexed by device region.
+// Each block in a shared page uses the slot matching its offset within the region.
+// A slot can already be in use if an old block with the same offset is still
+// allocated (blocks removed after errors) - those blocks use MemKAlloc instead.
+
+//Slab cache for shared page headers
+static MemCache * bufferPageCache;
+
+//Initializes the block buffer allocator
+void INIT IoBlockBufferInit()
+{
+	bufferPageCache = MemSlabCreate(sizeof(IoBlockBufferPage), 0);
+}
+
+//Allocates the data buffer of a block
+void IoBlockBufferAlloc(IoBlockCache * bCache, IoBlock * block)
+{
+	unsigned int blockSize = bCache->blockSize;
+
+	block->bufferPage = NULL;
+
+	if(blockSize == PAGE_SIZE)
+	{
+		//Single kernel page
+		block->address = MemPhys2Virt(MemPhysicalAlloc(1, MEM_KERNEL));
+	}
+	else if(blockSize > PAGE_SIZE)
+	{
+		//Separate pages mapped together
+		block->address = MemVirtualAlloc(blockSize);
+	}
+	else if(blockSize < IO_BLKBUF_MIN_PACKED)
+	{
+		block->address = MemKAlloc(blockSize);
+	}
+	else
+	{
+		//Find shared page for this region
+		unsigned long long region = block->offset >> 12;
+		unsigned int slot = ((unsigned int) block->offset & (PAGE_SIZE - 1)) >> __builtin_ctz(blockSize);
+		IoBlockBufferPage * page = RadixTreeFind(&bCache->bufferPages, region);
+
+		if(page == NULL)
+		{
+			page = MemSlabZAlloc(bufferPageCache);
+			page->region = region;
+			page->address = MemPhys2Virt(MemPhysicalAlloc(1, MEM_KERNEL));
+
+			RadixTreeInsert(&bCache->bufferPages, region, page);
+		}
+
+		//Use the block's slot
+		if(page->used[slot / 32] & (1U << (slot % 32)))
+		{
+			block->address = MemKAlloc(blockSize);
+		}
+		else
+		{
+			page->used[slot / 32] |= 1U << (slot % 32);
+			page->count++;
+
+			block->bufferPage = page;
+			block->address = page->address + slot * blockSize;
+		}
+	}
+}
+
+//Frees the data buffer of a block
+void IoBlockBufferFree(IoBlockCache * bCache, IoBlock * block)
+{
+	unsigned int blockSize = bCache->blockSize;
+	IoBlockBufferPage * page = block->bufferPage;
+
+	if(blockSize == PAGE_SIZE)
+	{
+		MemPhysicalFree(MemVirt2Phys(block->address), 1);
+	}
+	else if(blockSize > PAGE_SIZE)
+	{
+		MemVirtualFree(block->address);
+	}
+	else if(page == NULL)
+	{
+		MemKFree(block->address);
+	}
+	else
+	{
+		//Release slot
+		unsigned int slot = (unsigned int) (block->address - page->address) >> __builtin_ctz(blockSize);
+
+		page->used[slot / 32] &= ~(1U << (slot % 32));
+		page->count--;
+
+		//Free page when empty
+		if(page->count == 0)
+		{
+			RadixTreeRemove(&bCache->bufferPages, page->region);
+			MemPhysicalFree(MemVirt2Phys(page->address), 1);
+			MemSlabFree(bufferPageCache, page);
+		}
+
+		block->bufferPage = NULL;
+	}
+
+	block->address = NULL;
+}
+
+//Gets the physical pages used by a kernel buffer
+unsigned int IoBufferGetPages(void * buffer, unsigned int length, IoPageVec * vec, unsigned int max)
+{
+	char * ptr = buffer;
+	unsigned int count = 0;
+
+	while(length > 0)
+	{
+		unsigned int offset = (unsigned int) ptr & (PAGE_SIZE - 1);
+		unsigned int chunk = PAGE_SIZE - offset;
+		MemPhysPage page;
+
+		if(chunk > length)
+		{
+			chunk = length;
+		}
+
+		//Lookup page
+		if((unsigned int) ptr >= MEM_KFIXED_MAX)
+		{
+			page = MemGetMappedPage(ptr);
+		}
+		else
+		{
+			page = MemVirt2Phys(ptr);
+		}
+
+		//Extend the previous entry if this page follows it
+		if(count > 0 && offset == 0 && vec[count - 1].page +
+				(int) ((vec[count - 1].offset + vec[count - 1].length) / PAGE_SIZE) == page)
+		{
+			vec[count - 1].length += chunk;
+		}
+		else
+		{
+			if(count == max)
+			{
+				return 0;
+			}
+
+			vec[count].page = page;
+			vec[count].offset = offset;
+			vec[count].length = chunk;
+			count++;
+		}
+
+		ptr += chunk;
+		length -= chunk;
+	}
+
+	return count;
+}
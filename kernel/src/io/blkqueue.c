@@ -0,0 +1,530 @@
+/*
+ * blkqueue.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "errno.h"
+#include "inlineasm.h"
+#include "timer.h"
+#include "waitqueue.h"
+#include "io/blkqueue.h"
+#include "io/blktrace.h"
+#include "io/device.h"
+#include "mm/kmemory.h"
+
+//Block device request queues
+// The queue sends one request at a time to the driver. While the driver is busy, new
+// requests are held by the scheduler so they can be sorted and merged.
+
+//Inserts a request into the queue's request list sorted by offset
+static void InsertSorted(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	ListHead * pos;
+
+	for(pos = queue->requests.next; pos != &queue->requests; pos = pos->next)
+	{
+		if(ListEntry(pos, IoBlockRequest, listItem)->off > request->off)
+		{
+			break;
+		}
+	}
+
+	ListAddBefore(&request->listItem, pos);
+}
+
+//Returns the first request at or after the head position, wrapping around to the start
+static IoBlockRequest * NextSorted(IoBlockQueue * queue)
+{
+	IoBlockRequest * request;
+	ListForEachEntry(request, &queue->requests, listItem)
+	{
+		if(request->off >= queue->headPos)
+		{
+			return request;
+		}
+	}
+
+	return ListEntry(queue->requests.next, IoBlockRequest, listItem);
+}
+
+//Noop scheduler
+static void NoopAdd(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	ListHeadAddLast(&request->listItem, &queue->requests);
+}
+
+static IoBlockRequest * NoopNext(IoBlockQueue * queue)
+{
+	return ListEntry(queue->requests.next, IoBlockRequest, listItem);
+}
+
+const IoBlockScheduler IoBlockSchedNoop =
+{
+	.name = "noop",
+	.add = NoopAdd,
+	.next = NoopNext,
+};
+
+//Elevator scheduler
+// Requests are sorted by offset and dispatched in one direction only (C-LOOK)
+const IoBlockScheduler IoBlockSchedElevator =
+{
+	.name = "elevator",
+	.add = InsertSorted,
+	.next = NextSorted,
+};
+
+//Deadline scheduler
+// Like the elevator, except requests are also kept in fifo lists and expired
+// requests are dispatched first
+static void DeadlineAdd(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	InsertSorted(queue, request);
+
+	//Add to fifo
+	if(request->type == IO_BLKQ_READ)
+	{
+		request->deadline = TimerGetTime() + IO_BLKQ_READ_EXPIRE;
+	}
+	else
+	{
+		request->deadline = TimerGetTime() + IO_BLKQ_WRITE_EXPIRE;
+	}
+
+	ListHeadAddLast(&request->fifoItem, &queue->fifo[request->type]);
+}
+
+static IoBlockRequest * DeadlineNext(IoBlockQueue * queue)
+{
+	TimerTime now = TimerGetTime();
+
+	//Dispatch expired requests (reads first)
+	for(int type = IO_BLKQ_READ; type <= IO_BLKQ_WRITE; type++)
+	{
+		if(!ListEmpty(&queue->fifo[type]))
+		{
+			IoBlockRequest * request = ListEntry(queue->fifo[type].next, IoBlockRequest, fifoItem);
+
+			if(request->deadline <= now)
+			{
+				return request;
+			}
+		}
+	}
+
+	return NextSorted(queue);
+}
+
+const IoBlockScheduler IoBlockSchedDeadline =
+{
+	.name = "deadline",
+	.add = DeadlineAdd,
+	.next = DeadlineNext,
+};
+
+//Initializes a request queue
+void IoBlockQueueInit(IoBlockQueue * queue, IoDevice * device)
+{
+	MemSet(queue, 0, sizeof(IoBlockQueue));
+	queue->device = device;
+	queue->sched = &IoBlockSchedDeadline;
+
+	ListHeadInit(&queue->requests);
+	ListHeadInit(&queue->fifo[IO_BLKQ_READ]);
+	ListHeadInit(&queue->fifo[IO_BLKQ_WRITE]);
+	ListHeadInit(&queue->active);
+}
+
+//Changes the I/O scheduler used by a queue
+bool IoBlockQueueSetScheduler(IoBlockQueue * queue, const IoBlockScheduler * sched)
+{
+	if(queue->queued != 0)
+	{
+		return false;
+	}
+
+	queue->sched = sched;
+	return true;
+}
+
+//Removes a request from the scheduler's lists
+static void RemoveRequest(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	ListDeleteInit(&request->listItem);
+	ListDeleteInit(&request->fifoItem);
+	queue->queued--;
+}
+
+//Adds a request to the scheduler's lists
+static void AddRequest(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	ListHeadInit(&request->fifoItem);
+	queue->sched->add(queue, request);
+	queue->queued++;
+}
+
+//Returns the number of buffers a request's data is stored in
+static inline unsigned int RequestBufferCount(IoBlockRequest * request)
+{
+	return request->vec ? request->vecCount : 1;
+}
+
+//Copies the data to be written by a request into a buffer
+static void CopyRequestData(IoBlockRequest * request, char * dest)
+{
+	if(request->vec)
+	{
+		for(unsigned int i = 0; i < request->vecCount; i++)
+		{
+			MemCpy(dest, request->vec[i].base, request->vec[i].length);
+			dest += request->vec[i].length;
+		}
+	}
+	else
+	{
+		MemCpy(dest, request->buffer, request->count);
+	}
+}
+
+//Sends requests to the driver until it becomes busy
+static void Dispatch(IoBlockQueue * queue)
+{
+	IoDevice * device = queue->device;
+
+	//Synchronous drivers complete requests inside this loop
+	if(queue->dispatching)
+	{
+		return;
+	}
+
+	queue->dispatching = true;
+
+	while(!queue->busy && queue->queued > 0)
+	{
+		//Choose request
+		IoBlockRequest * first = queue->sched->next(queue);
+		RemoveRequest(queue, first);
+		ListHeadAddLast(&first->listItem, &queue->active);
+
+		//Merge contiguous requests into it
+		unsigned long long end = first->off + first->count;
+		unsigned int total = first->count;
+		bool merged = !first->noMerge;
+
+		while(merged)
+		{
+			IoBlockRequest * request;
+			merged = false;
+
+			ListForEachEntry(request, &queue->requests, listItem)
+			{
+				if(request->type == first->type && request->off == end && !request->noMerge &&
+						total + request->count <= IO_BLKQ_MERGE_MAX)
+				{
+					RemoveRequest(queue, request);
+					ListHeadAddLast(&request->listItem, &queue->active);
+
+					end += request->count;
+					total += request->count;
+					queue->merges++;
+					merged = true;
+					break;
+				}
+			}
+		}
+
+		//Setup request for the driver
+		IoBlockRequest * dispatched = &queue->dispatched;
+		dispatched->queue = queue;
+		dispatched->type = first->type;
+		dispatched->off = first->off;
+		dispatched->count = total;
+		dispatched->result = 0;
+		dispatched->vec = NULL;
+		dispatched->vecCount = 0;
+
+		if(first->type == IO_BLKQ_WRITE && (total != first->count || first->vec) &&
+				!device->devOps->submit && device->devOps->writev)
+		{
+			//Gather straight from the submitted buffers
+			IoBlockRequest * request;
+			unsigned int vecCount = 0;
+
+			ListForEachEntry(request, &queue->active, listItem)
+			{
+				vecCount += RequestBufferCount(request);
+			}
+
+			dispatched->buffer = NULL;
+			dispatched->vec = MemKAlloc(vecCount * sizeof(IoVec));
+
+			ListForEachEntry(request, &queue->active, listItem)
+			{
+				if(request->vec)
+				{
+					MemCpy(&dispatched->vec[dispatched->vecCount], request->vec,
+							request->vecCount * sizeof(IoVec));
+					dispatched->vecCount += request->vecCount;
+				}
+				else
+				{
+					dispatched->vec[dispatched->vecCount].base = request->buffer;
+					dispatched->vec[dispatched->vecCount].length = request->count;
+					dispatched->vecCount++;
+				}
+			}
+		}
+		else if(total == first->count && !first->vec)
+		{
+			dispatched->buffer = first->buffer;
+		}
+		else
+		{
+			//Other merged requests are transferred through a bounce buffer
+			dispatched->buffer = MemVirtualAlloc(total);
+
+			if(first->type == IO_BLKQ_WRITE)
+			{
+				IoBlockRequest * request;
+				ListForEachEntry(request, &queue->active, listItem)
+				{
+					CopyRequestData(request,
+							(char *) dispatched->buffer + (unsigned int) (request->off - first->off));
+				}
+			}
+		}
+
+		queue->busy = true;
+		queue->headPos = end;
+		queue->dispatches++;
+		queue->dispatchTime = rdtsc();
+
+		//Send to driver
+		if(device->devOps->submit)
+		{
+			device->devOps->submit(device, dispatched);
+		}
+		else
+		{
+			int res = -ENOSYS;
+
+			if(dispatched->type == IO_BLKQ_READ && device->devOps->read)
+			{
+				res = device->devOps->read(device, dispatched->off, dispatched->buffer, total);
+			}
+			else if(dispatched->vec)
+			{
+				res = device->devOps->writev(device, dispatched->off, dispatched->vec, dispatched->vecCount);
+			}
+			else if(dispatched->type == IO_BLKQ_WRITE && device->devOps->write)
+			{
+				res = device->devOps->write(device, dispatched->off, dispatched->buffer, total);
+			}
+
+			IoBlockRequestDone(dispatched, res);
+		}
+	}
+
+	queue->dispatching = false;
+}
+
+//Submits a request to a queue
+void IoBlockQueueSubmit(IoBlockQueue * queue, IoBlockRequest * request)
+{
+	request->queue = queue;
+	request->result = 0;
+	request->noMerge = false;
+	request->queueTime = rdtsc();
+
+	AddRequest(queue, request);
+	queue->submitted++;
+
+	Dispatch(queue);
+}
+
+//Records a device request in a queue's statistics
+void IoBlockQueueAccount(IoBlockQueue * queue, int type, unsigned int count, unsigned long long cycles)
+{
+	//Add to byte counts
+	if(type == IO_BLKQ_READ)
+	{
+		queue->bytesRead += count;
+	}
+	else
+	{
+		queue->bytesWritten += count;
+	}
+
+	//Find log2 of cycles (without 64-bit library functions)
+	unsigned int high = (unsigned int) (cycles >> 32);
+	unsigned int low = (unsigned int) cycles;
+	unsigned int bucket;
+
+	if(high != 0)
+	{
+		bucket = 63 - __builtin_clz(high);
+	}
+	else if(low != 0)
+	{
+		bucket = 31 - __builtin_clz(low);
+	}
+	else
+	{
+		bucket = 0;
+	}
+
+	if(bucket >= IO_BLKQ_LATENCY_BUCKETS)
+	{
+		bucket = IO_BLKQ_LATENCY_BUCKETS - 1;
+	}
+
+	queue->latency[bucket]++;
+}
+
+//Records a trace event for a completed driver request
+static void TraceRequest(IoBlockQueue * queue, IoBlockRequest * request, int result,
+		bool merged, unsigned long long now)
+{
+	IoBlockTraceEvent event =
+	{
+		.result = result,
+		.queueTime = now,
+		.issueTime = queue->dispatchTime,
+		.completeTime = now,
+		.offset = request->off,
+		.length = request->count,
+		.op = request->type,
+		.flags = merged ? IO_BTRACE_MERGED : 0,
+	};
+
+	//Use the earliest submitted request's queue time
+	IoBlockRequest * submitted;
+	ListForEachEntry(submitted, &queue->active, listItem)
+	{
+		if(submitted->queueTime < event.queueTime)
+		{
+			event.queueTime = submitted->queueTime;
+		}
+	}
+
+	IoBlockTraceAdd(queue->device, &event);
+}
+
+//Called by drivers when a request has completed
+void IoBlockRequestDone(IoBlockRequest * request, int result)
+{
+	IoBlockQueue * queue = request->queue;
+	IoBlockRequest * first = ListEntry(queue->active.next, IoBlockRequest, listItem);
+	bool merged = (request->count != first->count);
+	bool bounced = (request->vec == NULL && request->buffer != first->buffer);
+	bool retry = (merged && result != 0);
+	unsigned long long now = rdtsc();
+
+	IoBlockQueueAccount(queue, request->type, result == 0 ? request->count : 0,
+			now - queue->dispatchTime);
+
+	if(IoBlockTraceEnabled)
+	{
+		TraceRequest(queue, request, result, merged, now);
+	}
+
+	//Complete each submitted request
+	IoBlockRequest * submitted;
+	IoBlockRequest * tmpSubmitted;
+	ListForEachEntrySafe(submitted, tmpSubmitted, &queue->active, listItem)
+	{
+		ListDeleteInit(&submitted->listItem);
+
+		if(retry)
+		{
+			//Merged request failed, so try each request on its own
+			submitted->noMerge = true;
+			AddRequest(queue, submitted);
+			continue;
+		}
+
+		if(bounced && submitted->type == IO_BLKQ_READ)
+		{
+			MemCpy(submitted->buffer,
+					(char *) request->buffer + (unsigned int) (submitted->off - request->off),
+					submitted->count);
+		}
+
+		submitted->result = result;
+		submitted->complete(submitted);
+	}
+
+	if(request->vec)
+	{
+		MemKFree(request->vec);
+	}
+	else if(bounced)
+	{
+		MemVirtualFree(request->buffer);
+	}
+
+	//Start next request
+	queue->busy = false;
+	Dispatch(queue);
+}
+
+//Completion function for IoBlockQueueTransfer
+typedef struct TransferWait
+{
+	ProcWaitQueue waitQueue;
+	bool done;
+
+} TransferWait;
+
+static void TransferComplete(IoBlockRequest * request)
+{
+	TransferWait * wait = request->data;
+
+	wait->done = true;
+	ProcWaitQueueWakeAll(&wait->waitQueue);
+}
+
+//Submits a request to a queue and waits for it to complete
+int IoBlockQueueTransfer(IoBlockQueue * queue, int type, unsigned long long off,
+		void * buffer, unsigned int count)
+{
+	TransferWait wait;
+	IoBlockRequest request;
+
+	ProcWaitQueueInit(&wait.waitQueue);
+	wait.done = false;
+
+	request.type = type;
+	request.off = off;
+	request.buffer = buffer;
+	request.vec = NULL;
+	request.count = count;
+	request.complete = TransferComplete;
+	request.data = &wait;
+
+	IoBlockQueueSubmit(queue, &request);
+
+	while(!wait.done)
+	{
+		ProcWaitQueueWait(&wait.waitQueue, false);
+	}
+
+	return request.result;
+}
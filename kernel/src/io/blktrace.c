@@ -0,0 +1,176 @@
+/*
+ * blktrace.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "errno.h"
+#include "io/blktrace.h"
+#include "io/device.h"
+#include "mm/check.h"
+#include "mm/kmemory.h"
+
+//Block I/O Trace Buffer
+// Writers reserve a slot by atomically incrementing the head sequence number, so an
+// interrupt handler can add events while a thread is in the middle of adding one.
+// The sequence number in a slot is cleared while the event is being written and set
+// when it is complete. The reader uses it to detect events which are not finished
+// or which were overwritten while being copied.
+
+#define TRACE_MASK (IO_BTRACE_EVENTS - 1)
+
+bool IoBlockTraceEnabled;
+
+//Ring buffer and sequence numbers of the next event to write / read
+static IoBlockTraceEvent * traceBuffer;
+static unsigned int traceHead;
+static unsigned int traceTail;
+
+//Prevents the compiler moving memory accesses across this point
+#define TRACE_BARRIER() asm volatile("" ::: "memory")
+
+//Records a trace event
+void IoBlockTraceAdd(IoDevice * device, IoBlockTraceEvent * event)
+{
+	if(!IoBlockTraceEnabled)
+	{
+		return;
+	}
+
+	//Reserve slot
+	unsigned int sequence = __sync_fetch_and_add(&traceHead, 1);
+	IoBlockTraceEvent * slot = &traceBuffer[sequence & TRACE_MASK];
+
+	slot->sequence = 0;
+	TRACE_BARRIER();
+
+	//Fill in event
+	event->sequence = 0;
+	event->reserved = 0;
+
+	unsigned int nameLen = StrLen(device->name, sizeof(event->device));
+	MemCpy(event->device, device->name, nameLen);
+	MemSet(event->device + nameLen, 0, sizeof(event->device) - nameLen);
+
+	MemCpy(slot, event, sizeof(IoBlockTraceEvent));
+	TRACE_BARRIER();
+
+	slot->sequence = sequence + 1;
+}
+
+//Reads (and removes) events from the trace buffer
+static int TraceDeviceRead(IoDevice * device, unsigned long long off, void * buffer, unsigned int count)
+{
+	IGNORE_PARAM device;
+	IGNORE_PARAM off;
+
+	char * output = buffer;
+	unsigned int done = 0;
+
+	if(!MemCommitForWrite(buffer, count))
+	{
+		return -EFAULT;
+	}
+
+	while(count - done >= sizeof(IoBlockTraceEvent) && traceTail != traceHead)
+	{
+		//Skip overwritten events
+		if(traceHead - traceTail > IO_BTRACE_EVENTS)
+		{
+			traceTail = traceHead - IO_BTRACE_EVENTS;
+		}
+
+		IoBlockTraceEvent event;
+		MemCpy(&event, &traceBuffer[traceTail & TRACE_MASK], sizeof(IoBlockTraceEvent));
+		TRACE_BARRIER();
+
+		//Event was overwritten while being copied
+		if(traceHead - traceTail > IO_BTRACE_EVENTS)
+		{
+			continue;
+		}
+
+		//Event is still being written
+		if(event.sequence != traceTail + 1)
+		{
+			break;
+		}
+
+		MemCpy(output + done, &event, sizeof(IoBlockTraceEvent));
+		done += sizeof(IoBlockTraceEvent);
+		traceTail++;
+	}
+
+	return done;
+}
+
+//Enables or disables tracing
+static int TraceDeviceWrite(IoDevice * device, unsigned long long off, void * buffer, unsigned int count)
+{
+	IGNORE_PARAM device;
+	IGNORE_PARAM off;
+
+	if(count == 0)
+	{
+		return 0;
+	}
+
+	if(!MemCommitForRead(buffer, 1))
+	{
+		return -EFAULT;
+	}
+
+	switch(*(char *) buffer)
+	{
+		case '0':
+			IoBlockTraceEnabled = false;
+			break;
+
+		case '1':
+			IoBlockTraceEnabled = true;
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	return count;
+}
+
+static IoDeviceOps traceDeviceOps =
+{
+	.read = TraceDeviceRead,
+	.write = TraceDeviceWrite,
+};
+
+static IoDevice traceDevice =
+{
+	.name = "blktrace",
+	.mode = IO_DEV_CHAR | IO_OWNER_READ | IO_OWNER_WRITE,
+	.devOps = &traceDeviceOps,
+};
+
+//Allocates the trace buffer and registers the trace device
+void INIT IoBlockTraceInit()
+{
+	traceBuffer = MemVirtualAlloc(IO_BTRACE_EVENTS * sizeof(IoBlockTraceEvent));
+	IoBlockTraceEnabled = true;
+
+	IoDevFsRegister(&traceDevice);
+}
@@ -26,6 +26,7 @@
 #include "io/bcache.h"
 #include "htable.h"
 #include "errno.h"
+#include "mm/check.h"
 
 #define MAX_DEVICES 1024
 #define GET_DEVICE(var, inode) IoDevice * var; \
@@ -256,8 +257,16 @@ static int DevFsRead(IoFile * file, void * buffer, unsigned int count)
 	int res;
 	if(device->blockCache != NULL && IO_ISBLOCK(device->mode))
 	{
-		//Go via block cache
-		res = IoBlockCacheReadBuffer(device, file->off, buffer, count);
+		if(file->flags & IO_O_DIRECT)
+		{
+			//Bypass block cache
+			res = IoBlockCacheReadDirect(device, file->off, buffer, count);
+		}
+		else
+		{
+			//Go via block cache
+			res = IoBlockCacheReadBuffer(device, file->off, buffer, count);
+		}
 	}
 	else
 	{
@@ -284,8 +293,16 @@ static int DevFsWrite(IoFile * file, void * buffer, unsigned int count)
 	int res;
 	if(device->blockCache != NULL && IO_ISBLOCK(device->mode))
 	{
-		//Go via block cache
-		res = IoBlockCacheWriteBuffer(device, file->off, buffer, count);
+		if(file->flags & IO_O_DIRECT)
+		{
+			//Bypass block cache
+			res = IoBlockCacheWriteDirect(device, file->off, buffer, count);
+		}
+		else
+		{
+			//Go via block cache
+			res = IoBlockCacheWriteBuffer(device, file->off, buffer, count);
+		}
 	}
 	else
 	{
@@ -308,6 +325,18 @@ static int DevFsIoCtl(IoFile * file, int request, void * data)
 	//Forward to device
 	GET_DEVICE(device, file->iNode);
 
+	//Block cache statistics are handled here for all block devices
+	if(request == IO_BCACHE_IOCTL_STATS && device->blockCache != NULL && IO_ISBLOCK(device->mode))
+	{
+		if(!MemCommitForWrite(data, sizeof(IoBlockCacheStats)))
+		{
+			return -EFAULT;
+		}
+
+		IoBlockCacheGetStats(device->blockCache, data);
+		return 0;
+	}
+
 	if(device->devOps->ioctl)
 	{
 		return device->devOps->ioctl(device, request, data);
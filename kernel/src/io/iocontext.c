@@ -22,6 +22,7 @@
 #include "chaff.h"
 #include "process.h"
 #include "io/iocontext.h"
+#include "io/pagecache.h"
 #include "errno.h"
 #include "mm/check.h"
 #include "mm/kmemory.h"
@@ -71,6 +72,11 @@ static int IoReleaseFile(IoFile * file, IoContext * context, int fd)
 		if(context->files[fd] == file)
 		{
 			//Free file
+			if(file->pageCache)
+			{
+				IoPageCacheRelease(file->pageCache);
+			}
+
 			MemKFree(file);
 
 			//Delete descriptor reference
@@ -272,8 +278,18 @@ int IoRead(IoContext * context, int fd, void * buffer, int count)
 	}
 	else
 	{
-		//Forward to filesystem
-		if(file->ops->read)
+		//Forward to page cache or filesystem
+		if(file->pageCache)
+		{
+			res = IoPageCacheRead(file, buffer, count);
+
+			//Advance offset
+			if(res > 0)
+			{
+				file->off += res;
+			}
+		}
+		else if(file->ops->read)
 		{
 			res = file->ops->read(file, buffer, count);
 
@@ -317,8 +333,18 @@ int IoWrite(IoContext * context, int fd, void * buffer, int count)
 	}
 	else
 	{
-		//Forward to filesystem
-		if(file->ops->write)
+		//Forward to page cache or filesystem
+		if(file->pageCache)
+		{
+			res = IoPageCacheWrite(file, buffer, count);
+
+			//Advance offset
+			if(res > 0)
+			{
+				file->off += res;
+			}
+		}
+		else if(file->ops->write)
 		{
 			res = file->ops->write(file, buffer, count);
 
@@ -373,6 +399,12 @@ int IoTruncate(IoContext * context, int fd, unsigned long long size)
 	if(file->ops->truncate)
 	{
 		res = file->ops->truncate(file, size);
+
+		//Discard cached pages past the end
+		if(res == 0 && file->pageCache)
+		{
+			IoPageCacheTruncate(file->pageCache, size);
+		}
 	}
 	else
 	{
@@ -22,8 +22,9 @@
 #include "chaff.h"
 #include "io/fs.h"
 #include "io/device.h"
+#include "io/pagecache.h"
 #include "list.h"
-#include "htable.h"
+#include "imap.h"
 #include "errno.h"
 #include "mm/kmemory.h"
 
@@ -146,7 +147,7 @@ int IoFilesystemMount(IoFilesystemType * type, struct IoDevice * device,
 	unsigned int parentINode = onto->number;
 
 	//Check if mount point is already mounted
-	if(HashTableFind(&parent->mountPoints, &parentINode, sizeof(unsigned int)) != NULL)
+	if(IntMapFind(&parent->mountPoints, parentINode) != NULL)
 	{
 		return -EBUSY;
 	}
@@ -159,8 +160,7 @@ int IoFilesystemMount(IoFilesystemType * type, struct IoDevice * device,
 	int res = IoFilesystemMountInternal(type, device, flags, &newFs, parent, parentINode);
 
 	//Insert mount point
-	if(res == 0 && HashTableInsert(&parent->mountPoints, &newFs->mountItem,
-			&newFs->parentINode, sizeof(unsigned int)))
+	if(res == 0 && IntMapInsert(&parent->mountPoints, newFs->parentINode, newFs))
 	{
 		//Mounted
 		return 0;
@@ -209,7 +209,7 @@ int IoFilesystemMountRoot(IoFilesystemType * type, struct IoDevice * device, int
 int IoFilesystemUnMount(IoFilesystem * fs)
 {
 	//Check if filesystem is in use
-	if(fs->refCount > 0 || HashTableCount(&fs->mountPoints) > 0)
+	if(fs->refCount > 0 || IntMapCount(&fs->mountPoints) > 0)
 	{
 		return -EBUSY;
 	}
@@ -240,14 +240,24 @@ int IoFilesystemUnMount(IoFilesystem * fs)
 	else
 	{
 		fs->parentFs->refCount--;
-		HashTableRemoveItem(&fs->parentFs->mountPoints, &fs->mountItem);
+
+		//Only remove the mount point if it is this filesystem (a new filesystem whose
+		// mount failed may have lost the mount point to another filesystem)
+		if(IntMapFind(&fs->parentFs->mountPoints, fs->parentINode) == fs)
+		{
+			IntMapRemove(&fs->parentFs->mountPoints, fs->parentINode);
+		}
 	}
 
+	//Discard cached file data
+	IoPageCacheInvalidateFs(fs);
+
 	//Unlock device and type
 	fs->fsType->refCount--;
 	fs->device->mounted = false;
 
 	//Free filesystem
+	IntMapFree(&fs->mountPoints);
 	MemKFree(fs);
 	return 0;
 }
@@ -22,8 +22,9 @@
 #include "chaff.h"
 #include "io/iocontext.h"
 #include "io/fs.h"
+#include "io/pagecache.h"
 #include "errno.h"
-#include "htable.h"
+#include "imap.h"
 #include "mm/kmemory.h"
 
 //IoOpen and IoLookupPath calls
@@ -188,11 +189,11 @@ int IoLookupPath(SecContext * secContext, IoContext * ioContext, const char * pa
 		}
 
 		//Handle mount points
-		HashItem * mountPoint = HashTableFind(&currFs->mountPoints, &currINode, sizeof(unsigned int));
+		IoFilesystem * mountPoint = IntMapFind(&currFs->mountPoints, currINode);
 		if(mountPoint != NULL)
 		{
 			//Translate mount point
-			currFs = HashTableEntry(mountPoint, IoFilesystem, mountItem);
+			currFs = mountPoint;
 			currINode = currFs->rootINode;
 		}
 
@@ -402,10 +403,11 @@ int IoOpen(SecContext * secContext, IoContext * ioContext, const char * path,
 	IoFile * file = MemKAlloc(sizeof(IoFile));
 	file->refCount = 1;
 	file->off = 0;
-	file->flags = flags & (IO_O_RDWR | IO_O_APPEND | IO_O_DIRECTORY);
+	file->flags = flags & (IO_O_RDWR | IO_O_APPEND | IO_O_DIRECTORY | IO_O_DIRECT);
 	file->fs = iNode.fs;
 	file->iNode = iNode.number;
 	file->ops = iNode.ops;
+	file->pageCache = NULL;
 
 	res = file->ops->open(&iNode, file);
 	if(res != 0)
@@ -435,6 +437,28 @@ int IoOpen(SecContext * secContext, IoContext * ioContext, const char * path,
 		}
 	}
 
+	//Attach page cache
+	if(IO_ISREGULAR(iNode.mode) && file->ops->readpage)
+	{
+		if(!(flags & IO_O_DIRECT))
+		{
+			file->pageCache = IoPageCacheGet(&iNode);
+
+			if(flags & IO_O_TRUNC)
+			{
+				IoPageCacheTruncate(file->pageCache, 0);
+			}
+		}
+		else if(flags & IO_O_TRUNC)
+		{
+			//Direct files bypass the page cache, but other openers must not see
+			// the old contents
+			IoPageCache * pageCache = IoPageCacheGet(&iNode);
+			IoPageCacheTruncate(pageCache, 0);
+			IoPageCacheRelease(pageCache);
+		}
+	}
+
 	//Place in context
 	ioContext->files[fd] = file;
 	ioContext->descriptorFlags[fd] = flags & IO_O_CLOEXEC;
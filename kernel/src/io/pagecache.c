@@ -0,0 +1,510 @@
+/*
+ * pagecache.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "errno.h"
+#include "waitqueue.h"
+#include "io/fs.h"
+#include "io/iocontext.h"
+#include "io/pagecache.h"
+#include "mm/check.h"
+#include "mm/kmemory.h"
+#include "mm/physical.h"
+
+//Per-file page cache
+// Pages are stored in one global hash table keyed by (cache, page index) and caches
+// are stored in another keyed by (filesystem, iNode). All pages are kept on a
+// global LRU list which is used for eviction.
+
+//Keys used in the hash tables (these match the layout of the fields in the structures)
+typedef struct PageKey
+{
+	IoPageCache * cache;
+	unsigned int index;
+
+} PageKey;
+
+typedef struct CacheKey
+{
+	IoFilesystem * fs;
+	unsigned int iNode;
+
+} CacheKey;
+
+//Cache limits
+unsigned int IoPageCacheGlobalLimit;
+unsigned int IoPageCacheGlobalPages;
+
+//Global tables
+static HashTable pageTable;
+static HashTable cacheTable;
+static ListHead lruList = LIST_INLINE_INIT(lruList);
+
+//Slab cache for page headers
+static MemCache * pageHeadCache;
+
+//Wait queue for threads waiting for pages to be unlocked
+static ProcWaitQueue pageWaitQueue = LIST_INLINE_INIT(pageWaitQueue);
+
+static unsigned int IoPageCacheShrink(unsigned int pages);
+static MemShrinker pageCacheShrinker = { .shrink = IoPageCacheShrink };
+
+//Returns the offset of the start of a page
+static inline unsigned long long PageOffset(unsigned int index)
+{
+	return ((unsigned long long) index) * PAGE_SIZE;
+}
+
+//Frees a page cache if it is unused and empty
+static void FreeCacheIfUnused(IoPageCache * cache)
+{
+	if(cache->refCount == 0 && cache->pageCount == 0)
+	{
+		HashTableRemoveItem(&cacheTable, &cache->hItem);
+		MemKFree(cache);
+	}
+}
+
+//Frees a page's memory
+static void FreePage(IoPage * page)
+{
+	MemPhysicalFree(MemVirt2Phys(page->address), 1);
+	MemSlabFree(pageHeadCache, page);
+}
+
+//Removes a page from its cache
+// The page is freed now if it is unused, otherwise it is freed when its last user releases it
+static void RemovePage(IoPage * page)
+{
+	IoPageCache * cache = page->cache;
+
+	HashTableRemoveItem(&pageTable, &page->hItem);
+	ListDeleteInit(&page->listItem);
+	ListDeleteInit(&page->lruItem);
+
+	cache->pageCount--;
+	IoPageCacheGlobalPages--;
+	page->cache = NULL;
+
+	if(page->refCount == 0)
+	{
+		FreePage(page);
+	}
+}
+
+//Evicts up to the given number of unused pages
+// Returns the number of pages evicted
+static unsigned int EvictPages(unsigned int pages)
+{
+	unsigned int evicted = 0;
+
+	IoPage * page;
+	IoPage * tmpPage;
+	ListForEachEntrySafe(page, tmpPage, &lruList, lruItem)
+	{
+		if(evicted >= pages)
+		{
+			break;
+		}
+
+		if(page->refCount == 0)
+		{
+			IoPageCache * cache = page->cache;
+
+			RemovePage(page);
+			FreeCacheIfUnused(cache);
+			evicted++;
+		}
+	}
+
+	return evicted;
+}
+
+//Frees pages when memory is short
+static unsigned int IoPageCacheShrink(unsigned int pages)
+{
+	return EvictPages(pages);
+}
+
+//Finds a page in a cache
+static IoPage * FindPage(IoPageCache * cache, unsigned int index)
+{
+	PageKey key = { cache, index };
+	HashItem * item = HashTableFind(&pageTable, &key, sizeof(PageKey));
+
+	if(item)
+	{
+		return HashTableEntry(item, IoPage, hItem);
+	}
+
+	return NULL;
+}
+
+//Creates a new locked page in a cache
+static IoPage * CreatePage(IoPageCache * cache, unsigned int index)
+{
+	//Make room for the page
+	if(IoPageCacheGlobalPages >= IoPageCacheGlobalLimit)
+	{
+		EvictPages(1);
+	}
+
+	IoPage * page = MemSlabAlloc(pageHeadCache);
+	page->address = MemPhys2Virt(MemPhysicalAlloc(1, MEM_KERNEL));
+	page->cache = cache;
+	page->index = index;
+	page->refCount = 1;
+	page->locked = true;
+	page->upToDate = false;
+
+	HashTableInsert(&pageTable, &page->hItem, &page->cache, sizeof(PageKey));
+	ListHeadAddLast(&page->listItem, &cache->pageList);
+	ListHeadAddLast(&page->lruItem, &lruList);
+
+	cache->pageCount++;
+	IoPageCacheGlobalPages++;
+	return page;
+}
+
+//Unlocks a page and wakes up any waiting threads
+static void UnlockPage(IoPage * page)
+{
+	page->locked = false;
+	ProcWaitQueueWakeAll(&pageWaitQueue);
+}
+
+//Gets a page of a file and adds a reference to it
+// If fill is false and the page is not cached, the page is cleared instead of being read
+static int GetPage(IoFile * file, unsigned int index, bool fill, IoPage ** result)
+{
+	IoPageCache * cache = file->pageCache;
+
+	for(;;)
+	{
+		IoPage * page = FindPage(cache, index);
+
+		if(page == NULL)
+		{
+			//Create new page and fill it
+			page = CreatePage(cache, index);
+
+			if(fill && PageOffset(index) < cache->size)
+			{
+				int res = file->ops->readpage(file, index, page->address);
+				if(res != 0)
+				{
+					//Discard page
+					RemovePage(page);
+					UnlockPage(page);
+					IoPageCacheReleasePage(page);
+					return res;
+				}
+			}
+			else
+			{
+				MemSet(page->address, 0, PAGE_SIZE);
+			}
+
+			page->upToDate = true;
+			UnlockPage(page);
+			*result = page;
+			return 0;
+		}
+
+		//Move to end of LRU list
+		page->refCount++;
+		ListDelete(&page->lruItem);
+		ListHeadAddLast(&page->lruItem, &lruList);
+
+		//Wait for any read to finish
+		while(page->locked)
+		{
+			ProcWaitQueueWait(&pageWaitQueue, false);
+		}
+
+		if(page->upToDate && page->cache == cache)
+		{
+			*result = page;
+			return 0;
+		}
+
+		//The read failed or the page was removed, so try again
+		IoPageCacheReleasePage(page);
+	}
+}
+
+//Initializes the page cache
+void INIT IoPageCacheInit()
+{
+	pageHeadCache = MemSlabCreate(sizeof(IoPage), 0);
+
+	//Use up to an eighth of memory for caching
+	IoPageCacheGlobalLimit = MemPhysicalTotalPages / 8;
+
+	MemShrinkerRegister(&pageCacheShrinker);
+}
+
+//Gets the page cache for an iNode
+IoPageCache * IoPageCacheGet(IoINode * iNode)
+{
+	CacheKey key = { iNode->fs, iNode->number };
+	HashItem * item = HashTableFind(&cacheTable, &key, sizeof(CacheKey));
+	IoPageCache * cache;
+
+	if(item)
+	{
+		cache = HashTableEntry(item, IoPageCache, hItem);
+
+		//The file may have been changed while it was not open
+		if(cache->refCount == 0 && cache->size != iNode->size)
+		{
+			IoPageCacheTruncate(cache, 0);
+			cache->size = iNode->size;
+		}
+	}
+	else
+	{
+		//Create new cache
+		cache = MemKZAlloc(sizeof(IoPageCache));
+		cache->fs = iNode->fs;
+		cache->iNode = iNode->number;
+		cache->size = iNode->size;
+		ListHeadInit(&cache->pageList);
+
+		HashTableInsert(&cacheTable, &cache->hItem, &cache->fs, sizeof(CacheKey));
+	}
+
+	cache->refCount++;
+	return cache;
+}
+
+//Releases a page cache obtained with IoPageCacheGet
+void IoPageCacheRelease(IoPageCache * cache)
+{
+	cache->refCount--;
+	FreeCacheIfUnused(cache);
+}
+
+//Reads data from a file using its page cache
+int IoPageCacheRead(IoFile * file, void * buffer, unsigned int count)
+{
+	IoPageCache * cache = file->pageCache;
+	unsigned long long off = file->off;
+
+	//Limit to end of file
+	if(off >= cache->size)
+	{
+		return 0;
+	}
+
+	if(count > cache->size - off)
+	{
+		count = (unsigned int) (cache->size - off);
+	}
+
+	if(!MemCommitForWrite(buffer, count))
+	{
+		return -EFAULT;
+	}
+
+	//Copy each page
+	unsigned int done = 0;
+
+	while(done < count)
+	{
+		unsigned int index = (unsigned int) (off >> 12);
+		unsigned int pageOff = (unsigned int) off & (PAGE_SIZE - 1);
+		unsigned int length = PAGE_SIZE - pageOff;
+
+		if(length > count - done)
+		{
+			length = count - done;
+		}
+
+		IoPage * page;
+		int res = GetPage(file, index, true, &page);
+		if(res != 0)
+		{
+			return done > 0 ? (int) done : res;
+		}
+
+		MemCpy((char *) buffer + done, (char *) page->address + pageOff, length);
+		IoPageCacheReleasePage(page);
+
+		done += length;
+		off += length;
+
+		//File may have been truncated while waiting
+		if(off >= cache->size)
+		{
+			break;
+		}
+	}
+
+	return done;
+}
+
+//Writes data to a file using its page cache
+int IoPageCacheWrite(IoFile * file, void * buffer, unsigned int count)
+{
+	IoPageCache * cache = file->pageCache;
+
+	if(!MemCommitForRead(buffer, count))
+	{
+		return -EFAULT;
+	}
+
+	if(file->flags & IO_O_APPEND)
+	{
+		file->off = cache->size;
+	}
+
+	//Write each page
+	unsigned long long off = file->off;
+	unsigned int done = 0;
+
+	while(done < count)
+	{
+		unsigned int index = (unsigned int) (off >> 12);
+		unsigned int pageOff = (unsigned int) off & (PAGE_SIZE - 1);
+		unsigned int length = PAGE_SIZE - pageOff;
+
+		if(length > count - done)
+		{
+			length = count - done;
+		}
+
+		//The old data is not needed if everything up to the end of file is overwritten
+		bool fill = (pageOff != 0 || (length != PAGE_SIZE && off + length < cache->size));
+
+		IoPage * page;
+		int res = GetPage(file, index, fill, &page);
+		if(res != 0)
+		{
+			return done > 0 ? (int) done : res;
+		}
+
+		//Wait for other writers
+		while(page->locked)
+		{
+			ProcWaitQueueWait(&pageWaitQueue, false);
+		}
+
+		page->locked = true;
+		MemCpy((char *) page->address + pageOff, (char *) buffer + done, length);
+
+		//Write page to the filesystem
+		unsigned long long newSize = cache->size;
+		unsigned int validLength = PAGE_SIZE;
+
+		if(off + length > newSize)
+		{
+			newSize = off + length;
+		}
+
+		if(newSize - PageOffset(index) < PAGE_SIZE)
+		{
+			validLength = (unsigned int) (newSize - PageOffset(index));
+		}
+
+		res = file->ops->writepage(file, index, page->address, validLength);
+		if(res != 0)
+		{
+			//The cached page no longer matches the file
+			if(page->cache)
+			{
+				RemovePage(page);
+			}
+
+			UnlockPage(page);
+			IoPageCacheReleasePage(page);
+			return done > 0 ? (int) done : res;
+		}
+
+		cache->size = newSize;
+		UnlockPage(page);
+		IoPageCacheReleasePage(page);
+
+		done += length;
+		off += length;
+	}
+
+	return done;
+}
+
+//Updates a page cache after its file has been truncated
+void IoPageCacheTruncate(IoPageCache * cache, unsigned long long size)
+{
+	IoPage * page;
+	IoPage * tmpPage;
+	ListForEachEntrySafe(page, tmpPage, &cache->pageList, listItem)
+	{
+		unsigned long long start = PageOffset(page->index);
+
+		if(start >= size)
+		{
+			RemovePage(page);
+		}
+		else if(size - start < PAGE_SIZE)
+		{
+			//Clear data after the end of the file
+			unsigned int end = (unsigned int) (size - start);
+			MemSet((char *) page->address + end, 0, PAGE_SIZE - end);
+		}
+	}
+
+	cache->size = size;
+}
+
+//Discards all the unused page caches on a filesystem
+void IoPageCacheInvalidateFs(IoFilesystem * fs)
+{
+	IoPage * page;
+	IoPage * tmpPage;
+	ListForEachEntrySafe(page, tmpPage, &lruList, lruItem)
+	{
+		IoPageCache * cache = page->cache;
+
+		if(cache->fs == fs && cache->refCount == 0 && page->refCount == 0)
+		{
+			RemovePage(page);
+			FreeCacheIfUnused(cache);
+		}
+	}
+}
+
+//Gets an up to date page of a file
+int IoPageCacheGetPage(IoFile * file, unsigned int index, IoPage ** page)
+{
+	return GetPage(file, index, true, page);
+}
+
+//Releases a page obtained with IoPageCacheGetPage
+void IoPageCacheReleasePage(IoPage * page)
+{
+	page->refCount--;
+
+	//Free pages which were removed while in use
+	if(page->refCount == 0 && page->cache == NULL)
+	{
+		FreePage(page);
+	}
+}
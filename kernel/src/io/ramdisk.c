@@ -0,0 +1,553 @@
+/*
+ * ramdisk.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "io/bcache.h"
+#include "io/blkqueue.h"
+#include "io/device.h"
+#include "io/ramdisk.h"
+#include "errno.h"
+#include "mm/check.h"
+#include "mm/kmemory.h"
+#include "mm/physical.h"
+#include "process.h"
+#include "radix.h"
+#include "timer.h"
+#include "waitqueue.h"
+
+//RAM Disk
+// Data is stored in kernel pages kept in a radix tree indexed by page number.
+//
+// Disks with a profile are simulated by a thread which handles one request at a time.
+// The thread keeps the time the simulated disk becomes idle and sleeps until then.
+// The timer only has a resolution of 10ms, so delays shorter than one tick are added
+// up and slept off together. Individual requests can complete early but the total
+// throughput matches the profile.
+
+const IoRamDiskProfile IoRamDiskProfileSsd = { .latency = 100, .seek = 0, .bandwidth = 400 * 1024 };
+const IoRamDiskProfile IoRamDiskProfileHdd = { .latency = 0, .seek = 8000, .bandwidth = 100 * 1024 };
+
+//Shortest delay which is slept (one timer tick)
+#define RAMDISK_MIN_SLEEP ((((TimerTime) 1) << 32) / 100)
+
+//Converts microseconds to a TimerTime
+#define RAMDISK_US_TO_TIME(us) (((TimerTime) (us)) * 4295)
+
+typedef struct RamDisk
+{
+	IoDevice device;
+	unsigned long long size;
+	RadixTree pages;
+
+	//Simulated timing
+	IoRamDiskProfile profile;
+	TimerTime kbTime;				//Time taken to transfer 1KB
+	TimerTime busyUntil;			//Time the simulated disk finishes its current request
+	unsigned long long headPos;		//Offset after the end of the last request
+
+	//Request being handled by the disk thread
+	IoBlockRequest * pending;
+	ProcWaitQueue waitQueue;
+
+} RamDisk;
+
+static int RamDiskRead(IoDevice * device, unsigned long long off, void * buffer, unsigned int count);
+static int RamDiskWrite(IoDevice * device, unsigned long long off, void * buffer, unsigned int count);
+static int RamDiskWriteV(IoDevice * device, unsigned long long off, IoVec * vec, unsigned int vecCount);
+static void RamDiskSubmit(IoDevice * device, IoBlockRequest * request);
+
+//Operations for disks without a profile
+static IoDeviceOps ramDiskOps =
+{
+	.read = RamDiskRead,
+	.write = RamDiskWrite,
+	.writev = RamDiskWriteV,
+};
+
+//Operations for simulated disks
+static IoDeviceOps ramDiskTimedOps =
+{
+	.submit = RamDiskSubmit,
+};
+
+//Copies data to or from a RAM disk (buffer must be kernel memory or already checked)
+static int RamDiskTransfer(RamDisk * disk, unsigned long long off, char * buffer, unsigned int count, bool write)
+{
+	if(off > disk->size || count > disk->size - off)
+	{
+		return -ENXIO;
+	}
+
+	while(count > 0)
+	{
+		unsigned long long index = off >> 12;
+		unsigned int pageOff = (unsigned int) off & (PAGE_SIZE - 1);
+		unsigned int chunk = PAGE_SIZE - pageOff;
+		char * page = RadixTreeFind(&disk->pages, index);
+
+		if(chunk > count)
+		{
+			chunk = count;
+		}
+
+		if(write)
+		{
+			//Allocate pages when they are first written
+			if(page == NULL)
+			{
+				page = MemPhys2Virt(MemPhysicalAlloc(1, MEM_KERNEL));
+				MemSet(page, 0, PAGE_SIZE);
+				RadixTreeInsert(&disk->pages, index, page);
+			}
+
+			MemCpy(page + pageOff, buffer, chunk);
+		}
+		else if(page == NULL)
+		{
+			MemSet(buffer, 0, chunk);
+		}
+		else
+		{
+			MemCpy(buffer, page + pageOff, chunk);
+		}
+
+		off += chunk;
+		buffer += chunk;
+		count -= chunk;
+	}
+
+	return 0;
+}
+
+//Synchronous device operations
+static int RamDiskRead(IoDevice * device, unsigned long long off, void * buffer, unsigned int count)
+{
+	if(!MemCommitForWrite(buffer, count))
+	{
+		return -EFAULT;
+	}
+
+	return RamDiskTransfer(device->custom, off, buffer, count, false);
+}
+
+static int RamDiskWrite(IoDevice * device, unsigned long long off, void * buffer, unsigned int count)
+{
+	if(!MemCommitForRead(buffer, count))
+	{
+		return -EFAULT;
+	}
+
+	return RamDiskTransfer(device->custom, off, buffer, count, true);
+}
+
+static int RamDiskWriteV(IoDevice * device, unsigned long long off, IoVec * vec, unsigned int vecCount)
+{
+	for(unsigned int i = 0; i < vecCount; i++)
+	{
+		int res = RamDiskTransfer(device->custom, off, vec[i].base, vec[i].length, true);
+
+		if(res != 0)
+		{
+			return res;
+		}
+
+		off += vec[i].length;
+	}
+
+	return 0;
+}
+
+//Starts a request on a simulated disk
+static void RamDiskSubmit(IoDevice * device, IoBlockRequest * request)
+{
+	RamDisk * disk = device->custom;
+
+	disk->pending = request;
+	ProcWaitQueueWakeAll(&disk->waitQueue);
+}
+
+//Returns the time the simulated disk takes to handle a request
+static TimerTime RequestTime(RamDisk * disk, IoBlockRequest * request)
+{
+	TimerTime time = RAMDISK_US_TO_TIME(disk->profile.latency);
+
+	if(request->off != disk->headPos)
+	{
+		time += RAMDISK_US_TO_TIME(disk->profile.seek);
+	}
+
+	return time + ((request->count + 1023) >> 10) * disk->kbTime;
+}
+
+//Handles the requests of a simulated disk
+static int NORETURN RamDiskThread(void * arg)
+{
+	RamDisk * disk = arg;
+
+	for(;;)
+	{
+		//Wait for request
+		while(disk->pending == NULL)
+		{
+			ProcWaitQueueWait(&disk->waitQueue, false);
+		}
+
+		IoBlockRequest * request = disk->pending;
+
+		//Work out when the disk finishes the request
+		TimerTime now = TimerGetTime();
+
+		if(disk->busyUntil < now)
+		{
+			disk->busyUntil = now;
+		}
+
+		disk->busyUntil += RequestTime(disk, request);
+		disk->headPos = request->off + request->count;
+
+		if(disk->busyUntil - now >= RAMDISK_MIN_SLEEP)
+		{
+			TimerSleep(disk->busyUntil - now);
+		}
+
+		//Do the transfer
+		int res = RamDiskTransfer(disk, request->off, request->buffer, request->count,
+				request->type == IO_BLKQ_WRITE);
+
+		//The next request may be submitted from IoBlockRequestDone
+		disk->pending = NULL;
+		IoBlockRequestDone(request, res);
+	}
+}
+
+//Creates a RAM disk and registers it with devfs
+IoDevice * IoRamDiskCreate(const char * name, unsigned int size,
+		unsigned int blockSize, int cacheFlags, const IoRamDiskProfile * profile)
+{
+	//Check block size
+	if(blockSize == 0 || (blockSize & (blockSize - 1)) != 0)
+	{
+		PrintLog(Error, "IoRamDiskCreate: block size must be a power of 2");
+		return NULL;
+	}
+
+	//Round size up to whole blocks
+	RamDisk * disk = MemKZAlloc(sizeof(RamDisk));
+	disk->size = ((unsigned long long) size + blockSize - 1) & ~((unsigned long long) blockSize - 1);
+	ProcWaitQueueInit(&disk->waitQueue);
+
+	//Setup device
+	IoDevice * device = &disk->device;
+	device->name = StrDup(name, 64);
+	device->mode = IO_DEV_BLOCK | IO_OWNER_READ | IO_OWNER_WRITE;
+	device->devOps = &ramDiskOps;
+	device->custom = disk;
+
+	if(profile != NULL)
+	{
+		disk->profile = *profile;
+		device->devOps = &ramDiskTimedOps;
+
+		if(profile->bandwidth != 0)
+		{
+			disk->kbTime = 0xFFFFFFFFU / profile->bandwidth;
+		}
+	}
+
+	//Create cache and register
+	device->blockCache = IoBlockCacheCreate(device, blockSize, cacheFlags);
+	if(device->blockCache == NULL)
+	{
+		MemKFree(device->name);
+		MemKFree(disk);
+		return NULL;
+	}
+
+	int res = IoDevFsRegister(device);
+	if(res != 0)
+	{
+		PrintLog(Error, "IoRamDiskCreate: could not register device (error %i)", res);
+		IoBlockCacheDestroy(device->blockCache);
+		MemKFree(device->name);
+		MemKFree(disk);
+		return NULL;
+	}
+
+	//Start simulation thread
+	if(profile != NULL)
+	{
+		ProcWakeUp(ProcCreateKernelThread("kramdisk", RamDiskThread, disk));
+	}
+
+	return device;
+}
+
+//Copies data into a RAM disk without going through its block cache
+int IoRamDiskLoad(IoDevice * device, unsigned int off, const void * data, unsigned int length)
+{
+	RamDisk * disk = device->custom;
+	const char * ptr = data;
+
+	//Pages which are all zeros are left unallocated
+	while(length > 0)
+	{
+		unsigned int chunk = PAGE_SIZE - (off & (PAGE_SIZE - 1));
+		bool empty = true;
+
+		if(chunk > length)
+		{
+			chunk = length;
+		}
+
+		for(unsigned int i = 0; i < chunk; i++)
+		{
+			if(ptr[i] != 0)
+			{
+				empty = false;
+				break;
+			}
+		}
+
+		if(!empty)
+		{
+			int res = RamDiskTransfer(disk, off, (char *) ptr, chunk, true);
+
+			if(res != 0)
+			{
+				return res;
+			}
+		}
+		else if(off + chunk > disk->size)
+		{
+			return -ENXIO;
+		}
+
+		off += chunk;
+		ptr += chunk;
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+//Returns true if str starts with prefix
+static bool StartsWith(const char * str, const char * prefix)
+{
+	while(*prefix)
+	{
+		if(*str++ != *prefix++)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//Finds the value of an option on the command line (NULL if the option isn't there)
+// The value ends at the next space
+static const char * FindOption(const char * cmdLine, const char * name)
+{
+	unsigned int nameLen = StrLen(name, 64);
+
+	while(*cmdLine)
+	{
+		if(StartsWith(cmdLine, name) && cmdLine[nameLen] == '=')
+		{
+			return cmdLine + nameLen + 1;
+		}
+
+		//Skip to next word
+		while(*cmdLine && *cmdLine != ' ')
+		{
+			cmdLine++;
+		}
+
+		while(*cmdLine == ' ')
+		{
+			cmdLine++;
+		}
+	}
+
+	return NULL;
+}
+
+//Parses a number with an optional K or M suffix
+static unsigned int ParseNumber(const char * str)
+{
+	unsigned int value = 0;
+
+	while(*str >= '0' && *str <= '9')
+	{
+		value = value * 10 + (*str++ - '0');
+	}
+
+	if(*str == 'K' || *str == 'k')
+	{
+		value <<= 10;
+	}
+	else if(*str == 'M' || *str == 'm')
+	{
+		value <<= 20;
+	}
+
+	return value;
+}
+
+//Parses a numeric option (returns def if it isn't there)
+static unsigned int NumberOption(const char * cmdLine, const char * name, unsigned int def)
+{
+	const char * value = FindOption(cmdLine, name);
+
+	return value ? ParseNumber(value) : def;
+}
+
+//Parses the block cache flags option
+static int CacheFlagsOption(const char * cmdLine)
+{
+	const char * value = FindOption(cmdLine, "ramdisk.cache");
+	int flags = 0;
+
+	while(value != NULL && *value && *value != ' ')
+	{
+		if(StartsWith(value, "writeback"))
+		{
+			flags |= IO_BCACHE_WRITEBACK;
+		}
+		else if(StartsWith(value, "arc"))
+		{
+			flags |= IO_BCACHE_ARC;
+		}
+		else if(StartsWith(value, "compress"))
+		{
+			flags |= IO_BCACHE_COMPRESS;
+		}
+		else if(StartsWith(value, "checksum"))
+		{
+			flags |= IO_BCACHE_CHECKSUM;
+		}
+
+		//Next flag
+		while(*value && *value != ' ' && *value != ',')
+		{
+			value++;
+		}
+
+		if(*value == ',')
+		{
+			value++;
+		}
+	}
+
+	return flags;
+}
+
+//Creates the RAM disk given on the kernel command line or as a boot module
+void INIT IoRamDiskInit(multiboot_info_t * bootInfo)
+{
+	const char * cmdLine = "";
+	multiboot_module_t * image = NULL;
+
+	if(bootInfo->flags & MULTIBOOT_INFO_CMDLINE)
+	{
+		cmdLine = (const char *) ((unsigned int) KERNEL_VIRTUAL_BASE + bootInfo->cmdline);
+	}
+
+	//Find disk image
+	if(bootInfo->flags & MULTIBOOT_INFO_MODS)
+	{
+		unsigned long modules = (unsigned int) KERNEL_VIRTUAL_BASE + bootInfo->mods_addr;
+
+		MODULES_FOREACH(module, modules, bootInfo->mods_count)
+		{
+			if(module->cmdline != 0 &&
+				StartsWith((const char *) ((unsigned int) KERNEL_VIRTUAL_BASE + module->cmdline), "ramdisk"))
+			{
+				image = module;
+				break;
+			}
+		}
+	}
+
+	//Get size
+	unsigned int imageSize = image ? image->mod_end - image->mod_start : 0;
+	unsigned int size = NumberOption(cmdLine, "ramdisk", imageSize);
+
+	if(size == 0)
+	{
+		return;
+	}
+	else if(size < imageSize)
+	{
+		PrintLog(Warning, "IoRamDiskInit: ramdisk size is smaller than the image, using image size");
+		size = imageSize;
+	}
+
+	//Get profile
+	const char * profileName = FindOption(cmdLine, "ramdisk.profile");
+	IoRamDiskProfile profile = { 0, 0, 0 };
+	bool timed = false;
+
+	if(profileName != NULL && StartsWith(profileName, "ssd"))
+	{
+		profile = IoRamDiskProfileSsd;
+		timed = true;
+	}
+	else if(profileName != NULL && StartsWith(profileName, "hdd"))
+	{
+		profile = IoRamDiskProfileHdd;
+		timed = true;
+	}
+
+	if(FindOption(cmdLine, "ramdisk.latency") || FindOption(cmdLine, "ramdisk.seek") ||
+			FindOption(cmdLine, "ramdisk.bandwidth"))
+	{
+		profile.latency = NumberOption(cmdLine, "ramdisk.latency", profile.latency);
+		profile.seek = NumberOption(cmdLine, "ramdisk.seek", profile.seek);
+		profile.bandwidth = NumberOption(cmdLine, "ramdisk.bandwidth", profile.bandwidth);
+		timed = true;
+	}
+
+	//Create disk
+	IoDevice * device = IoRamDiskCreate("ram0", size, NumberOption(cmdLine, "ramdisk.blocksize", PAGE_SIZE),
+			CacheFlagsOption(cmdLine), timed ? &profile : NULL);
+
+	if(device == NULL)
+	{
+		return;
+	}
+
+	//Load image
+	if(image != NULL)
+	{
+		if(image->mod_end > MEM_KFIXED_MAX - (unsigned int) KERNEL_VIRTUAL_BASE)
+		{
+			PrintLog(Error, "IoRamDiskInit: ramdisk image is not in kernel memory");
+		}
+		else
+		{
+			IoRamDiskLoad(device, 0, (void *) ((unsigned int) KERNEL_VIRTUAL_BASE + image->mod_start), imageSize);
+		}
+	}
+
+	PrintLog(Info, "IoRamDiskInit: created ram0 (%u KB, profile latency %uus seek %uus bandwidth %u KB/s)",
+			(unsigned int) (size >> 10), profile.latency, profile.seek, profile.bandwidth);
+}
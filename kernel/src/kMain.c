@@ -27,8 +27,14 @@
 #include "timer.h"
 #include "io/device.h"
 #include "cpu.h"
+#include "crc32c.h"
 #include "mm/kmemory.h"
+#include "mm/physical.h"
+#include "mm/region.h"
 #include "io/bcache.h"
+#include "io/blktrace.h"
+#include "io/pagecache.h"
+#include "io/ramdisk.h"
 #include "processInt.h"
 
 void INIT NORETURN kMain(unsigned int mBootCode, multiboot_info_t * mBootInfo)
@@ -51,10 +57,19 @@ void INIT NORETURN kMain(unsigned int mBootCode, multiboot_info_t * mBootInfo)
 
 	// Other Initializations
 	CpuInitLate();
+	Crc32cInit();
 	TimerInit();
 	ProcInit();
+	MemPhysicalInitLate();
+	MemCompactInit();
+	MemWorkingSetInit();
+	MemBalloonInit();
 	IoBlockCacheInit();
+	IoPageCacheInit();
 	IoDevFsInit();
+	IoBlockCacheStatsInit();
+	IoBlockTraceInit();
+	IoRamDiskInit(mBootInfo);
 
 	// Exit boot mode
 	MemFreeInitPages();
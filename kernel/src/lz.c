@@ -0,0 +1,262 @@
+/*
+ * lz.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "lz.h"
+
+//LZ77 Codec
+// Each sequence is:
+//  token      high 4 bits = literal length, low 4 bits = match length - LZ_MIN_MATCH
+//             (a nibble of 15 means the length continues in following bytes)
+//  [length]   extra literal length bytes (each 255 means another byte follows)
+//  literals
+//  offset     2 byte little endian distance back to the match
+//  [length]   extra match length bytes
+// The last sequence only contains literals.
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_BITS	12
+
+//Positions of recently seen 4 byte sequences
+static unsigned short hashTable[1 << LZ_HASH_BITS];
+
+//Reads 4 bytes from the input
+static inline unsigned int LzRead32(const unsigned char * ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+//Returns the number of bytes needed to store an extended length
+static inline unsigned int LzExtraBytes(unsigned int length)
+{
+	if(length < 15)
+	{
+		return 0;
+	}
+
+	return (length - 15) / 255 + 1;
+}
+
+//Writes an extended length
+static inline unsigned char * LzWriteLength(unsigned char * out, unsigned int length)
+{
+	if(length >= 15)
+	{
+		length -= 15;
+
+		while(length >= 255)
+		{
+			*out++ = 255;
+			length -= 255;
+		}
+
+		*out++ = (unsigned char) length;
+	}
+
+	return out;
+}
+
+//Writes a sequence to the output
+// Returns the new output position or NULL if the output is full
+static unsigned char * LzEmit(unsigned char * out, unsigned char * outEnd,
+		const unsigned char * literals, unsigned int litLength, unsigned int offset, unsigned int matchLength)
+{
+	unsigned int matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+	unsigned int needed = 1 + LzExtraBytes(litLength) + litLength;
+
+	if(matchLength)
+	{
+		needed += 2 + LzExtraBytes(matchCode);
+	}
+
+	if(needed > (unsigned int) (outEnd - out))
+	{
+		return NULL;
+	}
+
+	//Token and literals
+	*out++ = ((litLength < 15 ? litLength : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+	out = LzWriteLength(out, litLength);
+
+	MemCpy(out, literals, litLength);
+	out += litLength;
+
+	//Match
+	if(matchLength)
+	{
+		*out++ = (unsigned char) offset;
+		*out++ = (unsigned char) (offset >> 8);
+		out = LzWriteLength(out, matchCode);
+	}
+
+	return out;
+}
+
+//Compresses some data
+unsigned int LzCompress(const void * input, unsigned int inLen, void * output, unsigned int outMax)
+{
+	const unsigned char * in = input;
+	unsigned char * out = output;
+	unsigned char * outEnd = out + outMax;
+	unsigned int pos = 0;
+	unsigned int anchor = 0;		//Start of the current run of literals
+
+	if(inLen > LZ_MAX_INPUT)
+	{
+		return 0;
+	}
+
+	MemSet(hashTable, 0, sizeof(hashTable));
+
+	while(pos + LZ_MIN_MATCH <= inLen)
+	{
+		//Lookup and replace hash entry
+		unsigned int sequence = LzRead32(in + pos);
+		unsigned int hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		unsigned int candidate = hashTable[hash];
+
+		hashTable[hash] = (unsigned short) pos;
+
+		if(candidate < pos && pos - candidate <= 0xFFFF && LzRead32(in + candidate) == sequence)
+		{
+			//Extend match
+			unsigned int length = LZ_MIN_MATCH;
+
+			while(pos + length < inLen && in[candidate + length] == in[pos + length])
+			{
+				length++;
+			}
+
+			out = LzEmit(out, outEnd, in + anchor, pos - anchor, pos - candidate, length);
+			if(out == NULL)
+			{
+				return 0;
+			}
+
+			pos += length;
+			anchor = pos;
+		}
+		else
+		{
+			pos++;
+		}
+	}
+
+	//Write remaining literals
+	out = LzEmit(out, outEnd, in + anchor, inLen - anchor, 0, 0);
+	if(out == NULL)
+	{
+		return 0;
+	}
+
+	return out - (unsigned char *) output;
+}
+
+//Reads an extended length
+// Returns false if the input ends
+static inline bool LzReadLength(const unsigned char ** in, const unsigned char * inEnd, unsigned int * length)
+{
+	if(*length == 15)
+	{
+		unsigned char value;
+
+		do
+		{
+			if(*in >= inEnd)
+			{
+				return false;
+			}
+
+			value = *(*in)++;
+			*length += value;
+		}
+		while(value == 255);
+	}
+
+	return true;
+}
+
+//Decompresses some data
+int LzDecompress(const void * input, unsigned int inLen, void * output, unsigned int outMax)
+{
+	const unsigned char * in = input;
+	const unsigned char * inEnd = in + inLen;
+	unsigned char * out = output;
+	unsigned char * outEnd = out + outMax;
+
+	while(in < inEnd)
+	{
+		unsigned int token = *in++;
+
+		//Copy literals
+		unsigned int length = token >> 4;
+
+		if(!LzReadLength(&in, inEnd, &length) ||
+				length > (unsigned int) (inEnd - in) || length > (unsigned int) (outEnd - out))
+		{
+			return -1;
+		}
+
+		MemCpy(out, in, length);
+		in += length;
+		out += length;
+
+		//The last sequence has no match
+		if(in == inEnd)
+		{
+			break;
+		}
+
+		//Copy match
+		if(inEnd - in < 2)
+		{
+			return -1;
+		}
+
+		unsigned int offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		length = token & 15;
+
+		if(!LzReadLength(&in, inEnd, &length))
+		{
+			return -1;
+		}
+
+		length += LZ_MIN_MATCH;
+
+		if(offset == 0 || offset > (unsigned int) (out - (unsigned char *) output) ||
+				length > (unsigned int) (outEnd - out))
+		{
+			return -1;
+		}
+
+		//Copy bytes one at a time since the match can overlap the output
+		const unsigned char * match = out - offset;
+
+		while(length-- > 0)
+		{
+			*out++ = *match++;
+		}
+	}
+
+	return out - (unsigned char *) output;
+}
@@ -0,0 +1,533 @@
+/*
+ * balloon.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "inlineasm.h"
+#include "interrupt.h"
+#include "list.h"
+#include "pci.h"
+#include "process.h"
+#include "timer.h"
+#include "waitqueue.h"
+#include "mm/kmemory.h"
+#include "mm/misc.h"
+#include "mm/physical.h"
+
+//Virtio memory balloon driver (legacy PCI interface)
+// The host sets a target number of pages. The driver inflates the balloon by allocating
+// pages and telling the host it can reuse them, and deflates it by giving them back.
+
+//PCI ids
+#define VIRTIO_VENDOR				0x1AF4
+#define VIRTIO_BALLOON_DEVICE		0x1002
+
+//Legacy virtio registers (offsets from the IO base)
+#define VIRTIO_REG_DEVICE_FEATURES	0x00
+#define VIRTIO_REG_GUEST_FEATURES	0x04
+#define VIRTIO_REG_QUEUE_ADDRESS	0x08
+#define VIRTIO_REG_QUEUE_SIZE		0x0C
+#define VIRTIO_REG_QUEUE_SELECT		0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY		0x10
+#define VIRTIO_REG_STATUS			0x12
+#define VIRTIO_REG_ISR				0x13
+#define VIRTIO_REG_NUM_PAGES		0x14	//Balloon config - target size
+#define VIRTIO_REG_ACTUAL			0x18	//Balloon config - current size
+
+//Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE	1
+#define VIRTIO_STATUS_DRIVER		2
+#define VIRTIO_STATUS_DRIVER_OK		4
+#define VIRTIO_STATUS_FAILED		128
+
+//ISR status bits
+#define VIRTIO_ISR_QUEUE			1
+#define VIRTIO_ISR_CONFIG			2
+
+//Queue indexes
+#define BALLOON_INFLATE_QUEUE		0
+#define BALLOON_DEFLATE_QUEUE		1
+
+//Maximum number of pages sent to the host in one request
+#define BALLOON_BATCH				256
+
+//Number of free pages the balloon will always leave
+#define BALLOON_MIN_FREE			1024
+
+//Seconds the balloon will not inflate for after being deflated by memory pressure
+#define BALLOON_BACKOFF				10
+
+//Virtqueue descriptor
+typedef struct VirtqDesc
+{
+	unsigned long long addr;
+	unsigned int len;
+	unsigned short flags;
+	unsigned short next;
+
+} VirtqDesc;
+
+//Virtqueue available ring
+typedef struct VirtqAvail
+{
+	unsigned short flags;
+	unsigned short idx;
+	unsigned short ring[];
+
+} VirtqAvail;
+
+//Virtqueue used ring
+typedef struct VirtqUsed
+{
+	unsigned short flags;
+	unsigned short idx;
+
+	struct
+	{
+		unsigned int id;
+		unsigned int len;
+	} ring[];
+
+} VirtqUsed;
+
+//A virtqueue used to send page numbers to the host
+// Only one request is ever outstanding on each queue
+typedef struct BalloonQueue
+{
+	unsigned short index;
+	unsigned short size;
+
+	volatile VirtqDesc * desc;
+	volatile VirtqAvail * avail;
+	volatile VirtqUsed * used;
+
+	unsigned int pfns[BALLOON_BATCH];
+
+} BalloonQueue;
+
+//Chunk of the list of pages in the balloon
+#define BALLOON_CHUNK_PAGES ((PAGE_SIZE - sizeof(ListHead) - sizeof(unsigned int)) / sizeof(MemPhysPage))
+
+typedef struct BalloonChunk
+{
+	ListHead listItem;
+	unsigned int count;
+	MemPhysPage pages[BALLOON_CHUNK_PAGES];
+
+} BalloonChunk;
+
+//Device state
+static unsigned short ioBase;
+static BalloonQueue inflateQueue;
+static BalloonQueue deflateQueue;
+
+//Pages in the balloon
+static ListHead chunks = LIST_INLINE_INIT(chunks);
+static unsigned int balloonPages;
+
+//Pages being deflated by the balloon thread
+// The shrinker can reuse deflateQueue.pfns while the thread is waiting for the host,
+// so the thread frees the pages from this copy
+static MemPhysPage deflatePages[BALLOON_BATCH];
+
+//Time of the last deflation due to memory pressure
+static TimerTime pressureTime;
+static bool pressureDeflated;
+
+//Wait queues for request completion and configuration changes
+static ProcWaitQueue queueWait = LIST_INLINE_INIT(queueWait);
+static ProcWaitQueue configWait = LIST_INLINE_INIT(configWait);
+
+static int NORETURN MemBalloonThread(void * unused);
+static void MemBalloonInterrupt(IntrContext * iContext);
+static unsigned int MemBalloonShrink(unsigned int pages);
+
+static MemShrinker balloonShrinker = { .shrink = MemBalloonShrink };
+
+//Returns the physical address of a kernel pointer
+static inline unsigned int MemBalloonPhysAddr(volatile void * ptr)
+{
+	return (unsigned int) ptr - (unsigned int) KERNEL_VIRTUAL_BASE;
+}
+
+//Sets up one of the device's virtqueues
+static bool MemBalloonQueueInit(BalloonQueue * queue, unsigned short index)
+{
+	//Get queue size
+	outw(ioBase + VIRTIO_REG_QUEUE_SELECT, index);
+	unsigned int size = inw(ioBase + VIRTIO_REG_QUEUE_SIZE);
+
+	if(size == 0 || (size & (size - 1)) != 0)
+	{
+		return false;
+	}
+
+	//Allocate pages for the queue (the used ring must be page aligned)
+	unsigned int availEnd = (16 * size + 6 + 2 * size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	unsigned int usedEnd = (6 + 8 * size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	MemPhysPage page = MemPhysicalAlloc((availEnd + usedEnd) / PAGE_SIZE, MEM_KERNEL);
+	void * base = MemPhys2Virt(page);
+
+	MemSet(base, 0, availEnd + usedEnd);
+
+	//Setup queue structure
+	queue->index = index;
+	queue->size = size;
+	queue->desc = base;
+	queue->avail = base + 16 * size;
+	queue->used = base + availEnd;
+
+	//Tell device where the queue is
+	outd(ioBase + VIRTIO_REG_QUEUE_ADDRESS, page);
+	return true;
+}
+
+//Returns true if the last request on a queue has completed
+static inline bool MemBalloonQueueIdle(BalloonQueue * queue)
+{
+	return queue->used->idx == queue->avail->idx;
+}
+
+//Sends the page numbers in a queue's buffer to the host
+static void MemBalloonQueueSubmit(BalloonQueue * queue, unsigned int count)
+{
+	//Wait for previous request (can only be here in the shrinker)
+	while(!MemBalloonQueueIdle(queue))
+	{
+		asm volatile("pause");
+	}
+
+	//Setup descriptor
+	queue->desc[0].addr = MemBalloonPhysAddr(queue->pfns);
+	queue->desc[0].len = count * sizeof(unsigned int);
+	queue->desc[0].flags = 0;
+	queue->desc[0].next = 0;
+
+	//Add to available ring and notify device
+	queue->avail->ring[queue->avail->idx & (queue->size - 1)] = 0;
+	asm volatile("":::"memory");
+	queue->avail->idx++;
+	asm volatile("":::"memory");
+
+	outw(ioBase + VIRTIO_REG_QUEUE_NOTIFY, queue->index);
+}
+
+//Sends the page numbers in a queue's buffer to the host and waits for the reply
+static void MemBalloonQueueSubmitWait(BalloonQueue * queue, unsigned int count)
+{
+	MemBalloonQueueSubmit(queue, count);
+
+	while(!MemBalloonQueueIdle(queue))
+	{
+		ProcWaitQueueWait(&queueWait, false);
+	}
+}
+
+//Adds a page to the list of pages in the balloon
+static void MemBalloonPush(MemPhysPage page)
+{
+	BalloonChunk * chunk = NULL;
+
+	if(!ListEmpty(&chunks))
+	{
+		chunk = ListEntry(chunks.prev, BalloonChunk, listItem);
+	}
+
+	//Allocate new chunk if full
+	if(chunk == NULL || chunk->count == BALLOON_CHUNK_PAGES)
+	{
+		chunk = MemKAlloc(sizeof(BalloonChunk));
+		chunk->count = 0;
+		ListHeadAddLast(&chunk->listItem, &chunks);
+	}
+
+	chunk->pages[chunk->count++] = page;
+	balloonPages++;
+}
+
+//Removes a page from the list of pages in the balloon
+// Empty chunks are not freed here since this is used by the shrinker
+static MemPhysPage MemBalloonPop()
+{
+	BalloonChunk * chunk;
+	ListForEachEntryReverse(chunk, &chunks, listItem)
+	{
+		if(chunk->count > 0)
+		{
+			balloonPages--;
+			return chunk->pages[--chunk->count];
+		}
+	}
+
+	return INVALID_PAGE;
+}
+
+//Frees empty chunks at the end of the page list
+static void MemBalloonTrim()
+{
+	while(!ListEmpty(&chunks))
+	{
+		BalloonChunk * chunk = ListEntry(chunks.prev, BalloonChunk, listItem);
+
+		if(chunk->count != 0)
+		{
+			break;
+		}
+
+		ListDelete(&chunk->listItem);
+		MemKFree(chunk);
+	}
+}
+
+//Inflates the balloon by up to the given number of pages
+static void MemBalloonInflate(unsigned int pages)
+{
+	unsigned int count = 0;
+
+	//Take pages (leaving a reserve of free pages)
+	while(count < pages && MemPhysicalFreePages > BALLOON_MIN_FREE)
+	{
+		inflateQueue.pfns[count++] = MemPhysicalAlloc(1, MEM_HIGHMEM);
+	}
+
+	//Tell host, then add pages to the balloon
+	// The pages are only added afterwards so the shrinker cannot give back pages the
+	// host has not been told about yet
+	if(count > 0)
+	{
+		MemBalloonQueueSubmitWait(&inflateQueue, count);
+
+		for(unsigned int i = 0; i < count; i++)
+		{
+			MemBalloonPush(inflateQueue.pfns[i]);
+		}
+	}
+}
+
+//Deflates the balloon by up to the given number of pages
+static void MemBalloonDeflate(unsigned int pages)
+{
+	unsigned int count = 0;
+
+	//Wait for any shrinker request
+	while(!MemBalloonQueueIdle(&deflateQueue))
+	{
+		ProcWaitQueueWait(&queueWait, false);
+	}
+
+	//Collect pages
+	while(count < pages)
+	{
+		MemPhysPage page = MemBalloonPop();
+
+		if(page == INVALID_PAGE)
+		{
+			break;
+		}
+
+		deflatePages[count] = page;
+		deflateQueue.pfns[count++] = page;
+	}
+
+	//Tell host, then free pages
+	if(count > 0)
+	{
+		MemBalloonQueueSubmitWait(&deflateQueue, count);
+
+		for(unsigned int i = 0; i < count; i++)
+		{
+			MemPhysicalFree(deflatePages[i], 1);
+		}
+	}
+
+	MemBalloonTrim();
+}
+
+//Gives balloon pages back when the system is out of memory
+static unsigned int MemBalloonShrink(unsigned int pages)
+{
+	unsigned int count = 0;
+
+	//Always release a whole batch (the most which fit in one request) to avoid
+	// repeated calls
+	IGNORE_PARAM pages;
+
+	//Wait for the thread's request to finish (this cannot sleep)
+	while(!MemBalloonQueueIdle(&deflateQueue))
+	{
+		asm volatile("pause");
+	}
+
+	//Free pages immediately
+	// VIRTIO_BALLOON_F_MUST_TELL_HOST is never negotiated so the host is told afterwards
+	while(count < BALLOON_BATCH)
+	{
+		MemPhysPage page = MemBalloonPop();
+
+		if(page == INVALID_PAGE)
+		{
+			break;
+		}
+
+		MemPhysicalFree(page, 1);
+		deflateQueue.pfns[count++] = page;
+	}
+
+	if(count > 0)
+	{
+		MemBalloonQueueSubmit(&deflateQueue, count);
+
+		//Stop the balloon inflating again straight away
+		pressureTime = TimerGetTime();
+		pressureDeflated = true;
+
+		PrintLog(Notice, "MemBalloon: deflated %u pages due to memory pressure", count);
+	}
+
+	return count;
+}
+
+//Initializes the balloon driver
+void INIT MemBalloonInit()
+{
+	//Find device
+	PciAddress addr = PciFindDevice(VIRTIO_VENDOR, VIRTIO_BALLOON_DEVICE, 0);
+	if(addr == PCI_INVALID_ADDRESS)
+	{
+		return;
+	}
+
+	//Get IO port
+	unsigned int bar = PciConfigRead(addr, PCI_REG_BAR0);
+	if(!(bar & PCI_BAR_IO))
+	{
+		PrintLog(Error, "MemBalloonInit: virtio balloon has no IO ports");
+		return;
+	}
+
+	ioBase = bar & 0xFFFC;
+
+	//Enable IO and DMA
+	PciConfigWrite(addr, PCI_REG_COMMAND, PciConfigRead(addr, PCI_REG_COMMAND) |
+			PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+	//Reset and identify device
+	outb(ioBase + VIRTIO_REG_STATUS, 0);
+	outb(ioBase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outb(ioBase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	//We don't use any features
+	ind(ioBase + VIRTIO_REG_DEVICE_FEATURES);
+	outd(ioBase + VIRTIO_REG_GUEST_FEATURES, 0);
+
+	//Setup queues
+	if(!MemBalloonQueueInit(&inflateQueue, BALLOON_INFLATE_QUEUE) ||
+		!MemBalloonQueueInit(&deflateQueue, BALLOON_DEFLATE_QUEUE))
+	{
+		PrintLog(Error, "MemBalloonInit: invalid virtio balloon queues");
+		outb(ioBase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+		return;
+	}
+
+	//Register interrupt
+	unsigned int irq = PciConfigRead(addr, PCI_REG_INTERRUPT) & 0xFF;
+	if(!IntrRegister(irq, INTR_SHARED, MemBalloonInterrupt))
+	{
+		PrintLog(Error, "MemBalloonInit: cannot register IRQ %u", irq);
+		outb(ioBase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+		return;
+	}
+
+	//Device is ready
+	outb(ioBase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+			VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	MemShrinkerRegister(&balloonShrinker);
+	ProcWakeUp(ProcCreateKernelThread("kballoon", MemBalloonThread, NULL));
+
+	PrintLog(Info, "MemBalloon: virtio balloon at IO port %#x, IRQ %u", ioBase, irq);
+}
+
+//Balloon interrupt handler
+static void MemBalloonInterrupt(IntrContext * iContext)
+{
+	IGNORE_PARAM iContext;
+
+	//Reading the ISR acknowledges the interrupt
+	unsigned char isr = inb(ioBase + VIRTIO_REG_ISR);
+
+	if(isr & VIRTIO_ISR_QUEUE)
+	{
+		ProcWaitQueueWakeAll(&queueWait);
+	}
+
+	if(isr & VIRTIO_ISR_CONFIG)
+	{
+		ProcWaitQueueWakeAll(&configWait);
+	}
+}
+
+//Balloon thread
+// Moves the balloon towards the size requested by the host
+static int NORETURN MemBalloonThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	for(;;)
+	{
+		unsigned int target = ind(ioBase + VIRTIO_REG_NUM_PAGES);
+
+		//Has the backoff expired?
+		if(pressureDeflated && TimerGetTime() - pressureTime > (((TimerTime) BALLOON_BACKOFF) << 32))
+		{
+			pressureDeflated = false;
+		}
+
+		if(target < balloonPages)
+		{
+			unsigned int pages = balloonPages - target;
+			MemBalloonDeflate(pages < BALLOON_BATCH ? pages : BALLOON_BATCH);
+		}
+		else if(target > balloonPages && !pressureDeflated && MemPhysicalFreePages > BALLOON_MIN_FREE)
+		{
+			unsigned int pages = target - balloonPages;
+			MemBalloonInflate(pages < BALLOON_BATCH ? pages : BALLOON_BATCH);
+		}
+		else
+		{
+			//Report size and wait for something to happen
+			outd(ioBase + VIRTIO_REG_ACTUAL, balloonPages);
+
+			if(target == balloonPages)
+			{
+				ProcWaitQueueWait(&configWait, false);
+			}
+			else
+			{
+				//Can't inflate at the moment, try again later
+				TimerSleep(((TimerTime) 1) << 32);
+			}
+
+			continue;
+		}
+
+		outd(ioBase + VIRTIO_REG_ACTUAL, balloonPages);
+	}
+}
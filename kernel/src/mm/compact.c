@@ -0,0 +1,291 @@
+/*
+ * compact.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "inlineasm.h"
+#include "process.h"
+#include "timer.h"
+#include "mm/physical.h"
+#include "mm/pagingInt.h"
+#include "mm/region.h"
+#include "mm/kmemory.h"
+
+//Physical memory compactor
+// Pages which are only mapped into one user context (pages with an owner) are moved
+// out of a window of memory until the entire window is free.
+
+//Background compactor thread
+static ProcThread * compactThread;
+
+static int NORETURN MemCompactThread(void * unused);
+
+//Returns true if the given page can be moved by the compactor
+static inline bool MemCompactIsMovable(MemPage * page)
+{
+	return page->refCount == 1 && page->owned;
+}
+
+//Finds the window of pages which needs the fewest moves to become free
+// Returns INVALID_PAGE if there are no windows which can be freed
+static MemPhysPage MemCompactFindWindow(MemPhysPage start, MemPhysPage end,
+		unsigned int number, unsigned int * moves)
+{
+	MemPhysPage bestWindow = INVALID_PAGE;
+	unsigned int bestMoves = UINT_MAX;
+
+	//Counters for the current window
+	unsigned int movable = 0;
+	unsigned int unmovable = 0;
+
+	//Slide window over the zone
+	for(MemPhysPage page = start; page < end; page++)
+	{
+		//Add new page to window (pages in uninitialized sections cannot be used)
+		MemPage * state = &MemPageStateTable[page];
+
+		if(!MemPhysicalIsReady(page))
+		{
+			unmovable++;
+		}
+		else if(MemCompactIsMovable(state))
+		{
+			movable++;
+		}
+		else if(state->refCount != 0)
+		{
+			unmovable++;
+		}
+
+		//Remove old page from window
+		if(page - start >= (int) number)
+		{
+			state = &MemPageStateTable[page - number];
+
+			if(!MemPhysicalIsReady(page - number))
+			{
+				unmovable--;
+			}
+			else if(MemCompactIsMovable(state))
+			{
+				movable--;
+			}
+			else if(state->refCount != 0)
+			{
+				unmovable--;
+			}
+		}
+
+		//Is this window better?
+		if(page - start + 1 >= (int) number && unmovable == 0 && movable < bestMoves)
+		{
+			bestWindow = page - number + 1;
+			bestMoves = movable;
+
+			//Can't do better than nothing
+			if(movable == 0)
+			{
+				break;
+			}
+		}
+	}
+
+	*moves = bestMoves;
+	return bestWindow;
+}
+
+//Moves a user page to a new physical page
+static void MemCompactMovePage(MemPhysPage oldPage, MemPhysPage newPage)
+{
+	MemPage * oldState = &MemPageStateTable[oldPage];
+	MemContext * context = oldState->owner;
+	unsigned int addr = oldState->ownerPage * PAGE_SIZE;
+
+	//Copy page contents
+	MemMapPage(MEM_TEMPPAGE1, oldPage);
+	MemMapPage(MEM_TEMPPAGE2, newPage);
+		MemCpy(MEM_TEMPPAGE2, MEM_TEMPPAGE1, PAGE_SIZE);
+	MemUnmapPage(MEM_TEMPPAGE2);
+	MemUnmapPage(MEM_TEMPPAGE1);
+
+	//Update page table entry
+	MemPageTable * table = MemGetPageTable(MemGetPageDirectory(context, addr), addr);
+	table->pageID = newPage;
+
+	if(context == MemCurrentContext)
+	{
+		invlpg((void *) addr);
+	}
+
+	//Transfer ownership
+	// The old page is left allocated so nothing else is placed in the window
+	MemPhysicalSetOwner(newPage, context, (void *) addr);
+	oldState->owned = 0;
+}
+
+//Attempts to create a run of free pages by moving pages out of the way
+bool MemPhysicalCompact(unsigned int number, int zone, unsigned int maxMoves)
+{
+	MemPhysPage start, end;
+
+	//Get zone range
+	if(number == 0 || !MemPhysicalGetZone(zone, &start, &end) || (unsigned int) (end - start) < number)
+	{
+		return false;
+	}
+
+	//Find window to free
+	unsigned int moves;
+	MemPhysPage window = MemCompactFindWindow(start, end, number, &moves);
+
+	if(window == INVALID_PAGE || moves > maxMoves || MemPhysicalFreePages < number)
+	{
+		return false;
+	}
+
+	//Verify the owners really map the pages in the window
+	MemPhysPage windowEnd = window + number;
+
+	for(MemPhysPage page = window; page < windowEnd; page++)
+	{
+		MemPage * state = &MemPageStateTable[page];
+
+		if(MemCompactIsMovable(state))
+		{
+			unsigned int addr = state->ownerPage * PAGE_SIZE;
+			MemPageDirectory * dir = MemGetPageDirectory(state->owner, addr);
+
+			if(!dir->present || !MemGetPageTable(dir, addr)->present ||
+					MemGetPageTable(dir, addr)->pageID != page)
+			{
+				//Page cannot be moved so give up on this window
+				PrintLog(Warning, "MemPhysicalCompact: page %u has a stale owner", page);
+				state->owned = 0;
+				return false;
+			}
+		}
+	}
+
+	//Reserve free pages in the window so new pages are not allocated inside it
+	for(MemPhysPage page = window; page < windowEnd; page++)
+	{
+		if(MemPageStateTable[page].refCount == 0)
+		{
+			MemPageStateTable[page].refCount = 1;
+			MemPageStateTable[page].owned = 0;
+			MemPhysicalFreePages--;
+		}
+	}
+
+	//Move all the user pages out of the window
+	// Destinations are taken from the highest zone possible so compacting a low zone
+	// does not fill it (or the zones below it) with user pages.
+	for(MemPhysPage page = window; page < windowEnd; page++)
+	{
+		if(MemCompactIsMovable(&MemPageStateTable[page]))
+		{
+			MemPhysPage newPage = MemPhysicalAllocAbove(zone);
+
+			if(newPage == INVALID_PAGE)
+			{
+				//Out of destinations, so release the pages which are not in use
+				// (reserved free pages and pages which have already been moved)
+				for(page = window; page < windowEnd; page++)
+				{
+					if(!MemPageStateTable[page].owned)
+					{
+						MemPhysicalFree(page, 1);
+					}
+				}
+
+				return false;
+			}
+
+			MemCompactMovePage(page, newPage);
+		}
+	}
+
+	//Release the entire window
+	MemPhysicalFree(window, number);
+	return true;
+}
+
+//Returns the length of the largest run of free pages in a zone
+unsigned int MemPhysicalLargestFree(int zone)
+{
+	MemPhysPage start, end;
+	unsigned int largest = 0;
+	unsigned int current = 0;
+
+	//Get zone range
+	if(!MemPhysicalGetZone(zone, &start, &end))
+	{
+		return 0;
+	}
+
+	//Find largest run
+	for(MemPhysPage page = start; page < end; page++)
+	{
+		if(MemPhysicalIsReady(page) && MemPageStateTable[page].refCount == 0)
+		{
+			current++;
+
+			if(current > largest)
+			{
+				largest = current;
+			}
+		}
+		else
+		{
+			current = 0;
+		}
+	}
+
+	return largest;
+}
+
+//Starts the background compactor thread
+void INIT MemCompactInit()
+{
+	compactThread = ProcCreateKernelThread("kcompact", MemCompactThread, NULL);
+	ProcWakeUp(compactThread);
+}
+
+//Background compactor thread entry point
+static int NORETURN MemCompactThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	for(;;)
+	{
+		//Wait until next pass
+		TimerSleep(((TimerTime) MEM_COMPACT_INTERVAL) << 32);
+
+		//Compact zones which have enough free memory but no large runs
+		for(int zone = MEM_HIGHMEM; zone >= MEM_DMA; zone--)
+		{
+			if(MemPhysicalFreePages >= 2 * MEM_COMPACT_TARGET &&
+					MemPhysicalLargestFree(zone) < MEM_COMPACT_TARGET)
+			{
+				MemPhysicalCompact(MEM_COMPACT_TARGET, zone, MEM_COMPACT_BATCH);
+			}
+		}
+	}
+}
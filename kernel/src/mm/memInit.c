@@ -253,74 +253,44 @@ void INIT MemManagerInit(multiboot_info_t * bootInfo)
 	}
 
 	//PHASE 3 - Fill memory table
-	// Store table pointer and free everything
+	// Store table pointer
+	//  The table itself is initialized in sections by MemPhysicalInit()
 	MemPageStateTable = (MemPage *) ((tableLocation * 4096) + 0xC0000000);
 	MemPageStateTableEnd = &MemPageStateTable[MemPhysicalTotalPages];
-	MemSet(MemPageStateTable, 0, MemPhysicalTotalPages * sizeof(MemPage));
 
-	// Allocate reserved areas of the memory map
+	// Reserve reserved areas of the memory map
 	unsigned int highestAddr = MemPhysicalTotalPages * 4096;
 	MMAP_FOREACH(mmapEntry, bootInfo->mmap_addr, bootInfo->mmap_length)
 	{
-		//Allocate if correct type
+		//Reserve if correct type
 		if(mmapEntry->type != MULTIBOOT_MEMORY_AVAILABLE && mmapEntry->addr < highestAddr
 				&& (mmapEntry->addr >> 32) == 0)
 		{
-			//Allocate
 			MemPhysPage startPages = mmapEntry->addr / 4096;
 			MemPhysPage endPages = (mmapEntry->len + mmapEntry->addr + 4095) / 4096;
 
 			// Update total
 			MemPhysicalTotalPages -= (endPages - startPages);
-
-			// Set ref counts
-			for(; startPages < endPages; ++startPages)
-			{
-				MemPageStateTable[startPages].refCount = 1;
-			}
+			MemPhysicalReserve(startPages, endPages);
 		}
 	}
 
-	// Allocate ROM and Kernel area
+	// Reserve ROM and Kernel area
 	//  (Total not updated for kernel area)
-	for(MemPhysPage page = 0xA0; page < ((int) _kernel_end_page); ++page)
-	{
-		MemPageStateTable[page].refCount = 1;
-	}
-
-	//All other pages are initially free
-	MemPhysicalFreePages = MemPhysicalTotalPages;
+	MemPhysicalReserve(0xA0, (MemPhysPage) _kernel_end_page);
 
-	// Allocate boot module area
+	// Reserve boot module area
 	//  (Total not updated for modules area)
 	if(bootInfo->flags & MULTIBOOT_INFO_MODS)
 	{
 		MODULES_FOREACH(module, bootInfo->mods_addr, bootInfo->mods_count)
 		{
-			//Allocate
-			MemPhysPage startPages = module->mod_start / 4096;
-			MemPhysPage endPages = (module->mod_end + 4095) / 4096;
-
-			for(; startPages < endPages; ++startPages)
-			{
-				if(MemPageStateTable[startPages].refCount == 0)
-				{
-					MemPageStateTable[startPages].refCount = 1;
-					MemPhysicalFreePages--;
-				}
-			}
+			MemPhysicalReserve(module->mod_start / 4096, (module->mod_end + 4095) / 4096);
 		}
 	}
 
-	// Allocate page state table and initial page tables
-	for(MemPhysPage page = tableLocation; page < endOfAllocedTable; ++page)
-	{
-		if(MemPageStateTable[page].refCount == 0)
-		{
-			MemPageStateTable[page].refCount = 1;
-			MemPhysicalFreePages--;
-		}
-	}
+	// Reserve page state table and initial page tables
+	MemPhysicalReserve(tableLocation, endOfAllocedTable);
 
 	//Setup physical manager zones
 	MemPhysicalInit();
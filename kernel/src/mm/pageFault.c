@@ -80,11 +80,22 @@ void MemPageFaultHandler(IntrContext * intContext)
 					//Update page id and old page's count
 					MemPhysicalDeleteRef(table->pageID, 1);
 					table->pageID = newPage;
+
+					ProcCurrThread->usage.cowCopyFaults++;
+				}
+				else
+				{
+					ProcCurrThread->usage.cowReuseFaults++;
 				}
 
+				//Page is now only mapped here
+				MemPhysicalSetOwner(table->pageID, MemCurrentContext, (void *) (addr & 0xFFFFF000));
+
 				//Make page writable
 				table->writable = 1;
 				invlpg(faultAddress);
+
+				ProcCurrThread->usage.minorFaults++;
 				return;
 			}
 		}
@@ -99,6 +110,9 @@ void MemPageFaultHandler(IntrContext * intContext)
 
 			// Wipe page
 			MemSet(basePageAddr, 0, 4096);
+
+			ProcCurrThread->usage.minorFaults++;
+			ProcCurrThread->usage.zeroFillFaults++;
 			return;
 		}
 	}
@@ -89,6 +89,30 @@ MemPhysPage MemUnmapPage(void * address)
 	}
 }
 
+//Kernel page lookup
+MemPhysPage MemGetMappedPage(void * address)
+{
+	//Validate address
+	unsigned int addr = ((unsigned int) address) & 0xFFFFF000;
+	if(addr < MEM_KFIXED_MAX)
+	{
+		PrintLog(Error, "MemGetMappedPage: Invalid virtual address passed");
+		return INVALID_PAGE;
+	}
+
+	//Get page table entry
+	MemPageTable * tableEntry = &MemVirtualPageTables[(addr - MEM_KFIXED_MAX) / 4096];
+
+	if(tableEntry->present)
+	{
+		return tableEntry->pageID;
+	}
+	else
+	{
+		return INVALID_PAGE;
+	}
+}
+
 //Increments the counter for the given page directory
 static void IncrementCounter(MemPageDirectory * dir)
 {
@@ -158,6 +182,7 @@ void MemIntMapUserPage(MemContext * context, void * address, MemPhysPage page, M
 		
 		//Wipe page
 		MemSet(MemPhys2Virt(pDir->pageID), 0, 4096);
+		context->tablePages++;
 	}
 
 	//Get table entry
@@ -178,6 +203,12 @@ void MemIntMapUserPage(MemContext * context, void * address, MemPhysPage page, M
 	else
 	{
 		IncrementCounter(pDir);
+
+		//Update resident set size
+		if(++context->rssPages > context->maxRssPages)
+		{
+			context->maxRssPages = context->rssPages;
+		}
 	}
 	
 	//Set page properties
@@ -186,6 +217,9 @@ void MemIntMapUserPage(MemContext * context, void * address, MemPhysPage page, M
 	pTable->writable = (flags & MEM_WRITABLE) ? 1 : 0;
 	pTable->cacheDisable = (flags & MEM_CACHEDISABLE) ? 1 : 0;
 	pTable->pageID = page;
+
+	//Record owner for the compactor
+	MemPhysicalSetOwner(page, context, address);
 }
 
 //Unmaps a user mode page and returns the page which was unmapped
@@ -211,12 +245,19 @@ MemPhysPage MemIntUnmapUserPage(MemContext * context, void * address)
 		{
 		    MemPhysPage page = pTable->pageID;
 
+		    //Page is no longer owned by this context
+		    if(MemPageStateTable[page].owned && MemPageStateTable[page].owner == context)
+		    {
+		        MemPhysicalClearOwner(page);
+		    }
+
 	        //Decrement counter
 	        if(DecrementCounter(pDir))
 	        {
 	            //No more pages left in page table - we can destroy it!
 	            MemPhysicalFree(pDir->pageID, 1);
 	            pDir->rawValue = 0;
+	            context->tablePages--;
 			}
 			else
 			{
@@ -228,6 +269,7 @@ MemPhysPage MemIntUnmapUserPage(MemContext * context, void * address)
 
 			//Invalidate this entry
 		    invlpg(address);
+		    context->rssPages--;
 	        
 	        return page;
 		}
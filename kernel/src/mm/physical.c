@@ -20,6 +20,8 @@
  */
 
 #include "chaff.h"
+#include "inlineasm.h"
+#include "process.h"
 #include "mm/physical.h"
 
 //Contains information about a zone of physical memory
@@ -38,13 +40,110 @@ static MemPhysicalZone zones[3];
 unsigned int MemPhysicalTotalPages;
 unsigned int MemPhysicalFreePages;
 
+//Memory pressure shrinkers
+static ListHead shrinkers = LIST_INLINE_INIT(shrinkers);
+
+//Ranges of pages reserved at boot (applied as each section is initialized)
+typedef struct MemReservedRange
+{
+	MemPhysPage start;
+	MemPhysPage end;
+
+} MemReservedRange;
+
+static MemReservedRange reservedRanges[MEM_MAX_RESERVED_RANGES];
+static unsigned int reservedCount;
+
+//Bitmap of initialized sections
+unsigned int MemPhysicalSectionsReady[0x100000 / MEM_INIT_SECTION_PAGES / 32];
+
+//Number of pages in the page state table
+static unsigned int highestPage;
+
+static void MemPhysicalInitSection(unsigned int section);
+static int MemPhysicalInitThread(void * unused);
+
+//Marks a range of pages as reserved
+void INIT MemPhysicalReserve(MemPhysPage start, MemPhysPage end)
+{
+	if(reservedCount >= MEM_MAX_RESERVED_RANGES)
+	{
+		Panic("MemPhysicalReserve: Too many reserved memory ranges");
+	}
+
+	reservedRanges[reservedCount].start = start;
+	reservedRanges[reservedCount].end = end;
+	reservedCount++;
+}
+
+//Initializes a section of the page state table
+static void MemPhysicalInitSection(unsigned int section)
+{
+	MemPhysPage start = section * MEM_INIT_SECTION_PAGES;
+	MemPhysPage end = start + MEM_INIT_SECTION_PAGES;
+
+	if(end > (int) highestPage)
+	{
+		end = highestPage;
+	}
+
+	//Wipe section
+	MemSet(&MemPageStateTable[start], 0, (end - start) * sizeof(MemPage));
+
+	//Allocate reserved pages
+	unsigned int freePages = end - start;
+
+	for(unsigned int i = 0; i < reservedCount; i++)
+	{
+		MemPhysPage page = reservedRanges[i].start > start ? reservedRanges[i].start : start;
+		MemPhysPage rangeEnd = reservedRanges[i].end < end ? reservedRanges[i].end : end;
+
+		for(; page < rangeEnd; page++)
+		{
+			if(MemPageStateTable[page].refCount == 0)
+			{
+				MemPageStateTable[page].refCount = 1;
+				freePages--;
+			}
+		}
+	}
+
+	//Section is now usable
+	MemPhysicalFreePages += freePages;
+	MemPhysicalSectionsReady[section / 32] |= 1 << (section % 32);
+}
+
+//Ensures the section containing the given page is initialized
+// Returns the end of the section
+static MemPage * MemPhysicalPrepare(MemPage * page)
+{
+	MemPhysPage pageID = page - MemPageStateTable;
+
+	if(!MemPhysicalIsReady(pageID))
+	{
+		MemPhysicalInitSection(pageID / MEM_INIT_SECTION_PAGES);
+	}
+
+	return &MemPageStateTable[(pageID | (MEM_INIT_SECTION_PAGES - 1)) + 1];
+}
+
 //Sets up the zones using the given total number of pages
 void INIT MemPhysicalInit()
 {
 	//Calculate highest page from end of page state table
-	unsigned int highestPage =
-			((unsigned int) MemPageStateTableEnd - (unsigned int) MemPageStateTable)
-				/ sizeof(MemPage);
+	highestPage = MemPageStateTableEnd - MemPageStateTable;
+
+	//Initialize the first sections now
+	unsigned long long startTime = rdtsc();
+	unsigned int syncPages = highestPage < MEM_INIT_SYNC_PAGES ? highestPage : MEM_INIT_SYNC_PAGES;
+
+	for(unsigned int section = 0; section * MEM_INIT_SECTION_PAGES < syncPages; section++)
+	{
+		MemPhysicalInitSection(section);
+	}
+
+	PrintLog(Info, "MemPhysicalInit: initialized %u pages in %u K cycles (%u pages deferred)",
+			syncPages, (unsigned int) ((rdtsc() - startTime) >> 10), highestPage - syncPages);
 
 	//DMA zone
 	zones[MEM_DMA].start = MemPageStateTable;
@@ -81,6 +180,150 @@ void INIT MemPhysicalInit()
 	}
 }
 
+//Starts the thread which initializes the rest of the page state table
+void INIT MemPhysicalInitLate()
+{
+	if(highestPage > MEM_INIT_SYNC_PAGES)
+	{
+		ProcWakeUp(ProcCreateKernelThread("kpageinit", MemPhysicalInitThread, NULL));
+	}
+}
+
+//Initializes the rest of the page state table in the background
+static int MemPhysicalInitThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	unsigned long long startTime = rdtsc();
+	unsigned int sections = (highestPage + MEM_INIT_SECTION_PAGES - 1) / MEM_INIT_SECTION_PAGES;
+
+	for(unsigned int section = 0; section < sections; section++)
+	{
+		if(!MemPhysicalIsReady(section * MEM_INIT_SECTION_PAGES))
+		{
+			MemPhysicalInitSection(section);
+
+			//Let other threads run between sections
+			ProcYield();
+		}
+	}
+
+	PrintLog(Info, "MemPhysicalInitThread: initialized remaining pages in %u K cycles",
+			(unsigned int) ((rdtsc() - startTime) >> 10));
+	return 0;
+}
+
+//Searches for free pages in a single zone
+static MemPhysPage MemPhysicalFindInZone(unsigned int number, int zone)
+{
+	//Ensure zone exists
+	if(zones[zone].end > zones[zone].start)
+	{
+		//Start bitmap lookup
+		MemPage * head = zones[zone].headPtr;
+
+		MemPage * firstFree = NULL;
+		MemPage * sectionEnd = NULL;
+		unsigned int freeLength = 0;
+
+		do
+		{
+			//Wrap around head pointer
+			if(head >= zones[zone].end)
+			{
+				head = zones[zone].start;
+				firstFree = NULL;
+			}
+
+			//Initialize sections as we reach them
+			if(head >= sectionEnd || head < sectionEnd - MEM_INIT_SECTION_PAGES)
+			{
+				sectionEnd = MemPhysicalPrepare(head);
+			}
+
+			//Check if there is a free page
+			if(head->refCount == 0)
+			{
+				if(firstFree == NULL)
+				{
+					//Set as first free
+					firstFree = head;
+					freeLength = 1;
+				}
+				else
+				{
+					//Set as another free
+					++freeLength;
+				}
+
+				//Enough?
+				if(freeLength == number)
+				{
+					//Decrement free pages
+					MemPhysicalFreePages -= number;
+
+					//Increment refcounts
+					for(MemPage * page = firstFree; number > 0; ++page, --number)
+					{
+						page->refCount = 1;
+						page->slab = NULL;
+						page->owned = 0;
+					}
+
+					//Update zone head
+					zones[zone].headPtr = head;
+
+					//Return first page in set
+					return ((unsigned int) firstFree - (unsigned int) MemPageStateTable) / sizeof(MemPage);
+				}
+			}
+			else
+			{
+				//No free here
+				firstFree = NULL;
+			}
+
+			//Move on head
+			++head;
+		}
+		while(head != zones[zone].headPtr);
+	}
+
+	return INVALID_PAGE;
+}
+
+//Searches for free pages in a zone and the zones below it
+static MemPhysPage MemPhysicalFind(unsigned int number, int zone)
+{
+	for(; zone >= MEM_DMA; --zone)
+	{
+		MemPhysPage page = MemPhysicalFindInZone(number, zone);
+
+		if(page != INVALID_PAGE)
+		{
+			return page;
+		}
+	}
+
+	return INVALID_PAGE;
+}
+
+//Allocates a page in the given zone or a zone above it (used by the compactor)
+MemPhysPage MemPhysicalAllocAbove(int zone)
+{
+	for(int searchZone = MEM_HIGHMEM; searchZone >= zone; --searchZone)
+	{
+		MemPhysPage page = MemPhysicalFindInZone(1, searchZone);
+
+		if(page != INVALID_PAGE)
+		{
+			return page;
+		}
+	}
+
+	return INVALID_PAGE;
+}
+
 //Allocates physical pages
 MemPhysPage MemPhysicalAlloc(unsigned int number, int zone)
 {
@@ -97,75 +340,80 @@ MemPhysPage MemPhysicalAlloc(unsigned int number, int zone)
 		return INVALID_PAGE;
 	}
 
-	//Start zones loop
-	for(; zone >= MEM_DMA; --zone)
+	//Find some free pages
+	MemPhysPage page = MemPhysicalFind(number, zone);
+
+	if(page == INVALID_PAGE && number > 1)
 	{
-		//Ensure zone exists
-		if(zones[zone].end > zones[zone].start)
+		//Memory may just be fragmented, try compacting each zone
+		for(int compactZone = zone; compactZone >= MEM_DMA; --compactZone)
 		{
-			//Start bitmap lookup
-			MemPage * head = zones[zone].headPtr;
+			if(MemPhysicalCompact(number, compactZone, UINT_MAX))
+			{
+				page = MemPhysicalFind(number, compactZone);
+				break;
+			}
+		}
+	}
 
-			MemPage * firstFree = NULL;
-			unsigned int freeLength;
+	if(page == INVALID_PAGE && MemPhysicalShrink(number) > 0)
+	{
+		//Some memory was released, try again
+		page = MemPhysicalFind(number, zone);
+	}
 
-			do
-			{
-				//Wrap around head pointer
-				if(head >= zones[zone].end)
-				{
-					head = zones[zone].start;
-				}
+	//If we still have nothing, we're out of memory!
+	if(page == INVALID_PAGE)
+	{
+		Panic("MemPhysicalAlloc: Out of memory");
+	}
 
-				//Check if there is a free page
-				if(head->refCount == 0)
-				{
-					if(firstFree == NULL)
-					{
-						//Set as first free
-						firstFree = head;
-						freeLength = 1;
-					}
-					else
-					{
-						//Set as another free
-						++freeLength;
-					}
+	return page;
+}
 
-					//Enough?
-					if(freeLength == number)
-					{
-						//Decrement free pages
-						MemPhysicalFreePages -= number;
+//Registers a shrinker
+void MemShrinkerRegister(MemShrinker * shrinker)
+{
+	ListHeadAddLast(&shrinker->listItem, &shrinkers);
+}
 
-						//Increment refcounts
-						for(MemPage * page = firstFree; number > 0; ++page, --number)
-						{
-							page->refCount = 1;
-						}
+//Unregisters a shrinker
+void MemShrinkerUnregister(MemShrinker * shrinker)
+{
+	ListDelete(&shrinker->listItem);
+}
 
-						//Update zone head
-						zones[zone].headPtr = head;
+//Calls the registered shrinkers until the given number of pages have been freed
+unsigned int MemPhysicalShrink(unsigned int pages)
+{
+	unsigned int freed = 0;
 
-						//Return first page in set
-						return ((unsigned int) firstFree - (unsigned int) MemPageStateTable) / sizeof(MemPage);
-					}
-				}
-				else
-				{
-					//No free here
-					firstFree = NULL;
-				}
+	MemShrinker * shrinker;
+	ListForEachEntry(shrinker, &shrinkers, listItem)
+	{
+		freed += shrinker->shrink(pages - freed);
 
-				//Move on head
-				++head;
-			}
-			while(head != zones[zone].headPtr);
+		if(freed >= pages)
+		{
+			break;
 		}
 	}
 
-	//If we're here, we're out of memory!
-	Panic("MemPhysicalAlloc: Out of memory");
+	return freed;
+}
+
+//Gets the range of pages in a zone
+bool MemPhysicalGetZone(int zone, MemPhysPage * start, MemPhysPage * end)
+{
+	//Ensure zone exists
+	if(zone < MEM_DMA || zone > MEM_HIGHMEM || zones[zone].end <= zones[zone].start)
+	{
+		return false;
+	}
+
+	*start = zones[zone].start - MemPageStateTable;
+	*end = zones[zone].end - MemPageStateTable;
+	return true;
 }
 
 //Adds a reference to the given page(s)
@@ -31,12 +31,21 @@
 #warning TODO Copy-On-Write Page tables
 
 //Kernel context
-MemContext MemKernelContextData = { LIST_INLINE_INIT(MemKernelContextData.regions), INVALID_PAGE, 0x1000 };
+MemContext MemKernelContextData =
+{
+	.regions = LIST_INLINE_INIT(MemKernelContextData.regions),
+	.physDirectory = INVALID_PAGE,
+	.refCount = 0x1000,
+	.contextItem = LIST_INLINE_INIT(MemKernelContextData.contextItem),
+};
 	//INVALID_PAGE changed in MemManagerInit
 
 //Current context
 MemContext * MemCurrentContext = MemKernelContext;
 
+//List of all user contexts
+ListHead MemContextList = LIST_INLINE_INIT(MemContextList);
+
 //Check if a region will run into another
 static bool MemRegionIsCollision(MemRegion * thisRegion, MemRegion * nextRegion);
 
@@ -44,8 +53,9 @@ static bool MemRegionIsCollision(MemRegion * thisRegion, MemRegion * nextRegion)
 MemContext * MemContextInit()
 {
 	//Allocate new context
-	MemContext * newContext = MemKAlloc(sizeof(MemContext));
+	MemContext * newContext = MemKZAlloc(sizeof(MemContext));
 	ListHeadInit(&newContext->regions);
+	ListHeadAddLast(&newContext->contextItem, &MemContextList);
 
 	//Allocate directory
 	newContext->physDirectory = MemPhysicalAlloc(1, MEM_KERNEL);
@@ -68,8 +78,9 @@ MemContext * MemContextInit()
 MemContext * MemContextClone()
 {
 	//Allocate new context
-	MemContext * newContext = MemKAlloc(sizeof(MemContext));
+	MemContext * newContext = MemKZAlloc(sizeof(MemContext));
 	ListHeadInit(&newContext->regions);
+	ListHeadAddLast(&newContext->contextItem, &MemContextList);
 
 	//Copy regions
 	MemRegion * oldRegion;
@@ -117,6 +128,8 @@ MemContext * MemContextClone()
 				{
 					//Increase count and make readonly
 					MemPhysicalAddRef(table[j].pageID, 1);
+					MemPhysicalClearOwner(table[j].pageID);
+					newContext->rssPages++;
 
 					//Fixed pages are made writable again in the page fault handler
 					table[j].writable = 0;
@@ -129,11 +142,13 @@ MemContext * MemContextClone()
 
 			//Store in directory
 			dir[i].pageID = newTable;
+			newContext->tablePages++;
 		}
 	}
 
 	//Flush user mode paging caches
 	setCR3(getCR3());
+	newContext->maxRssPages = newContext->rssPages;
 
 	//Return context
 	return newContext;
@@ -215,6 +230,7 @@ void MemContextDelete(MemContext * context)
 	}
 
 	//Free the final context
+	ListDelete(&context->contextItem);
 	MemKFree(context);
 }
 
@@ -343,6 +359,7 @@ MemRegion * MemRegionCreate(MemContext * context, void * startAddress,
 	newRegion->flags = flags;
 	newRegion->length = length;
 	newRegion->start = startAddr;
+	MemSet(newRegion->idleHistogram, 0, sizeof(newRegion->idleHistogram));
 
 	//Find place to insert region
 	MemRegion * region = NULL;
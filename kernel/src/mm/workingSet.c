@@ -0,0 +1,158 @@
+/*
+ * workingSet.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "inlineasm.h"
+#include "list.h"
+#include "process.h"
+#include "timer.h"
+#include "mm/physical.h"
+#include "mm/pagingInt.h"
+#include "mm/region.h"
+
+//Working set scanner
+// Each scan clears the accessed bits of all user pages. Pages which have not been
+// accessed since the previous scan have their idle age incremented.
+//
+// Idle ages are only tracked for pages with an owner. A shared page is mapped into
+// several regions, each of which would age it once per scan, so shared pages are
+// counted separately instead.
+
+//Background scanner thread
+static ProcThread * scannerThread;
+
+static int NORETURN MemWorkingSetThread(void * unused);
+
+//Returns the histogram bucket for an idle age
+static inline unsigned int MemIdleBucket(unsigned int age)
+{
+	if(age == 0)
+	{
+		return 0;
+	}
+
+	return 32 - __builtin_clz(age);
+}
+
+//Scans the pages of a context and updates its working set information
+void MemWorkingSetScan(MemContext * context)
+{
+	unsigned int wssPages = 0;
+	unsigned int coldPages = 0;
+	unsigned int sharedPages = 0;
+
+	//Scan each region
+	MemRegion * region;
+	ListForEachEntry(region, &context->regions, listItem)
+	{
+		unsigned int end = region->start + region->length;
+
+		MemSet(region->idleHistogram, 0, sizeof(region->idleHistogram));
+
+		for(unsigned int addr = region->start; addr < end; addr += PAGE_SIZE)
+		{
+			//Skip missing page tables
+			MemPageDirectory * dir = MemGetPageDirectory(context, addr);
+
+			if(!dir->present)
+			{
+				addr |= 0x3FF000;
+				continue;
+			}
+
+			MemPageTable * table = MemGetPageTable(dir, addr);
+
+			if(!table->present)
+			{
+				continue;
+			}
+
+			//Skip shared pages
+			MemPage * page = &MemPageStateTable[table->pageID];
+
+			if(!page->owned)
+			{
+				sharedPages++;
+				continue;
+			}
+
+			//Sample and clear accessed bit
+			if(table->accessed)
+			{
+				table->accessed = 0;
+				page->idleAge = 0;
+
+				//The TLB may also have the accessed bit cached
+				if(context == MemCurrentContext)
+				{
+					invlpg((void *) addr);
+				}
+			}
+			else if(page->idleAge < MEM_IDLE_AGE_MAX)
+			{
+				page->idleAge++;
+			}
+
+			//Update statistics
+			region->idleHistogram[MemIdleBucket(page->idleAge)]++;
+
+			if(page->idleAge < MEM_WSS_WINDOW)
+			{
+				wssPages++;
+			}
+			else if(page->idleAge >= MEM_WSS_COLD_AGE)
+			{
+				coldPages++;
+			}
+		}
+	}
+
+	//Store totals
+	context->wssPages = wssPages;
+	context->coldPages = coldPages;
+	context->sharedPages = sharedPages;
+}
+
+//Starts the working set scanner thread
+void INIT MemWorkingSetInit()
+{
+	scannerThread = ProcCreateKernelThread("kwsscan", MemWorkingSetThread, NULL);
+	ProcWakeUp(scannerThread);
+}
+
+//Working set scanner thread entry point
+static int NORETURN MemWorkingSetThread(void * unused)
+{
+	IGNORE_PARAM unused;
+
+	for(;;)
+	{
+		//Wait until next scan
+		TimerSleep(((TimerTime) MEM_WSS_INTERVAL) << 32);
+
+		//Scan every context
+		MemContext * context;
+		ListForEachEntry(context, &MemContextList, contextItem)
+		{
+			MemWorkingSetScan(context);
+		}
+	}
+}
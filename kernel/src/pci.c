@@ -0,0 +1,74 @@
+/*
+ * pci.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "inlineasm.h"
+#include "pci.h"
+
+//PCI configuration mechanism 1 ports
+#define PCI_CONFIG_ADDRESS	0xCF8
+#define PCI_CONFIG_DATA		0xCFC
+
+//Reads a 32-bit value from PCI configuration space
+unsigned int PciConfigRead(PciAddress addr, unsigned int reg)
+{
+	outd(PCI_CONFIG_ADDRESS, 0x80000000 | addr | (reg & 0xFC));
+	return ind(PCI_CONFIG_DATA);
+}
+
+//Writes a 32-bit value to PCI configuration space
+void PciConfigWrite(PciAddress addr, unsigned int reg, unsigned int value)
+{
+	outd(PCI_CONFIG_ADDRESS, 0x80000000 | addr | (reg & 0xFC));
+	outd(PCI_CONFIG_DATA, value);
+}
+
+//Finds a PCI function with the given vendor and device id
+PciAddress PciFindDevice(unsigned short vendor, unsigned short device, PciAddress start)
+{
+	unsigned int wanted = ((unsigned int) device << 16) | vendor;
+
+	//Scan every function of every device on every bus
+	for(PciAddress addr = start; addr < PCI_ADDRESS(256, 0, 0); addr += PCI_ADDRESS(0, 0, 1))
+	{
+		unsigned int id = PciConfigRead(addr, PCI_REG_ID);
+
+		//Skip the rest of the device if function 0 doesn't exist or isn't multifunction
+		if((addr & PCI_ADDRESS(0, 0, 7)) == 0 &&
+				(id == 0xFFFFFFFF || !(PciConfigRead(addr, PCI_REG_HEADER) & 0x800000)))
+		{
+			if(id == wanted)
+			{
+				return addr;
+			}
+
+			addr += PCI_ADDRESS(0, 0, 7);
+			continue;
+		}
+
+		if(id == wanted)
+		{
+			return addr;
+		}
+	}
+
+	return PCI_INVALID_ADDRESS;
+}
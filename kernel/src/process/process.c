@@ -22,7 +22,7 @@
 #include "chaff.h"
 #include "process.h"
 #include "processInt.h"
-#include "htable.h"
+#include "imap.h"
 #include "timer.h"
 #include "errno.h"
 #include "io/iocontext.h"
@@ -32,25 +32,20 @@
 
 //Process management functions
 
-//Process and thread hash tables
-static HashTable hTableProcess, hTableThread;
+//Process and thread id maps
+static IntMap processMap, threadMap;
 
-//Simple hash table manipulators
+//Simple id map manipulators
 static inline bool ProcHashInsert(ProcProcess * process)
 {
-	return HashTableInsert(&hTableProcess, &process->hItem, &process->pid, sizeof(unsigned int));
+	return IntMapInsert(&processMap, process->pid, process);
 }
 
 static inline bool ThreadHashInsert(ProcThread * thread)
 {
-	return HashTableInsert(&hTableThread, &thread->hItem, &thread->tid, sizeof(unsigned int));
+	return IntMapInsert(&threadMap, thread->tid, thread);
 }
 
-#define PHASH_INSERT(table, field, item) \
-	HashTableInsert(&(table), &(item)->hItem, &(item)->field, sizeof(unsigned int))
-#define PHASH_FIND(table, field, id) \
-	HashTableFind(&(table), &(item)->field, sizeof(unsigned int))
-
 //Next ids to use
 static unsigned int processNextID;
 static unsigned int threadNextID;
@@ -61,6 +56,9 @@ static void ProcDisownChildren(ProcProcess * process);
 //Raw thread creator
 static ProcThread * ProcCreateRawThread(const char * name, ProcProcess * parent, bool withStack);
 
+//Adds the fault counters and peak memory usage from one usage structure to another
+static void ProcUsageAdd(ProcUsage * dest, const ProcUsage * src);
+
 //Global processes and threads
 ProcProcess ProcKernelProcessData;
 ProcThread * ProcIdleThread;
@@ -101,31 +99,13 @@ void INIT ProcInit()
 //Gets a process from the given ID or returns NULL if the process doesn't exist
 ProcProcess * ProcGetProcessByID(unsigned int pid)
 {
-	HashItem * item = HashTableFind(&hTableProcess, &pid, sizeof(unsigned int));
-
-	if(item)
-	{
-		return HashTableEntry(item, ProcProcess, hItem);
-	}
-	else
-	{
-		return NULL;
-	}
+	return IntMapFind(&processMap, pid);
 }
 
 //Gets a thread from the given ID or returns NULL if the thread doesn't exist
 ProcThread * ProcGetThreadByID(unsigned int tid)
 {
-	HashItem * item = HashTableFind(&hTableThread, &tid, sizeof(unsigned int));
-
-	if(item)
-	{
-		return HashTableEntry(item, ProcThread, hItem);
-	}
-	else
-	{
-		return NULL;
-	}
+	return IntMapFind(&threadMap, tid);
 }
 
 //Creates a completely empty process from nothing
@@ -283,6 +263,7 @@ ProcProcess * ProcFork(void (* startAddr)(), void * userStackPtr)
 
 	//Clone memory context
 	newProc->memContext = MemContextClone();
+	ProcCurrThread->usage.forkSharedPages += newProc->memContext->rssPages;
 
 	//Clone IO context
 	newProc->ioContext = IoContextClone(ProcCurrProcess->ioContext);
@@ -544,6 +525,8 @@ void NORETURN ProcExitProcess(unsigned int exitCode)
 		// Free memory context
 		if(ProcCurrProcess->memContext)
 		{
+			ProcCurrProcess->usage.maxRssPages = ProcCurrProcess->memContext->maxRssPages;
+
 			MemContextSwitchTo(MemKernelContext);
 			MemContextDeleteReference(ProcCurrProcess->memContext);
 
@@ -608,11 +591,18 @@ void ProcIntReapProcess(ProcProcess * process)
 	//Any child processes should be inherited by the kernel
 	ProcDisownChildren(process);
 
+	//Give usage counters to the parent
+	if(process->parent != NULL)
+	{
+		ProcUsageAdd(&process->parent->childUsage, &process->usage);
+		ProcUsageAdd(&process->parent->childUsage, &process->childUsage);
+	}
+
 	//Remove as one of the parent's children
 	ListDelete(&process->processSibling);
 
-	//Remove from hashtable
-	HashTableRemoveItem(&hTableProcess, &process->hItem);
+	//Remove from id map
+	IntMapRemove(&processMap, process->pid);
 
 	//Free name
 	MemKFree(process->name);
@@ -696,12 +686,15 @@ void ProcIntReapThread(ProcThread * thread)
 	//Free FPU state
 	CpuFreeFpuState(ProcCurrThread);
 
-	//Remove from hash table
-	HashTableRemoveItem(&hTableThread, &thread->hItem);
+	//Remove from id map
+	IntMapRemove(&threadMap, thread->tid);
 
 	//Remove from thread list
 	ListDelete(&thread->threadSibling);
 
+	//Give usage counters to the process
+	ProcUsageAdd(&thread->parent->usage, &thread->usage);
+
 	//Free kernel stack
 	MemPhysicalFree(MemVirt2Phys(thread->kStackBase), 1);
 
@@ -711,3 +704,62 @@ void ProcIntReapThread(ProcThread * thread)
 	//Free thread structure
 	MemSlabFree(cacheThread, thread);
 }
+
+//Adds the fault counters and peak memory usage from one usage structure to another
+static void ProcUsageAdd(ProcUsage * dest, const ProcUsage * src)
+{
+	dest->minorFaults += src->minorFaults;
+	dest->zeroFillFaults += src->zeroFillFaults;
+	dest->cowCopyFaults += src->cowCopyFaults;
+	dest->cowReuseFaults += src->cowReuseFaults;
+	dest->forkSharedPages += src->forkSharedPages;
+
+	if(src->maxRssPages > dest->maxRssPages)
+	{
+		dest->maxRssPages = src->maxRssPages;
+	}
+}
+
+//Gets the memory usage and page fault counters of any process
+void ProcGetProcessUsage(ProcProcess * process, ProcUsage * usage)
+{
+	//Start with reaped threads
+	*usage = process->usage;
+
+	//Add running threads
+	ProcThread * thread;
+	ListForEachEntry(thread, &process->threads, threadSibling)
+	{
+		ProcUsageAdd(usage, &thread->usage);
+	}
+
+	//Add memory usage
+	if(process->memContext != NULL)
+	{
+		usage->rssPages = process->memContext->rssPages;
+		usage->tablePages = process->memContext->tablePages;
+		usage->maxRssPages = process->memContext->maxRssPages;
+	}
+}
+
+//Gets the memory usage and page fault counters of the current process
+int ProcGetUsage(int who, ProcUsage * usage)
+{
+	switch(who)
+	{
+		case PROC_USAGE_SELF:
+			ProcGetProcessUsage(ProcCurrProcess, usage);
+			return 0;
+
+		case PROC_USAGE_CHILDREN:
+			*usage = ProcCurrProcess->childUsage;
+			return 0;
+
+		case PROC_USAGE_THREAD:
+			*usage = ProcCurrThread->usage;
+			return 0;
+
+		default:
+			return -EINVAL;
+	}
+}
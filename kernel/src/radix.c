@@ -0,0 +1,319 @@
+/*
+ * radix.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+#include "chaff.h"
+#include "radix.h"
+#include "mm/kmemory.h"
+
+//Radix Tree
+// Each level of the tree uses RADIX_MAP_SHIFT bits of the index. The bottom level
+// (shift 0) contains the items. The tree only grows as high as needed for the
+// largest index in it.
+
+//Clears the bits of an index below the given bit (all of them if bits >= 64)
+static inline unsigned long long RadixBase(unsigned long long index, unsigned int bits)
+{
+	if(bits >= 64)
+	{
+		return 0;
+	}
+
+	return index & ~((1ULL << bits) - 1);
+}
+
+//Returns the largest index which can be stored in a tree of the given height
+static inline unsigned long long RadixMaxIndex(unsigned int height)
+{
+	unsigned int bits = height * RADIX_MAP_SHIFT;
+
+	if(bits >= 64)
+	{
+		return ~0ULL;
+	}
+
+	return (1ULL << bits) - 1;
+}
+
+//Allocates a new node
+static RadixNode * RadixNodeAlloc(RadixNode * parent, unsigned int offset)
+{
+	RadixNode * node = MemKZAlloc(sizeof(RadixNode));
+	node->parent = parent;
+	node->offset = offset;
+	return node;
+}
+
+//Inserts an item into a radix tree
+bool RadixTreeInsert(RadixTree * tree, unsigned long long index, void * item)
+{
+	//Create root
+	if(tree->root == NULL)
+	{
+		tree->root = RadixNodeAlloc(NULL, 0);
+		tree->height = 1;
+	}
+
+	//Grow tree until the index fits
+	while(index > RadixMaxIndex(tree->height))
+	{
+		RadixNode * newRoot = RadixNodeAlloc(NULL, 0);
+		newRoot->slots[0] = tree->root;
+		newRoot->count = 1;
+
+		tree->root->parent = newRoot;
+		tree->root = newRoot;
+		tree->height++;
+	}
+
+	//Find bottom node, creating nodes on the way
+	RadixNode * node = tree->root;
+
+	for(unsigned int shift = (tree->height - 1) * RADIX_MAP_SHIFT; shift > 0; shift -= RADIX_MAP_SHIFT)
+	{
+		unsigned int slot = (unsigned int) (index >> shift) & RADIX_MAP_MASK;
+
+		if(node->slots[slot] == NULL)
+		{
+			node->slots[slot] = RadixNodeAlloc(node, slot);
+			node->count++;
+		}
+
+		node = node->slots[slot];
+	}
+
+	//Insert item
+	unsigned int slot = (unsigned int) index & RADIX_MAP_MASK;
+
+	if(node->slots[slot] != NULL)
+	{
+		return false;
+	}
+
+	node->slots[slot] = item;
+	node->count++;
+	tree->itemCount++;
+	return true;
+}
+
+//Finds the bottom node containing an index
+static RadixNode * RadixFindNode(RadixTree * tree, unsigned long long index)
+{
+	if(tree->root == NULL || index > RadixMaxIndex(tree->height))
+	{
+		return NULL;
+	}
+
+	RadixNode * node = tree->root;
+
+	for(unsigned int shift = (tree->height - 1) * RADIX_MAP_SHIFT; shift > 0; shift -= RADIX_MAP_SHIFT)
+	{
+		node = node->slots[(index >> shift) & RADIX_MAP_MASK];
+
+		if(node == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	return node;
+}
+
+//Removes an item from a radix tree
+void * RadixTreeRemove(RadixTree * tree, unsigned long long index)
+{
+	RadixNode * node = RadixFindNode(tree, index);
+	unsigned int slot = (unsigned int) index & RADIX_MAP_MASK;
+
+	if(node == NULL || node->slots[slot] == NULL)
+	{
+		return NULL;
+	}
+
+	//Remove item
+	void * item = node->slots[slot];
+	node->slots[slot] = NULL;
+	node->count--;
+	tree->itemCount--;
+
+	//Free empty nodes
+	while(node->count == 0)
+	{
+		RadixNode * parent = node->parent;
+		unsigned int offset = node->offset;
+		MemKFree(node);
+
+		if(parent == NULL)
+		{
+			tree->root = NULL;
+			tree->height = 0;
+			return item;
+		}
+
+		parent->slots[offset] = NULL;
+		parent->count--;
+		node = parent;
+	}
+
+	//Shrink tree while the root only has a first child
+	while(tree->height > 1 && tree->root->count == 1 && tree->root->slots[0] != NULL)
+	{
+		RadixNode * child = tree->root->slots[0];
+		MemKFree(tree->root);
+
+		child->parent = NULL;
+		tree->root = child;
+		tree->height--;
+	}
+
+	return item;
+}
+
+//Finds an item in a radix tree
+void * RadixTreeFind(RadixTree * tree, unsigned long long index)
+{
+	RadixNode * node = RadixFindNode(tree, index);
+
+	if(node == NULL)
+	{
+		return NULL;
+	}
+
+	return node->slots[index & RADIX_MAP_MASK];
+}
+
+//Finds the first item with an index greater than or equal to the one given
+void * RadixTreeNext(RadixTree * tree, unsigned long long * index)
+{
+	unsigned long long current = *index;
+
+	if(tree->root == NULL || current > RadixMaxIndex(tree->height))
+	{
+		return NULL;
+	}
+
+	RadixNode * node = tree->root;
+	unsigned int shift = (tree->height - 1) * RADIX_MAP_SHIFT;
+	unsigned int start = (unsigned int) (current >> shift) & RADIX_MAP_MASK;
+
+	for(;;)
+	{
+		//Find next used slot in this node
+		unsigned int slot = start;
+
+		while(slot < RADIX_MAP_SIZE && node->slots[slot] == NULL)
+		{
+			slot++;
+		}
+
+		if(slot < RADIX_MAP_SIZE)
+		{
+			//Skipped slots start from the beginning of the next slot's range
+			if(slot != start)
+			{
+				current = RadixBase(current, shift + RADIX_MAP_SHIFT) |
+						((unsigned long long) slot << shift);
+			}
+
+			if(shift == 0)
+			{
+				*index = current;
+				return node->slots[slot];
+			}
+
+			//Go down a level
+			node = node->slots[slot];
+			shift -= RADIX_MAP_SHIFT;
+			start = (unsigned int) (current >> shift) & RADIX_MAP_MASK;
+		}
+		else
+		{
+			//Go up a level and continue after this node
+			if(node->parent == NULL)
+			{
+				return NULL;
+			}
+
+			start = node->offset + 1;
+			node = node->parent;
+			shift += RADIX_MAP_SHIFT;
+			current = RadixBase(current, shift + RADIX_MAP_SHIFT) |
+					((unsigned long long) start << shift);
+		}
+	}
+}
+
+//Finds a number of items in index order
+unsigned int RadixTreeGangFind(RadixTree * tree, unsigned long long first, void ** items, unsigned int max)
+{
+	unsigned int found = 0;
+
+	while(found < max)
+	{
+		void * item = RadixTreeNext(tree, &first);
+
+		if(item == NULL)
+		{
+			break;
+		}
+
+		items[found++] = item;
+
+		//Stop at the end of the index space
+		if(first == ~0ULL)
+		{
+			break;
+		}
+
+		first++;
+	}
+
+	return found;
+}
+
+//Frees a node and all the nodes below it
+static void RadixNodeFree(RadixNode * node, unsigned int height)
+{
+	if(height > 1)
+	{
+		for(unsigned int i = 0; i < RADIX_MAP_SIZE; i++)
+		{
+			if(node->slots[i] != NULL)
+			{
+				RadixNodeFree(node->slots[i], height - 1);
+			}
+		}
+	}
+
+	MemKFree(node);
+}
+
+//Frees all the nodes in a radix tree
+void RadixTreeClear(RadixTree * tree)
+{
+	if(tree->root != NULL)
+	{
+		RadixNodeFree(tree->root, tree->height);
+	}
+
+	tree->root = NULL;
+	tree->height = 0;
+	tree->itemCount = 0;
+}
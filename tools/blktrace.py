@@ -0,0 +1,175 @@
+#!/usr/bin/env python
+#
+# blktrace.py - analyses block I/O trace events saved from /dev/blktrace
+#
+#  Copyright 2012 James Cowgill
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+# Usage:
+#  blktrace.py [--mhz MHZ] [--replay] TRACE_FILE
+#
+# Without --replay, prints a summary of each device (request counts, cache hit rate
+# and latency percentiles). With --replay, prints every event in time order.
+#
+# Times are time stamp counter cycles unless --mhz gives the CPU frequency.
+#
+# The event layout must match IoBlockTraceEvent in kernel/include/io/blktrace.h
+#
+
+import argparse
+import struct
+import sys
+
+EVENT = struct.Struct('<IiQQQQIBBH16s')
+
+FLAG_CACHE = 1
+FLAG_HIT = 2
+FLAG_MISS = 4
+FLAG_MERGED = 8
+FLAG_DIRECT = 16
+
+OPS = ('read', 'write')
+
+
+class Event(object):
+    def __init__(self, data):
+        (self.sequence, self.result, self.queue, self.issue, self.complete,
+         self.offset, self.length, self.op, self.flags, _, device) = EVENT.unpack(data)
+        self.device = device.split(b'\0', 1)[0].decode('ascii', 'replace')
+
+    def kind(self):
+        if self.flags & FLAG_CACHE:
+            return 'cache'
+        elif self.flags & FLAG_DIRECT:
+            return 'direct'
+        return 'device'
+
+
+def read_events(path):
+    events = []
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    for pos in range(0, len(data) - EVENT.size + 1, EVENT.size):
+        events.append(Event(data[pos:pos + EVENT.size]))
+
+    return events
+
+
+def percentile(values, pct):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, len(values) * pct // 100)]
+
+
+def count_lost(events):
+    lost = 0
+    for prev, event in zip(events, events[1:]):
+        gap = (event.sequence - prev.sequence - 1) & 0xFFFFFFFF
+        if gap < 0x80000000:
+            lost += gap
+    return lost
+
+
+def summary(events, scale, unit):
+    devices = {}
+    for event in events:
+        devices.setdefault(event.device, []).append(event)
+
+    print('%u events (%u lost)' % (len(events), count_lost(events)))
+
+    for name in sorted(devices):
+        print('\n%s:' % name)
+
+        for kind in ('cache', 'device', 'direct'):
+            for op in (0, 1):
+                group = [e for e in devices[name] if e.kind() == kind and e.op == op]
+                if not group:
+                    continue
+
+                errors = sum(1 for e in group if e.result != 0)
+                kb = sum(e.length for e in group) // 1024
+                wait = [(e.issue - e.queue) / scale for e in group]
+                service = [(e.complete - e.issue) / scale for e in group]
+
+                line = '  %-6s %-5s %7u reqs %9u KB %5u errors' % (kind, OPS[op], len(group), kb, errors)
+
+                if kind == 'cache':
+                    hits = sum(1 for e in group if e.flags & FLAG_HIT)
+                    line += '  hit rate %5.1f%%' % (100.0 * hits / len(group))
+                elif kind == 'device':
+                    merged = sum(1 for e in group if e.flags & FLAG_MERGED)
+                    line += '  merged %u' % merged
+
+                print(line)
+
+                if kind == 'device':
+                    print('         queue wait %s: p50 %.1f p90 %.1f p99 %.1f max %.1f' %
+                          (unit, percentile(wait, 50), percentile(wait, 90),
+                           percentile(wait, 99), max(wait)))
+
+                print('         service    %s: p50 %.1f p90 %.1f p99 %.1f max %.1f' %
+                      (unit, percentile(service, 50), percentile(service, 90),
+                       percentile(service, 99), max(service)))
+
+
+def replay(events, scale, unit):
+    if not events:
+        return
+
+    start = min(e.queue for e in events)
+
+    print('%12s %-8s %-6s %-5s %12s %8s %10s %10s %s' %
+          ('time', 'device', 'kind', 'op', 'offset', 'length', 'wait', 'service', 'flags'))
+
+    for event in sorted(events, key=lambda e: e.queue):
+        flags = []
+        if event.flags & FLAG_HIT:
+            flags.append('hit')
+        if event.flags & FLAG_MISS:
+            flags.append('miss')
+        if event.flags & FLAG_MERGED:
+            flags.append('merged')
+        if event.result != 0:
+            flags.append('error %d' % event.result)
+
+        print('%12.1f %-8s %-6s %-5s %12u %8u %10.1f %10.1f %s' %
+              ((event.queue - start) / scale, event.device, event.kind(), OPS[event.op & 1],
+               event.offset, event.length, (event.issue - event.queue) / scale,
+               (event.complete - event.issue) / scale, ','.join(flags)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Analyse block I/O trace events')
+    parser.add_argument('trace', help='file saved from /dev/blktrace')
+    parser.add_argument('--mhz', type=float, help='CPU frequency used to convert cycles to microseconds')
+    parser.add_argument('--replay', action='store_true', help='print every event in time order')
+    args = parser.parse_args()
+
+    events = read_events(args.trace)
+
+    if args.mhz:
+        scale, unit = args.mhz, 'us'
+    else:
+        scale, unit = 1.0, 'cycles'
+
+    if args.replay:
+        replay(events, scale, unit)
+    else:
+        summary(events, scale, unit)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,295 @@
+/*
+ * htbench.c
+ *
+ *  Copyright 2012 James Cowgill
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Created on: 18 Oct 2012
+ *      Author: James
+ */
+
+//Hash table benchmark (runs on the host)
+// Compares the kernel hash table against the previous implementation (byte at a time
+// FNV hash with buckets selected by division) using the kinds of keys used in the kernel.
+//
+// Build and run from the root of the repository with:
+//  gcc -O2 -std=gnu99 -Ikernel/include -o htbench tools/htbench.c kernel/src/htable.c
+//  ./htbench [items]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "htable.h"
+
+//Memory allocation used by htable.c
+void * MemVirtualZAlloc(unsigned int bytes)
+{
+	return calloc(1, bytes);
+}
+
+void MemVirtualFree(void * ptr)
+{
+	free(ptr);
+}
+
+void * MemKZAlloc(unsigned int bytes)
+{
+	return calloc(1, bytes);
+}
+
+void MemKFree(void * ptr)
+{
+	free(ptr);
+}
+
+//Previous hash function
+static unsigned int LegacyHash(const void * keyPtr, unsigned int keyLen)
+{
+	const char * mem = keyPtr;
+	unsigned int hash = 2166136261;
+
+	while(keyLen-- > 0)
+	{
+		hash ^= *mem++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+//Previous lookup (on a table built with LegacyHash)
+static HashItem * LegacyFind(HashItem ** buckets, unsigned int bucketCount,
+		const void * keyPtr, unsigned int keyLen)
+{
+	HashItem * item = buckets[LegacyHash(keyPtr, keyLen) % bucketCount];
+
+	while(item)
+	{
+		if(item->keyLen == keyLen && memcmp(item->keyPtr, keyPtr, keyLen) == 0)
+		{
+			return item;
+		}
+
+		item = item->next;
+	}
+
+	return NULL;
+}
+
+//Benchmark item
+typedef struct Item
+{
+	HashItem hItem;
+	union
+	{
+		unsigned int pid;
+		unsigned long long offset;
+		char name[16];
+	} key;
+
+	unsigned int keyLen;
+
+} Item;
+
+static double Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Prints chain statistics of a bucket array
+static void PrintChains(const char * name, HashItem ** buckets, unsigned int bucketCount, unsigned int items)
+{
+	unsigned int used = 0, longest = 0;
+	unsigned long long probes = 0;
+
+	for(unsigned int i = 0; i < bucketCount; i++)
+	{
+		unsigned int length = 0;
+
+		for(HashItem * item = buckets[i]; item; item = item->next)
+		{
+			length++;
+		}
+
+		if(length > 0)
+		{
+			used++;
+		}
+
+		if(length > longest)
+		{
+			longest = length;
+		}
+
+		//Successful lookups in this chain compare 1 + 2 + ... + length keys
+		probes += (unsigned long long) length * (length + 1) / 2;
+	}
+
+	printf("  %-8s buckets %u, used %u (%.1f%%), longest chain %u, average probes %.3f\n",
+		name, bucketCount, used, 100.0 * used / bucketCount, longest, (double) probes / items);
+}
+
+//Times lookups of every item and prints the throughput
+static void PrintThroughput(const char * name, double seconds, unsigned int lookups)
+{
+	printf("  %-8s %.1f million lookups per second\n", name, lookups / seconds / 1e6);
+}
+
+static void Benchmark(const char * title, Item * items, unsigned int count)
+{
+	const unsigned int rounds = 20;
+	unsigned int found = 0;
+
+	//Lookups are done in a random order so the access pattern does not depend on how
+	// the keys were generated
+	Item ** order = malloc(count * sizeof(Item *));
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		unsigned int j = rand() % (i + 1);
+		order[i] = order[j];
+		order[j] = &items[i];
+	}
+
+	printf("%s (%u items)\n", title, count);
+
+	//Current implementation
+	HashTable table;
+	memset(&table, 0, sizeof(HashTable));
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		HashTableInsert(&table, &items[i].hItem, &items[i].key, items[i].keyLen);
+	}
+
+	//Finish the last resize
+	while(table.oldBuckets)
+	{
+		HashTableFind(&table, &items[0].key, items[0].keyLen);
+	}
+
+	double start = Now();
+	for(unsigned int r = 0; r < rounds; r++)
+	{
+		for(unsigned int i = 0; i < count; i++)
+		{
+			found += HashTableFind(&table, &order[i]->key, order[i]->keyLen) != NULL;
+		}
+	}
+	double current = Now() - start;
+
+	//Previous implementation (using the same number of buckets)
+	unsigned int bucketCount = table.bucketCount;
+	HashTableFree(&table);
+
+	HashItem ** buckets = calloc(bucketCount, sizeof(HashItem *));
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		HashItem * item = &items[i].hItem;
+		unsigned int bucketID = LegacyHash(&items[i].key, items[i].keyLen) % bucketCount;
+
+		item->keyPtr = &items[i].key;
+		item->keyLen = items[i].keyLen;
+		item->next = buckets[bucketID];
+		buckets[bucketID] = item;
+	}
+
+	start = Now();
+	for(unsigned int r = 0; r < rounds; r++)
+	{
+		for(unsigned int i = 0; i < count; i++)
+		{
+			found += LegacyFind(buckets, bucketCount, &order[i]->key, order[i]->keyLen) != NULL;
+		}
+	}
+	double legacy = Now() - start;
+
+	PrintChains("previous", buckets, bucketCount, count);
+	free(buckets);
+
+	//Rebuild current table to get its chains
+	memset(&table, 0, sizeof(HashTable));
+	HashTableReserve(&table, count);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		HashTableInsert(&table, &items[i].hItem, &items[i].key, items[i].keyLen);
+	}
+
+	while(table.oldBuckets)
+	{
+		HashTableFind(&table, &items[0].key, items[0].keyLen);
+	}
+
+	PrintChains("current", table.buckets, table.bucketCount, count);
+	HashTableFree(&table);
+
+	PrintThroughput("previous", legacy, count * rounds);
+	PrintThroughput("current", current, count * rounds);
+	free(order);
+
+	if(found != count * rounds * 2)
+	{
+		printf("  error: only %u of %u lookups succeeded\n", found, count * rounds * 2);
+		exit(1);
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	unsigned int count = 100000;
+
+	if(argc > 1)
+	{
+		count = strtoul(argv[1], NULL, 0);
+	}
+
+	Item * items = calloc(count, sizeof(Item));
+
+	//Process and thread ids
+	for(unsigned int i = 0; i < count; i++)
+	{
+		items[i].key.pid = i + 1;
+		items[i].keyLen = sizeof(unsigned int);
+	}
+
+	Benchmark("pids", items, count);
+
+	//Block offsets
+	memset(items, 0, count * sizeof(Item));
+	for(unsigned int i = 0; i < count; i++)
+	{
+		items[i].key.offset = (unsigned long long) i * 4096;
+		items[i].keyLen = sizeof(unsigned long long);
+	}
+
+	Benchmark("block offsets", items, count);
+
+	//Device names
+	memset(items, 0, count * sizeof(Item));
+	for(unsigned int i = 0; i < count; i++)
+	{
+		items[i].keyLen = snprintf(items[i].key.name, sizeof(items[i].key.name), "device%u", i);
+	}
+
+	Benchmark("names", items, count);
+
+	free(items);
+	return 0;
+}